@@ -22,6 +22,7 @@
 
 TEMPLATE = lib
 QT -= gui
+QT += dbus
 
 CONFIG += plugin
 
@@ -30,6 +31,8 @@ PKGCONFIG += mlocale5 libmkcal-qt5 libkcalcoren-qt5
 PKGCONFIG += Qt5Contacts
 DEFINES *= USING_QTPIM
 
+system(qdbusxml2cpp -c BirthdayAdaptor -a birthdayadaptor.h:birthdayadaptor.cpp com.nokia.contacts.birthdays.xml)
+
 CONFIG(coverage):{
 QMAKE_CXXFLAGS += -c -g  --coverage -ftest-coverage -fprofile-arcs
 LIBS += -lgcov
@@ -42,13 +45,21 @@ DEFINES += ENABLE_DEBUG
 
 HEADERS  = cdbirthdaycalendar.h \
     cdbirthdaycontroller.h \
-    cdbirthdayplugin.h
+    cdbirthdayplugin.h \
+    birthdayadaptor.h
 
 SOURCES  = cdbirthdaycalendar.cpp \
     cdbirthdaycontroller.cpp \
-    cdbirthdayplugin.cpp
+    cdbirthdayplugin.cpp \
+    birthdayadaptor.cpp
 
 TARGET = birthdayplugin
 target.path = $$LIBDIR/contactsd-1.0/plugins
 
-INSTALLS += target
+xml.files = com.nokia.contacts.birthdays.xml
+xml.path = $$INCLUDEDIR/contactsd-1.0
+
+INSTALLS += target xml
+
+OTHER_FILES += \
+    com.nokia.contacts.birthdays.xml
@@ -21,6 +21,7 @@
  ** conditions contained in a signed written agreement between you and Nokia.
  **/
 
+#include <QElapsedTimer>
 #include <QStringBuilder>
 
 #include <QContactName>
@@ -41,11 +42,19 @@ const QLatin1String calNotebookId("b1376da7-5555-1111-2222-227549c4e570");
 const QLatin1String calNotebookColor("#e00080"); // Pink
 const QString calIdExtension = QLatin1String("com.nokia.birthday/");
 
+static int dayKey(const QDate &date)
+{
+    // Orders dates by day of year regardless of leap years
+    return date.month() * 100 + date.day();
+}
+
 
 CDBirthdayCalendar::CDBirthdayCalendar(SyncMode syncMode, QObject *parent) :
     QObject(parent),
     mCalendar(0),
-    mStorage(0)
+    mStorage(0),
+    mIndexValid(false),
+    mUnsavedChanges(0)
 {
     mCalendar = mKCal::ExtendedCalendar::Ptr(new mKCal::ExtendedCalendar(KDateTime::Spec::LocalZone()));
     mStorage = mKCal::ExtendedCalendar::defaultStorage(mCalendar);
@@ -62,12 +71,16 @@ CDBirthdayCalendar::CDBirthdayCalendar(SyncMode syncMode, QObject *parent) :
     MLocale::setDefault(*locale);
 
     mStorage->open();
+    mStorage->registerObserver(this);
 
     mKCal::Notebook::Ptr notebook = mStorage->notebook(calNotebookId);
 
     if (notebook.isNull()) {
         notebook = createNotebook();
         mStorage->addNotebook(notebook);
+
+        // Nothing to load from a new notebook
+        mIndexValid = true;
     } else {
         // Clear the calendar database if and only if restoring from a backup.
         switch(syncMode) {
@@ -80,6 +93,7 @@ CDBirthdayCalendar::CDBirthdayCalendar(SyncMode syncMode, QObject *parent) :
             mStorage->deleteNotebook(notebook);
             notebook = createNotebook();
             mStorage->addNotebook(notebook);
+            mIndexValid = true;
             break;
         }
     }
@@ -88,6 +102,7 @@ CDBirthdayCalendar::CDBirthdayCalendar(SyncMode syncMode, QObject *parent) :
 CDBirthdayCalendar::~CDBirthdayCalendar()
 {
     if (mStorage) {
+        mStorage->unregisterObserver(this);
         mStorage->close();
     }
 
@@ -113,12 +128,116 @@ mKCal::Notebook::Ptr CDBirthdayCalendar::createNotebook()
 QHash<CDBirthdayCalendar::ContactIdType, CalendarBirthday>
 CDBirthdayCalendar::birthdays()
 {
-    if (not mStorage->loadNotebookIncidences(calNotebookId)) {
-        warning() << Q_FUNC_INFO << "Failed to load all incidences";
+    if (not ensureIndex()) {
         return QHash<ContactIdType, CalendarBirthday>();
     }
 
     QHash<ContactIdType, CalendarBirthday> result;
+    result.reserve(mIndex.count());
+
+    QHash<ContactIdType, IndexedBirthday>::ConstIterator it = mIndex.constBegin(), end = mIndex.constEnd();
+    for ( ; it != end; ++it) {
+        result.insert(it.key(), it->birthday);
+    }
+
+    return result;
+}
+
+QList<CDBirthdayCalendar::ContactIdType>
+CDBirthdayCalendar::contactIds()
+{
+    if (not ensureIndex()) {
+        return QList<ContactIdType>();
+    }
+
+    return mIndex.keys();
+}
+
+QList<CDBirthdayCalendar::ContactIdType>
+CDBirthdayCalendar::upcomingBirthdays(const QDate &from, int count)
+{
+    QList<ContactIdType> result;
+
+    if (count <= 0 || not from.isValid() || not ensureIndex()) {
+        return result;
+    }
+
+    // Walk one year of birthdays starting at the day of \a from, wrapping around
+    // to the start of the year. February 29th sorts right after February 28th,
+    // which is where it occurs in other than leap years.
+    const QMultiMap<int, ContactIdType>::ConstIterator begin = mUpcoming.constBegin(), end = mUpcoming.constEnd();
+    const QMultiMap<int, ContactIdType>::ConstIterator start = mUpcoming.lowerBound(dayKey(from));
+
+    QMultiMap<int, ContactIdType>::ConstIterator it = start;
+    for (int visited = 0; visited < mUpcoming.count() && result.count() < count; ++visited, ++it) {
+        if (it == end) {
+            it = begin;
+        }
+
+        // Events do not recur before the birth date itself
+        const QDate date = mIndex.value(*it).birthday.date();
+        if (nextOccurrence(date, from) >= date) {
+            result.append(*it);
+        }
+    }
+
+    return result;
+}
+
+QDate CDBirthdayCalendar::nextOccurrence(const QDate &birthday, const QDate &from)
+{
+    if (not birthday.isValid() || not from.isValid()) {
+        return QDate();
+    }
+
+    const int year = from.year() + (dayKey(birthday) < dayKey(from) ? 1 : 0);
+
+    // Same rules as the recurrence set up in updateBirthday(): February 29th
+    // birthdays occur on February 28th in other than leap years.
+    if (birthday.month() == 2 && birthday.day() == 29 && not QDate::isLeapYear(year)) {
+        return QDate(year, 2, 28);
+    }
+
+    return QDate(year, birthday.month(), birthday.day());
+}
+
+void CDBirthdayCalendar::indexBirthday(ContactIdType contactId, const KCalCore::Event::Ptr &event)
+{
+    unindexBirthday(contactId);
+
+    const IndexedBirthday indexed(event);
+    mIndex.insert(contactId, indexed);
+    mUpcoming.insert(dayKey(indexed.birthday.date()), contactId);
+}
+
+void CDBirthdayCalendar::unindexBirthday(ContactIdType contactId)
+{
+    QHash<ContactIdType, IndexedBirthday>::Iterator it = mIndex.find(contactId);
+    if (it != mIndex.end()) {
+        mUpcoming.remove(dayKey(it->birthday.date()), contactId);
+        mIndex.erase(it);
+    }
+}
+
+void CDBirthdayCalendar::clearIndex()
+{
+    mIndex.clear();
+    mUpcoming.clear();
+}
+
+bool CDBirthdayCalendar::ensureIndex()
+{
+    if (mIndexValid) {
+        return true;
+    }
+
+    // Load the notebook once; afterwards all lookups are served from memory
+    if (not mStorage->loadNotebookIncidences(calNotebookId)) {
+        warning() << Q_FUNC_INFO << "Failed to load all incidences";
+        return false;
+    }
+
+    clearIndex();
 
     foreach(const KCalCore::Event::Ptr event, mCalendar->events()) {
         const QString eventUid = event->uid();
@@ -129,13 +248,16 @@ CDBirthdayCalendar::birthdays()
 #else
         if (0 != contactId) {
 #endif
-            result.insert(contactId, CalendarBirthday(event->dtStart().date(), event->summary()));
+            indexBirthday(contactId, event);
         } else {
             warning() << Q_FUNC_INFO << "Birthday event with a bad uid: " << eventUid;
         }
     }
 
-    return result;
+    mIndexValid = true;
+
+    debug() << "Indexed" << mIndex.count() << "birthday events";
+    return true;
 }
 
 #ifdef USING_QTPIM
@@ -144,102 +266,86 @@ static QContactId contactId(const QContact &contact) { return contact.id(); }
 static QContactLocalId contactId(const QContact &contact) { return contact.localId(); }
 #endif
 
-void CDBirthdayCalendar::updateBirthday(const QContact &contact)
+bool CDBirthdayCalendar::updateBirthday(const QContact &contact)
 {
-    // Retrieve contact details.
-#ifdef USING_QTPIM
-    const QString displayLabel = contact.detail<QContactDisplayLabel>().label();
-#else
-    const QString displayLabel = contact.displayLabel();
-#endif
-    const QDate contactBirthday = contact.detail<QContactBirthday>().date();
+    return not updateBirthdays(QList<QContact>() << contact).isEmpty();
+}
 
-    if (displayLabel.isEmpty() || contactBirthday.isNull()) {
-        warning() << Q_FUNC_INFO << "Contact without name or birthday, local ID: "
-                  << contactId(contact);
-        return;
-    }
+namespace {
+
+// For birthdays on February 29th the event shall occur on the last day of
+// February. This is February 29th in leap years, and February 28th in all
+// other years.
+//
+// NOTE: Actually this recurrence pattern will fail badly for people born on
+// February 29th of the years 2100, 2200, 2300, 2500, ... - but I seriously
+// doubt we care.
+//
+// NOTE2: Using setByYearDays() instead of just setting proper start dates,
+// since libmkcal fails to store the start dates of recurrence rules.
+//
+// The rules only differ by their start date, so they are built once and
+// copied for each event.
+struct LeapDayRecurrence
+{
+    LeapDayRecurrence()
+    {
+        // 1. Include February 29th in leap years.
+        leapDay.setByYearDays(QList<int>() << 60); // Feb 29th
+        leapDay.setRecurrenceType(KCalCore::RecurrenceRule::rYearly);
+        leapDay.setFrequency(4); // every 4th year
 
-    // Retrieve birthday event.
-    if (not mStorage->isValidNotebook(calNotebookId)) {
-        warning() << Q_FUNC_INFO << "Invalid notebook ID: " << calNotebookId;
-        return;
+        // 2. Include February 28th starting from year after birth.
+        lastDay.setByYearDays(QList<int>() << 59); // Feb 28th
+        lastDay.setRecurrenceType(KCalCore::RecurrenceRule::rYearly);
+        lastDay.setFrequency(1); // every year
+
+        // 3. Exclude February 28th in leap years.
+        leapYearLastDay.setByYearDays(QList<int>() << 59); // Feb 28th
+        leapYearLastDay.setRecurrenceType(KCalCore::RecurrenceRule::rYearly);
+        leapYearLastDay.setFrequency(4); // every 4th year
     }
 
-    KCalCore::Event::Ptr event = calendarEvent(contactId(contact));
+    void apply(KCalCore::Recurrence *recurrence, const KDateTime &start) const
+    {
+        recurrence->addRRule(copy(leapDay, start));
+        recurrence->addRRule(copy(lastDay, start));
+        recurrence->addExRule(copy(leapYearLastDay, start));
+    }
 
-    if (event.isNull()) {
-        // Add a new event.
-        event = KCalCore::Event::Ptr(new KCalCore::Event());
-        event->startUpdates();
-        event->setUid(calendarEventId(contactId(contact)));
-        event->setAllDay(true);
-
-        // Ensure events appear as birthdays in the calendar, NB#259710.
-        event->setCategories(QStringList() << QLatin1String("BIRTHDAY"));
-
-        if (not mCalendar->addEvent(event, calNotebookId)) {
-            warning() << Q_FUNC_INFO << "Failed to add event to calendar";
-            return;
-        }
-    } else {
-        // Update the existing event.
-        event->setReadOnly(false);
-        event->startUpdates();
+    static KCalCore::RecurrenceRule *copy(const KCalCore::RecurrenceRule &rule, const KDateTime &start)
+    {
+        KCalCore::RecurrenceRule *rv = new KCalCore::RecurrenceRule(rule);
+        rv->setStartDt(start);
+        return rv;
     }
 
+    KCalCore::RecurrenceRule leapDay;
+    KCalCore::RecurrenceRule lastDay;
+    KCalCore::RecurrenceRule leapYearLastDay;
+};
+
+void setBirthdayDetails(const KCalCore::Event::Ptr &event, const QString &displayLabel, const QDate &birthday)
+{
+    static const LeapDayRecurrence leapDayRecurrence;
+
     // Transfer birthday details from contact to calendar event.
     event->setSummary(displayLabel);
 
     // Event has only date information, no time.
-    event->setDtStart(KDateTime(contactBirthday, QTime(), KDateTime::ClockTime));
-    event->setDtEnd(KDateTime(contactBirthday.addDays(1), QTime(), KDateTime::ClockTime));
+    event->setDtStart(KDateTime(birthday, QTime(), KDateTime::ClockTime));
+    event->setDtEnd(KDateTime(birthday.addDays(1), QTime(), KDateTime::ClockTime));
 
     // Must always set the recurrence as it depends on the event date.
     KCalCore::Recurrence *const recurrence = event->recurrence();
+    recurrence->clear();
 
-    if (contactBirthday.month() != 2 || contactBirthday.day() < 29) {
+    if (birthday.month() != 2 || birthday.day() < 29) {
         // Simply setup yearly recurrence for trivial dates.
         recurrence->setStartDateTime(event->dtStart());
         recurrence->setYearly(1); /* every year */
     } else {
-        // For birthdays on February 29th the event shall occur on the
-        // last day of February. This is February 29th in leap years,
-        // and February 28th in all other years.
-        //
-        // NOTE: Actually this recurrence pattern will fail badly for
-        // people born on February 29th of the years 2100, 2200, 2300,
-        // 2500, ... - but I seriously doubt we care.
-        //
-        // NOTE2: Using setByYearDays() instead of just setting proper
-        // start dates, since libmkcal fails to store the start dates
-        // of recurrence rules.
-        KCalCore::RecurrenceRule *rule;
-
-        // 1. Include February 29th in leap years.
-        rule = new KCalCore::RecurrenceRule;
-        rule->setStartDt(event->dtStart());
-        rule->setByYearDays(QList<int>() << 60); // Feb 29th
-        rule->setRecurrenceType(KCalCore::RecurrenceRule::rYearly);
-        rule->setFrequency(4); // every 4th year
-        recurrence->addRRule(rule);
-
-        // 2. Include February 28th starting from year after birth.
-        rule = new KCalCore::RecurrenceRule;
-        rule->setStartDt(event->dtStart());
-        rule->setByYearDays(QList<int>() << 59); // Feb 28th
-        rule->setRecurrenceType(KCalCore::RecurrenceRule::rYearly);
-        rule->setFrequency(1); // every year
-        recurrence->addRRule(rule);
-
-        // 3. Exclude February 28th in leap years.
-        rule = new KCalCore::RecurrenceRule;
-        rule->setStartDt(event->dtStart());
-        rule->setByYearDays(QList<int>() << 59); // Feb 28th
-        rule->setRecurrenceType(KCalCore::RecurrenceRule::rYearly);
-        rule->setFrequency(4); // every 4th year
-        recurrence->addExRule(rule);
-
+        leapDayRecurrence.apply(recurrence, event->dtStart());
     }
 
     // Set the alarms on the event
@@ -249,11 +355,73 @@ void CDBirthdayCalendar::updateBirthday(const QContact &contact)
     alarm->setEnabled(true);
     alarm->setDisplayAlarm(event->summary());
     alarm->setStartOffset(KCalCore::Duration(-36 * 3600 /* seconds */));
+}
+
+}
+
+QList<CDBirthdayCalendar::ContactIdType>
+CDBirthdayCalendar::updateBirthdays(const QList<QContact> &contacts)
+{
+    QList<ContactIdType> updated;
+
+    if (not mStorage->isValidNotebook(calNotebookId)) {
+        warning() << Q_FUNC_INFO << "Invalid notebook ID: " << calNotebookId;
+        return updated;
+    }
+
+    foreach (const QContact &contact, contacts) {
+        // Retrieve contact details.
+#ifdef USING_QTPIM
+        const QString displayLabel = contact.detail<QContactDisplayLabel>().label();
+#else
+        const QString displayLabel = contact.displayLabel();
+#endif
+        const QDate contactBirthday = contact.detail<QContactBirthday>().date();
+
+        if (displayLabel.isEmpty() || contactBirthday.isNull()) {
+            warning() << Q_FUNC_INFO << "Contact without name or birthday, local ID: "
+                      << contactId(contact);
+            continue;
+        }
+
+        // Retrieve birthday event.
+        KCalCore::Event::Ptr event = calendarEvent(contactId(contact));
+
+        if (event.isNull()) {
+            // Add a new event, complete before the calendar sees it.
+            event = KCalCore::Event::Ptr(new KCalCore::Event());
+            event->setUid(calendarEventId(contactId(contact)));
+            event->setAllDay(true);
+
+            // Ensure events appear as birthdays in the calendar, NB#259710.
+            event->setCategories(QStringList() << QLatin1String("BIRTHDAY"));
+
+            setBirthdayDetails(event, displayLabel, contactBirthday);
+            event->setReadOnly(true);
 
-    event->setReadOnly(true);
-    event->endUpdates();
+            if (not mCalendar->addEvent(event, calNotebookId)) {
+                warning() << Q_FUNC_INFO << "Failed to add event to calendar";
+                continue;
+            }
+        } else {
+            // Update the existing event.
+            event->setReadOnly(false);
+            event->startUpdates();
+
+            setBirthdayDetails(event, displayLabel, contactBirthday);
+
+            event->setReadOnly(true);
+            event->endUpdates();
+        }
+
+        indexBirthday(contactId(contact), event);
+        ++mUnsavedChanges;
+        updated.append(contactId(contact));
 
-    debug() << "Updated birthday event in calendar, local ID: " << contactId(contact);
+        debug() << "Updated birthday event in calendar, local ID: " << contactId(contact);
+    }
+
+    return updated;
 }
 
 void CDBirthdayCalendar::deleteBirthday(ContactIdType contactId)
@@ -266,26 +434,38 @@ void CDBirthdayCalendar::deleteBirthday(ContactIdType contactId)
     }
 
     mCalendar->deleteEvent(event);
+    unindexBirthday(contactId);
+    ++mUnsavedChanges;
 
     debug() << "Deleted birthday event in calendar, local ID: " << event->uid();
 }
 
-void CDBirthdayCalendar::save()
+bool CDBirthdayCalendar::save()
 {
+    if (mUnsavedChanges == 0) {
+        return true;
+    }
+
+    QElapsedTimer t;
+    t.start();
+
     if (not mStorage->save()) {
         warning() << Q_FUNC_INFO << "Failed to update birthdays in calendar";
+        return false;
     }
+
+    debug() << "Committed" << mUnsavedChanges << "birthday events - elapsed:" << t.elapsed();
+    mUnsavedChanges = 0;
+    return true;
 }
 
 CalendarBirthday CDBirthdayCalendar::birthday(ContactIdType contactId)
 {
-    KCalCore::Event::Ptr event = calendarEvent(contactId);
-
-    if (event.isNull()) {
+    if (not ensureIndex()) {
         return CalendarBirthday();
     }
 
-    return CalendarBirthday(event->dtStart().date(), event->summary());
+    return mIndex.value(contactId).birthday;
 }
 
 #ifdef USING_QTPIM
@@ -329,6 +509,11 @@ CDBirthdayCalendar::ContactIdType CDBirthdayCalendar::localContactId(const QStri
     return fromNumericContactId(numericId);
 }
 
+quint32 CDBirthdayCalendar::numericId(ContactIdType contactId)
+{
+    return numericContactId(contactId);
+}
+
 QString CDBirthdayCalendar::calendarEventId(ContactIdType contactId)
 {
     return calIdExtension + QString::number(numericContactId(contactId));
@@ -336,14 +521,12 @@ QString CDBirthdayCalendar::calendarEventId(ContactIdType contactId)
 
 KCalCore::Event::Ptr CDBirthdayCalendar::calendarEvent(ContactIdType contactId)
 {
-    const QString eventId = calendarEventId(contactId);
-
-    if (not mStorage->load(eventId)) {
+    if (not ensureIndex()) {
         warning() << Q_FUNC_INFO << "Unable to load event from calendar";
         return KCalCore::Event::Ptr();
     }
 
-    KCalCore::Event::Ptr event = mCalendar->event(eventId);
+    KCalCore::Event::Ptr event = mIndex.value(contactId).event;
 
     if (event.isNull()) {
         debug() << Q_FUNC_INFO << "Not found in calendar:" << contactId;
@@ -370,3 +553,48 @@ void CDBirthdayCalendar::onLocaleChanged()
         warning() << Q_FUNC_INFO << "Could not save calendar";
     }
 }
+
+void CDBirthdayCalendar::storageModified(mKCal::ExtendedStorage *storage, const QString &info)
+{
+    Q_UNUSED(storage);
+    Q_UNUSED(info);
+
+    // Not from within the storage's own notification
+    QMetaObject::invokeMethod(this, "onStorageModified", Qt::QueuedConnection);
+}
+
+void CDBirthdayCalendar::onStorageModified()
+{
+    // Another process changed the calendar. Changes not saved yet were made to the
+    // stale copy and must not be written over the external ones; drop them with it.
+    // The controller compares the reloaded calendar and writes them again.
+    const int droppedChanges = mUnsavedChanges;
+    debug() << "Birthday calendar modified externally, dropping" << droppedChanges
+            << "unsaved changes, index will be rebuilt";
+
+    if (droppedChanges > 0) {
+        // Reopening the storage forgets the incidences it was going to write
+        mStorage->close();
+        mStorage->open();
+        mUnsavedChanges = 0;
+    }
+
+    mCalendar->close();
+    clearIndex();
+    mIndexValid = false;
+
+    Q_EMIT modifiedExternally(droppedChanges);
+}
+
+void CDBirthdayCalendar::storageProgress(mKCal::ExtendedStorage *storage, const QString &info)
+{
+    Q_UNUSED(storage);
+    Q_UNUSED(info);
+}
+
+void CDBirthdayCalendar::storageFinished(mKCal::ExtendedStorage *storage, bool error, const QString &info)
+{
+    Q_UNUSED(storage);
+    Q_UNUSED(error);
+    Q_UNUSED(info);
+}
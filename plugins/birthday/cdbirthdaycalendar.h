@@ -27,6 +27,8 @@
 #include <QObject>
 #include <QContact>
 #include <QDate>
+#include <QHash>
+#include <QMultiMap>
 
 #include <extendedstorage.h>
 #include <extendedcalendar.h>
@@ -54,7 +56,7 @@ private:
 };
 
 
-class CDBirthdayCalendar : public QObject
+class CDBirthdayCalendar : public QObject, public mKCal::ExtendedStorageObserver
 {
     Q_OBJECT
 
@@ -75,31 +77,76 @@ public:
     ~CDBirthdayCalendar();
 
     //! Updates and saves Birthday of \a contact to calendar.
-    void updateBirthday(const QContact &contact);
+    bool updateBirthday(const QContact &contact);
+
+    //! Updates the birthdays of \a contacts in one pass; they are committed by the next save().
+    //! Returns the ids of the contacts whose events were written.
+    QList<ContactIdType> updateBirthdays(const QList<QContact> &contacts);
 
     //! Deletes \a contact birthday from calendar.
     void deleteBirthday(ContactIdType contactId);
 
     //! Actually save the events in the calendar database
-    void save();
+    bool save();
+
+    //! Number of event changes not yet saved.
+    int unsavedChanges() const { return mUnsavedChanges; }
 
     CalendarBirthday birthday(ContactIdType contactId);
     QHash<ContactIdType, CalendarBirthday> birthdays();
+    QList<ContactIdType> contactIds();
+
+    //! Returns up to \a count contacts ordered by their next birthday on or after \a from.
+    QList<ContactIdType> upcomingBirthdays(const QDate &from, int count);
+
+    //! Returns the first occurrence of \a birthday on or after \a from.
+    static QDate nextOccurrence(const QDate &birthday, const QDate &from);
+    static quint32 numericId(ContactIdType contactId);
+
+    // mKCal::ExtendedStorageObserver, whose methods are all pure virtual
+    void storageModified(mKCal::ExtendedStorage *storage, const QString &info);
+    void storageProgress(mKCal::ExtendedStorage *storage, const QString &info);
+    void storageFinished(mKCal::ExtendedStorage *storage, bool error, const QString &info);
 
 private:
+    struct IndexedBirthday
+    {
+        IndexedBirthday() {}
+        explicit IndexedBirthday(const KCalCore::Event::Ptr &event)
+        : birthday(event->dtStart().date(), event->summary()), event(event) {}
+
+        CalendarBirthday birthday;
+        KCalCore::Event::Ptr event;
+    };
+
     mKCal::Notebook::Ptr createNotebook();
 
+    bool ensureIndex();
+    void indexBirthday(ContactIdType contactId, const KCalCore::Event::Ptr &event);
+    void unindexBirthday(ContactIdType contactId);
+    void clearIndex();
+
     static ContactIdType localContactId(const QString &calendarEventId);
     static QString calendarEventId(ContactIdType contactId);
 
     KCalCore::Event::Ptr calendarEvent(ContactIdType contactId);
 
+Q_SIGNALS:
+    //! Another process changed the calendar database; \a droppedChanges changes not saved yet were lost.
+    void modifiedExternally(int droppedChanges);
+
 private Q_SLOTS:
     void onLocaleChanged();
+    void onStorageModified();
 
 private:
     mKCal::ExtendedCalendar::Ptr mCalendar;
     mKCal::ExtendedStorage::Ptr mStorage;
+    QHash<ContactIdType, IndexedBirthday> mIndex;
+    // Contacts keyed by the day of year of their birthday, see dayKey()
+    QMultiMap<int, ContactIdType> mUpcoming;
+    bool mIndexValid;
+    int mUnsavedChanges;
 };
 
 #endif // CDBIRTHDAYCALENDAR_H
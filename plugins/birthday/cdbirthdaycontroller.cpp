@@ -24,17 +24,34 @@
 #include "cdbirthdaycontroller.h"
 #include "cdbirthdaycalendar.h"
 #include "cdbirthdayplugin.h"
+#include "birthdayadaptor.h"
 #include "debug.h"
 
+#include <QDBusConnection>
+#include <QDBusError>
+
+#include <QCryptographicHash>
+#include <QDataStream>
 #include <QDir>
 #include <QFile>
+#include <QTemporaryFile>
+#include <QtEndian>
+
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
 
 #include <QContactBirthday>
 #include <QContactDetailFilter>
 #include <QContactFetchRequest>
+#include <QContactIntersectionFilter>
+#include <QContactUnionFilter>
 #ifdef USING_QTPIM
+#include <QContactIdFetchRequest>
 #include <QContactIdFilter>
 #else
+#include <QContactLocalIdFetchRequest>
 #include <QContactLocalIdFilter>
 #endif
 
@@ -46,14 +63,113 @@ QTM_USE_NAMESPACE
 
 using namespace Contactsd;
 
+namespace {
+
+#ifdef USING_QTPIM
+typedef QContactIdFetchRequest ContactIdFetchRequest;
+#else
+typedef QContactLocalIdFetchRequest ContactIdFetchRequest;
+#endif
+
+// Change signals arriving within this window are handled together
+const int UpdateTimeout = 500; // ms
+
+// Each save is a storage commit; never commit more often than this
+const int SaveInterval = 2000; // ms
+
+// Full syncs fetch and commit this many contacts at a time
+const int FullSyncPageSize = 250;
+
+const QLatin1String DBusObjectPath("/birthdays");
+
+const quint32 FingerprintsVersion = 2;
+
+QString displayLabel(const QContact &contact)
+{
+#ifdef USING_QTPIM
+    return contact.detail<QContactDisplayLabel>().label();
+#else
+    return contact.displayLabel();
+#endif
+}
+
+quint32 birthdayFingerprint(const QString &displayLabel, const QDate &date)
+{
+    // The calendar event depends on nothing else. Fingerprints are stored across
+    // restarts, so they must not depend on the per-process seed of qHash().
+    QCryptographicHash hash(QCryptographicHash::Md5);
+    hash.addData(displayLabel.toUtf8());
+    hash.addData(QByteArray::number(date.toJulianDay()));
+
+    const QByteArray digest = hash.result();
+    return qFromBigEndian<quint32>(reinterpret_cast<const uchar *>(digest.constData()));
+}
+
+QContactFetchHint birthdayFetchHint()
+{
+    // Only the details birthdayFingerprint() and the calendar event are built from.
+    // Contacts whose fingerprint matches are dropped right away, and the others are
+    // written from the same partial contacts, so nothing else is ever loaded.
+    QContactFetchHint fetchHint;
+#ifdef USING_QTPIM
+    static const QList<QContactDetail::DetailType> detailTypes = QList<QContactDetail::DetailType>()
+        << QContactBirthday::Type
+        << QContactDisplayLabel::Type;
+    fetchHint.setDetailTypesHint(detailTypes);
+#else
+    static const QStringList detailDefinitions = QStringList() << QContactBirthday::DefinitionName
+                                                               << QContactDisplayLabel::DefinitionName;
+    fetchHint.setDetailDefinitionsHint(detailDefinitions);
+#endif
+    fetchHint.setOptimizationHints(QContactFetchHint::NoRelationships |
+                                   QContactFetchHint::NoActionPreferences |
+                                   QContactFetchHint::NoBinaryBlobs);
+    return fetchHint;
+}
+
+QContactDetailFilter birthdayFilter()
+{
+    QContactDetailFilter filter;
+#ifdef USING_QTPIM
+    filter.setDetailType(QContactBirthday::Type);
+#else
+    filter.setDetailDefinitionName(QContactBirthday::DefinitionName);
+#endif
+    return filter;
+}
+
+QContactFilter idFilter(const QList<CDBirthdayController::ContactIdType> &contactIds)
+{
+#ifdef USING_QTPIM
+    QContactIdFilter filter;
+#else
+    QContactLocalIdFilter filter;
+#endif
+    filter.setIds(contactIds);
+    return filter;
+}
+
+}
+
 CDBirthdayController::CDBirthdayController(QObject *parent)
     : QObject(parent)
     , mCalendar(0)
     , mManager(0)
+    , mFingerprintsValid(false)
+    , mFingerprintsDirty(false)
+    , mSyncOffset(0)
+    , mSyncRunning(false)
+    , mSyncPending(false)
+    , mSyncByFingerprint(false)
+    , mSyncAborted(false)
 {
 #ifdef USING_QTPIM
-    // Temporary override until qtpim supports QTCONTACTS_MANAGER_OVERRIDE
-    mManager = new QContactManager(QStringLiteral("org.nemomobile.contacts.sqlite"), QMap<QString, QString>(), this);
+    // Temporary override until qtpim supports QTCONTACTS_MANAGER_OVERRIDE. Presence
+    // updates never affect a birthday; have the backend report them separately
+    // instead of as contactsChanged(), so presence storms cost us nothing.
+    QMap<QString, QString> parameters;
+    parameters.insert(QStringLiteral("mergePresenceChanges"), QStringLiteral("false"));
+    mManager = new QContactManager(QStringLiteral("org.nemomobile.contacts.sqlite"), parameters, this);
 #else
     mManager = new QContactManager(this);
 #endif
@@ -74,31 +190,155 @@ CDBirthdayController::CDBirthdayController(QObject *parent)
 #endif
     connect(mManager, SIGNAL(dataChanged()), SLOT(updateAllBirthdays()));
 
+    mUpdateTimer.setInterval(UpdateTimeout);
+    mUpdateTimer.setSingleShot(true);
+    connect(&mUpdateTimer, SIGNAL(timeout()), SLOT(onUpdateTimeout()));
+
+    mSaveTimer.setSingleShot(true);
+    connect(&mSaveTimer, SIGNAL(timeout()), SLOT(onSaveTimeout()));
+
     const CDBirthdayCalendar::SyncMode syncMode = stampFileExists() ? CDBirthdayCalendar::KeepOldDB :
                                                                       CDBirthdayCalendar::DropOldDB;
 
     mCalendar = new CDBirthdayCalendar(syncMode, this);
+    connect(mCalendar, SIGNAL(modifiedExternally(int)), SLOT(onCalendarModifiedExternally(int)));
+
+    if (CDBirthdayCalendar::KeepOldDB == syncMode) {
+        loadFingerprints();
+    } else {
+        dropFingerprints();
+    }
+
     updateAllBirthdays();
+
+    if (registerDBusObject()) {
+        (void) new BirthdayAdaptor(this);
+    }
 }
 
 CDBirthdayController::~CDBirthdayController()
 {
+    QDBusConnection::sessionBus().unregisterObject(DBusObjectPath);
+
+    // Flush anything still waiting for the next scheduled save
+    if (mSaveTimer.isActive()) {
+        mSaveTimer.stop();
+        saveCalendar();
+    }
 }
 
 void
 CDBirthdayController::contactsChanged(const QList<ContactIdType>& contacts)
 {
-    fetchContacts(contacts);
+    // Most changes (presence, avatars, ...) are irrelevant to us; collect them and
+    // find the ones that matter once the burst is over
+    foreach (const ContactIdType &id, contacts)
+        mPendingChanges.insert(id);
+
+    if (not mUpdateTimer.isActive()) {
+        mUpdateTimer.start();
+    }
 }
 
-#ifdef USING_QTPIM
-#else
-#endif
 void CDBirthdayController::contactsRemoved(const QList<ContactIdType>& contacts)
 {
-    foreach (const ContactIdType &id, contacts)
-        mCalendar->deleteBirthday(id);
-    mCalendar->save();
+    foreach (const ContactIdType &id, contacts) {
+        mPendingChanges.remove(id);
+        removeBirthday(id);
+    }
+    scheduleSave();
+}
+
+QVariantList CDBirthdayController::upcomingBirthdays(const QString &fromDate, uint count)
+{
+    QElapsedTimer t;
+    t.start();
+
+    const QDate from = fromDate.isEmpty() ? QDate::currentDate() : QDate::fromString(fromDate, Qt::ISODate);
+    if (not from.isValid()) {
+        warning() << Q_FUNC_INFO << "Invalid date:" << fromDate;
+        return QVariantList();
+    }
+
+    QVariantList result;
+
+    foreach (const ContactIdType &id, mCalendar->upcomingBirthdays(from, qMin<uint>(count, INT_MAX))) {
+        const CalendarBirthday birthday = mCalendar->birthday(id);
+
+        QVariantMap entry;
+        entry.insert(QLatin1String("contactId"), CDBirthdayCalendar::numericId(id));
+        entry.insert(QLatin1String("birthday"), birthday.date().toString(Qt::ISODate));
+        entry.insert(QLatin1String("nextOccurrence"), CDBirthdayCalendar::nextOccurrence(birthday.date(), from).toString(Qt::ISODate));
+        entry.insert(QLatin1String("displayLabel"), birthday.summary());
+        result.append(entry);
+    }
+
+    debug() << "Answered upcoming birthdays query with" << result.count() << "entries - elapsed:" << t.nsecsElapsed() / 1000 << "us";
+    return result;
+}
+
+bool CDBirthdayController::registerDBusObject()
+{
+    QDBusConnection connection = QDBusConnection::sessionBus();
+    if (not connection.isConnected()) {
+        warning() << "Could not connect to DBus:" << connection.lastError();
+        return false;
+    }
+
+    if (not connection.registerObject(DBusObjectPath, this)) {
+        warning() << "Could not register DBus object" << DBusObjectPath << ":" << connection.lastError();
+        return false;
+    }
+    return true;
+}
+
+void CDBirthdayController::onCalendarModifiedExternally(int droppedChanges)
+{
+    if (not mFingerprintsValid) {
+        // Only a full comparison with the calendar can tell what to write again
+        if (droppedChanges > 0) {
+            updateAllBirthdays();
+        }
+        return;
+    }
+
+    // The calendar rebuilds its index from the database; only the birthdays the
+    // other process changed stop matching their fingerprints
+    const QHash<ContactIdType, CalendarBirthday> birthdays = mCalendar->birthdays();
+    int dropped = 0;
+
+    QHash<ContactIdType, quint32>::Iterator it = mFingerprints.begin();
+    while (it != mFingerprints.end()) {
+        const QHash<ContactIdType, CalendarBirthday>::ConstIterator birthday = birthdays.constFind(it.key());
+        if (birthday == birthdays.constEnd() || *it != birthdayFingerprint(birthday->summary(), birthday->date())) {
+            it = mFingerprints.erase(it);
+            ++dropped;
+        } else {
+            ++it;
+        }
+    }
+
+    // Events we did not write still have to be reconciled, and removed when no
+    // contact matches them
+    int adopted = 0;
+    QHash<ContactIdType, CalendarBirthday>::ConstIterator birthday = birthdays.constBegin();
+    for ( ; birthday != birthdays.constEnd(); ++birthday) {
+        if (not mFingerprints.contains(birthday.key())) {
+            mFingerprints.insert(birthday.key(), birthdayFingerprint(birthday->summary(), birthday->date()));
+            ++adopted;
+        }
+    }
+
+    debug() << "Birthday calendar modified externally:" << dropped << "fingerprints dropped,"
+            << adopted << "events adopted";
+
+    if (dropped > 0 || adopted > 0) {
+        mFingerprintsDirty = true;
+
+        // Rewrite what differs now, including the changes dropped with the stale
+        // calendar, and remove the adopted events that have no contact
+        updateAllBirthdays();
+    }
 }
 
 
@@ -135,26 +375,289 @@ CDBirthdayController::stampFilePath() const
     return BasePlugin::cacheFileName(QLatin1String("calendar.stamp"));
 }
 
+QString
+CDBirthdayController::fingerprintFilePath() const
+{
+    return BasePlugin::cacheFileName(QLatin1String("calendar.fingerprints"));
+}
+
+void
+CDBirthdayController::loadFingerprints()
+{
+    QFile file(fingerprintFilePath());
+
+    if (not file.exists()) {
+        return;
+    }
+
+    if (not file.open(QIODevice::ReadOnly)) {
+        warning() << Q_FUNC_INFO << "Unable to open birthday fingerprints" << file.fileName()
+                                 << ":" << file.errorString();
+        return;
+    }
+
+    QDataStream stream(&file);
+    quint32 version = 0;
+    stream >> version;
+
+    if (version != FingerprintsVersion) {
+        debug() << "Ignoring birthday fingerprints of version" << version;
+        return;
+    }
+
+    stream >> mFingerprints;
+
+    if (stream.status() != QDataStream::Ok) {
+        warning() << Q_FUNC_INFO << "Corrupted birthday fingerprints" << file.fileName();
+        mFingerprints.clear();
+        return;
+    }
+
+    mFingerprintsValid = true;
+    debug() << "Loaded" << mFingerprints.count() << "birthday fingerprints";
+}
+
+void
+CDBirthdayController::saveFingerprints()
+{
+    if (not mFingerprintsValid) {
+        return;
+    }
+
+    const QString fileName = fingerprintFilePath();
+    QTemporaryFile tempFile(fileName);
+    tempFile.setAutoRemove(false);
+
+    if (not tempFile.open()) {
+        warning() << Q_FUNC_INFO << "Could not open file" << tempFile.fileName()
+                                 << "for writing:" << tempFile.errorString();
+        tempFile.setAutoRemove(true);
+        return;
+    }
+
+    QDataStream stream(&tempFile);
+    stream << FingerprintsVersion;
+    stream << mFingerprints;
+
+    const bool written = stream.status() == QDataStream::Ok;
+    tempFile.close();
+
+    if (not written || tempFile.error() != QFile::NoError) {
+        warning() << Q_FUNC_INFO << "Could not write birthday fingerprints:" << tempFile.errorString();
+        tempFile.setAutoRemove(true);
+        return;
+    }
+
+    if (::rename(tempFile.fileName().toLocal8Bit(), fileName.toLocal8Bit()) != 0) {
+        warning() << Q_FUNC_INFO << "Could not write birthday fingerprints:" << strerror(errno);
+        tempFile.setAutoRemove(true);
+        return;
+    }
+
+    mFingerprintsDirty = false;
+}
+
+void
+CDBirthdayController::dropFingerprints()
+{
+    mFingerprints.clear();
+    mFingerprintsValid = false;
+    mFingerprintsDirty = false;
+
+    if (mSyncRunning) {
+        // The running sync can no longer tell garbage from events it has not reached
+        mSyncAborted = true;
+    }
+
+    QFile::remove(fingerprintFilePath());
+}
+
+void
+CDBirthdayController::scheduleSave()
+{
+    if (mCalendar->unsavedChanges() == 0 && not mFingerprintsDirty) {
+        return;
+    }
+    if (mSaveTimer.isActive()) {
+        // Already scheduled; this change goes into the same commit
+        return;
+    }
+
+    const qint64 sinceLastSave = mLastSave.isValid() ? mLastSave.elapsed() : SaveInterval;
+    mSaveTimer.start(qMax<qint64>(0, SaveInterval - sinceLastSave));
+}
+
+void
+CDBirthdayController::onSaveTimeout()
+{
+    saveCalendar();
+}
+
+bool
+CDBirthdayController::saveCalendar()
+{
+    mLastSave.start();
+
+    if (not mCalendar->save()) {
+        // The calendar may not match the fingerprints anymore; compare it in full next time
+        dropFingerprints();
+        return false;
+    }
+
+    if (mFingerprintsDirty) {
+        saveFingerprints();
+    }
+
+    return true;
+}
+
 void
 CDBirthdayController::updateAllBirthdays()
 {
-    // Fetch any contact with a birthday.
-    QContactDetailFilter fetchFilter;
-#ifdef USING_QTPIM
-    fetchFilter.setDetailType(QContactBirthday::Type);
-#else
-    fetchFilter.setDetailDefinitionName(QContactBirthday::DefinitionName);
-#endif
+    if (mSyncRunning) {
+        // Start over once the running sync is done
+        mSyncPending = true;
+        return;
+    }
+
+    // Fetch the ids of any contact with a birthday; the contacts themselves are
+    // fetched and reconciled a page at a time.
+    ContactIdFetchRequest * const idRequest = new ContactIdFetchRequest(this);
+    idRequest->setManager(mManager);
+    idRequest->setFilter(birthdayFilter());
+
+    connect(idRequest, SIGNAL(stateChanged(QContactAbstractRequest::State)),
+            SLOT(onFullSyncIdsStateChanged(QContactAbstractRequest::State)));
+
+    if (not idRequest->start()) {
+        warning() << Q_FUNC_INFO << "Unable to start birthday contact id fetch request";
+        delete idRequest;
+        return;
+    }
+
+    mSyncRunning = true;
+    mSyncTimer.start();
+}
+
+void
+CDBirthdayController::onFullSyncIdsStateChanged(QContactAbstractRequest::State newState)
+{
+    ContactIdFetchRequest * const idRequest = qobject_cast<ContactIdFetchRequest*>(sender());
 
-    fetchContacts(fetchFilter, SLOT(onFullSyncRequestStateChanged(QContactAbstractRequest::State)));
+    if (idRequest == 0) {
+        warning() << Q_FUNC_INFO << "Invalid id fetch request";
+        return;
+    }
+    if (newState != QContactAbstractRequest::FinishedState && newState != QContactAbstractRequest::CanceledState) {
+        return;
+    }
+
+    idRequest->deleteLater();
+
+    if (newState == QContactAbstractRequest::CanceledState || idRequest->error() != QContactManager::NoError) {
+        warning() << Q_FUNC_INFO << "Error during birthday contact id fetch request, code: " << idRequest->error();
+        finishFullSync(false);
+        return;
+    }
+
+    mSyncIds = idRequest->ids();
+    qSort(mSyncIds);
+    mSyncOffset = 0;
+    mSyncedIds.clear();
+    mSyncedIds.reserve(mSyncIds.count());
+    mSyncAborted = false;
+
+    // Decide once for the whole sync, so that all pages are reconciled the same way
+    mSyncByFingerprint = mFingerprintsValid;
+    if (not mSyncByFingerprint) {
+        mFingerprints.clear();
+        mFingerprintsDirty = true;
+    }
+
+    debug() << "Full birthday sync of" << mSyncIds.count() << "contacts started"
+            << (mSyncByFingerprint ? "using fingerprints" : "against the calendar");
+
+    fetchNextSyncPage();
+}
+
+void
+CDBirthdayController::fetchNextSyncPage()
+{
+    if (mSyncOffset >= mSyncIds.count()) {
+        finishFullSync(true);
+        return;
+    }
+
+    const QList<ContactIdType> pageIds = mSyncIds.mid(mSyncOffset, FullSyncPageSize);
+    mSyncOffset += pageIds.count();
+
+    if (not fetchContacts(idFilter(pageIds), SLOT(onFullSyncRequestStateChanged(QContactAbstractRequest::State)))) {
+        finishFullSync(false);
+    }
 }
 
 void
 CDBirthdayController::onFullSyncRequestStateChanged(QContactAbstractRequest::State newState)
 {
-    if (processFetchRequest(qobject_cast<QContactFetchRequest*>(sender()), newState, FullSync)) {
+    if (newState != QContactAbstractRequest::FinishedState && newState != QContactAbstractRequest::CanceledState) {
+        return;
+    }
+
+    // Each page is committed before the next one is requested, so the main loop
+    // gets to run in between
+    if (processFetchRequest(qobject_cast<QContactFetchRequest*>(sender()), newState, FullSync)
+            && not mSyncAborted) {
+        fetchNextSyncPage();
+    } else {
+        finishFullSync(false);
+    }
+}
+
+void
+CDBirthdayController::finishFullSync(bool success)
+{
+    if (mSyncAborted) {
+        // A failed save dropped the fingerprints of the pages already synced; the next
+        // full sync compares against the calendar instead
+        warning() << Q_FUNC_INFO << "Birthday calendar could not be saved, full sync aborted";
+        success = false;
+    }
+
+    if (success) {
+        // Birthdays not matched by any contact are garbage
+        const QList<ContactIdType> knownIds = mSyncByFingerprint ? mFingerprints.keys() : mCalendar->contactIds();
+        int removed = 0;
+
+        foreach (const ContactIdType &id, knownIds) {
+            if (not mSyncedIds.contains(id)) {
+                debug() << "Birthday with contact id" << id << "no longer has a matching contact, trashing it";
+                removeBirthday(id);
+                ++removed;
+            }
+        }
+
+        mFingerprintsValid = true;
+        saveCalendar();
+
         // Create the stamp file only after a successful full sync.
         createStampFile();
+
+        debug() << "Full birthday sync of" << mSyncedIds.count() << "contacts finished," << removed
+                << "removed - elapsed:" << mSyncTimer.elapsed();
+    } else if (not mSyncByFingerprint) {
+        // Fingerprints were only partially rebuilt
+        dropFingerprints();
+    }
+
+    mSyncIds.clear();
+    mSyncedIds.clear();
+    mSyncOffset = 0;
+    mSyncRunning = false;
+    mSyncAborted = false;
+
+    if (mSyncPending) {
+        mSyncPending = false;
+        updateAllBirthdays();
     }
 }
 
@@ -163,14 +666,31 @@ CDBirthdayController::onFullSyncRequestStateChanged(QContactAbstractRequest::Sta
 ///////////////////////////////////////////////////////////////////////////////////////////////////
 
 void
-CDBirthdayController::fetchContacts(const QList<ContactIdType> &contactIds)
+CDBirthdayController::onUpdateTimeout()
 {
-#ifdef USING_QTPIM
-    QContactIdFilter fetchFilter;
-#else
-    QContactLocalIdFilter fetchFilter;
-#endif
-    fetchFilter.setIds(contactIds);
+    if (mPendingChanges.isEmpty()) {
+        return;
+    }
+
+    const QList<ContactIdType> changedIds = mPendingChanges.toList();
+    mPendingChanges.clear();
+
+    // Contacts with a calendar event may have lost their birthday or changed their label
+    QList<ContactIdType> knownIds;
+    foreach (const ContactIdType &id, changedIds) {
+        if (not mCalendar->birthday(id).date().isNull()) {
+            knownIds.append(id);
+        }
+    }
+
+    debug() << "Checking" << changedIds.count() << "changed contacts," << knownIds.count() << "with birthday events";
+
+    // Any other contact only matters if it has a birthday now, which the backend can
+    // tell us without returning anything for the rest
+    QContactFilter fetchFilter = idFilter(changedIds) & birthdayFilter();
+    if (not knownIds.isEmpty()) {
+        fetchFilter = fetchFilter | idFilter(knownIds);
+    }
 
     fetchContacts(fetchFilter, SLOT(onFetchRequestStateChanged(QContactAbstractRequest::State)));
 }
@@ -185,27 +705,12 @@ CDBirthdayController::onFetchRequestStateChanged(QContactAbstractRequest::State
 // Common sync logic
 ///////////////////////////////////////////////////////////////////////////////////////////////////
 
-void
+bool
 CDBirthdayController::fetchContacts(const QContactFilter &filter, const char *slot)
 {
-    QContactFetchHint fetchHint;
-#ifdef USING_QTPIM
-    static const QList<QContactDetail::DetailType> detailTypes = QList<QContactDetail::DetailType>() 
-        << QContactBirthday::Type
-        << QContactDisplayLabel::Type;
-    fetchHint.setDetailTypesHint(detailTypes);
-#else
-    static const QStringList detailDefinitions = QStringList() << QContactBirthday::DefinitionName
-                                                               << QContactDisplayLabel::DefinitionName;
-    fetchHint.setDetailDefinitionsHint(detailDefinitions);
-#endif
-    fetchHint.setOptimizationHints(QContactFetchHint::NoRelationships |
-                                   QContactFetchHint::NoActionPreferences |
-                                   QContactFetchHint::NoBinaryBlobs);
-
     QContactFetchRequest * const fetchRequest = new QContactFetchRequest(this);
     fetchRequest->setManager(mManager);
-    fetchRequest->setFetchHint(fetchHint);
+    fetchRequest->setFetchHint(birthdayFetchHint());
     fetchRequest->setFilter(filter);
 
     connect(fetchRequest, SIGNAL(stateChanged(QContactAbstractRequest::State)), slot);
@@ -213,10 +718,11 @@ CDBirthdayController::fetchContacts(const QContactFilter &filter, const char *sl
     if (not fetchRequest->start()) {
         warning() << Q_FUNC_INFO << "Unable to start birthday contact fetch request";
         delete fetchRequest;
-        return;
+        return false;
     }
 
     debug() << "Birthday contacts fetch request started";
+    return true;
 }
 
 bool
@@ -259,8 +765,15 @@ CDBirthdayController::processFetchRequest(QContactFetchRequest *const fetchReque
     }
 
     // Save the calendar in any case (success or not), since this "save" call
-    // also applies for the deleteBirthday() calls in processNotificationQueues()
-    mCalendar->save();
+    // also applies for the deleteBirthday() calls in processNotificationQueues().
+    // Saves are coalesced; nothing is committed if nothing changed. Full sync
+    // pages are committed right away to keep the pending changes bounded.
+    if (FullSync == syncMode) {
+        mSaveTimer.stop();
+        saveCalendar();
+    } else {
+        scheduleSave();
+    }
 
     // Provide hint we are done with this request.
     fetchRequest->deleteLater();
@@ -277,6 +790,8 @@ QContactLocalId apiId(const QContact &contact) { return contact.localId(); }
 void
 CDBirthdayController::updateBirthdays(const QList<QContact> &changedBirthdays)
 {
+    QList<QContact> changed;
+
     foreach (const QContact &contact, changedBirthdays) {
         const QContactBirthday contactBirthday = contact.detail<QContactBirthday>();
 #ifdef USING_QTPIM
@@ -290,7 +805,7 @@ CDBirthdayController::updateBirthdays(const QList<QContact> &changedBirthdays)
         if (contactDisplayLabel.isEmpty() || contactBirthday.date().isNull()) {
             debug() << "Contact: " << contact << " removed birthday or displayLabel, so delete the calendar event";
 
-            mCalendar->deleteBirthday(apiId(contact));
+            removeBirthday(apiId(contact));
         // Display label or birthdate was changed on the contact, so update the calendar.
         } else if ((contactDisplayLabel != calendarBirthday.summary()) ||
                    (contactBirthday.date() != calendarBirthday.date())) {
@@ -298,34 +813,68 @@ CDBirthdayController::updateBirthdays(const QList<QContact> &changedBirthdays)
                     << " and calendar displayLabel: " << calendarBirthday.summary()
                     << " changed details to: " << contact << ", so update the calendar event";
 
-            mCalendar->updateBirthday(contact);
+            changed.append(contact);
         }
     }
+
+    writeBirthdays(changed);
+}
+
+void
+CDBirthdayController::writeBirthdays(const QList<QContact> &contacts)
+{
+    if (contacts.isEmpty()) {
+        return;
+    }
+
+    // Fingerprints are only recorded for the events actually written
+    foreach (const ContactIdType &id, mCalendar->updateBirthdays(contacts)) {
+        const CalendarBirthday birthday = mCalendar->birthday(id);
+        mFingerprints.insert(id, birthdayFingerprint(birthday.summary(), birthday.date()));
+        mFingerprintsDirty = true;
+
+        if (mSyncRunning) {
+            // Added while a full sync is running; not garbage even if its page has passed
+            mSyncedIds.insert(id);
+        }
+    }
+}
+
+void
+CDBirthdayController::removeBirthday(const ContactIdType &contactId)
+{
+    mCalendar->deleteBirthday(contactId);
+
+    if (mFingerprints.remove(contactId)) {
+        mFingerprintsDirty = true;
+    }
 }
 
 void
 CDBirthdayController::syncBirthdays(const QList<QContact> &birthdayContacts)
 {
-    QHash<ContactIdType, CalendarBirthday> oldBirthdays = mCalendar->birthdays();
+    if (mSyncByFingerprint) {
+        resyncBirthdays(birthdayContacts);
+        return;
+    }
+
+    // Without fingerprints, compare against the calendar itself and record them as we go
+    QList<QContact> changed;
 
-    // Check all birthdays from the contacts if the stored calendar item is up-to-date
     foreach (const QContact &contact, birthdayContacts) {
-#ifdef USING_QTPIM
-        const QString contactDisplayLabel = contact.detail<QContactDisplayLabel>().label();
-#else
-        const QString contactDisplayLabel = contact.displayLabel();
-#endif
+        const QString contactDisplayLabel = displayLabel(contact);
 
         if (contactDisplayLabel.isNull()) {
             debug() << "Contact: " << contact << " has no displayLabel, so not syncing to calendar";
             continue;
         }
 
-        QHash<ContactIdType, CalendarBirthday>::Iterator it = oldBirthdays.find(apiId(contact));
+        const ContactIdType id = apiId(contact);
+        const CalendarBirthday calendarBirthday = mCalendar->birthday(id);
+        mSyncedIds.insert(id);
 
-        if (oldBirthdays.end() != it) {
+        if (not calendarBirthday.date().isNull()) {
             const QContactBirthday contactBirthday = contact.detail<QContactBirthday>();
-            const CalendarBirthday &calendarBirthday = *it;
 
             // Display label or birthdate was changed on the contact, so update the calendar.
             if ((contactDisplayLabel != calendarBirthday.summary()) ||
@@ -334,20 +883,45 @@ CDBirthdayController::syncBirthdays(const QList<QContact> &birthdayContacts)
                         << " and calendar displayLabel: " << calendarBirthday.summary()
                         << " changed details to: " << contact << ", so update the calendar event";
 
-                mCalendar->updateBirthday(contact);
+                changed.append(contact);
+            } else {
+                mFingerprints.insert(id, birthdayFingerprint(calendarBirthday.summary(), calendarBirthday.date()));
+                mFingerprintsDirty = true;
             }
-
-            // Birthday exists, so not a garbage one
-            oldBirthdays.erase(it);
         } else {
             // Create new birthday
-            mCalendar->updateBirthday(contact);
+            changed.append(contact);
         }
     }
 
-    // Remaining old birthdays in the calendar db do not did not match any contact, so remove them.
-    foreach (const ContactIdType &id, oldBirthdays.keys()) {
-        debug() << "Birthday with contact id" << id << "no longer has a matching contact, trashing it";
-        mCalendar->deleteBirthday(id);
+    writeBirthdays(changed);
+}
+
+void
+CDBirthdayController::resyncBirthdays(const QList<QContact> &birthdayContacts)
+{
+    // Only events whose fingerprint differs are touched; the calendar is not read at all
+    // when nothing changed
+    QList<QContact> changed;
+
+    foreach (const QContact &contact, birthdayContacts) {
+        const QString contactDisplayLabel = displayLabel(contact);
+        const QDate contactBirthday = contact.detail<QContactBirthday>().date();
+
+        if (contactDisplayLabel.isEmpty() || contactBirthday.isNull()) {
+            continue;
+        }
+
+        const ContactIdType id = apiId(contact);
+        mSyncedIds.insert(id);
+
+        QHash<ContactIdType, quint32>::ConstIterator it = mFingerprints.constFind(id);
+        if (it == mFingerprints.constEnd() || *it != birthdayFingerprint(contactDisplayLabel, contactBirthday)) {
+            changed.append(contact);
+        }
     }
+
+    writeBirthdays(changed);
+
+    debug() << "Resynced" << birthdayContacts.count() << "birthday contacts:" << changed.count() << "rewritten";
 }
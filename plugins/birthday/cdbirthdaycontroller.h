@@ -58,6 +58,10 @@ public:
     explicit CDBirthdayController(QObject *parent = 0);
     ~CDBirthdayController();
 
+public Q_SLOTS:
+    // com.nokia.contacts.birthdays
+    QVariantList upcomingBirthdays(const QString &fromDate, uint count);
+
 private Q_SLOTS:
 #ifdef USING_QTPIM
     void contactsChanged(const QList<QContactId> &contacts);
@@ -68,24 +72,56 @@ private Q_SLOTS:
 #endif
 
     void onFetchRequestStateChanged(QContactAbstractRequest::State newState);
+    void onFullSyncIdsStateChanged(QContactAbstractRequest::State newState);
     void onFullSyncRequestStateChanged(QContactAbstractRequest::State newState);
+    void onUpdateTimeout();
+    void onCalendarModifiedExternally(int droppedChanges);
+    void onSaveTimeout();
     void updateAllBirthdays();
 
 private:
+    bool registerDBusObject();
     bool stampFileExists();
     void createStampFile();
     QString stampFilePath() const;
+    QString fingerprintFilePath() const;
+    void loadFingerprints();
+    void saveFingerprints();
+    void dropFingerprints();
+    void scheduleSave();
+    bool saveCalendar();
+    void writeBirthdays(const QList<QContact> &contacts);
+    void removeBirthday(const ContactIdType &contactId);
     bool processFetchRequest(QContactFetchRequest * const fetchRequest,
                              QContactAbstractRequest::State newState,
                              SyncMode syncMode = Incremental);
-    void fetchContacts(const QList<ContactIdType> &contactIds);
-    void fetchContacts(const QContactFilter &filter, const char *slot);
+    bool fetchContacts(const QContactFilter &filter, const char *slot);
+    void fetchNextSyncPage();
+    void finishFullSync(bool success);
     void updateBirthdays(const QList<QContact> &changedBirthdays);
     void syncBirthdays(const QList<QContact> &birthdayContacts);
+    void resyncBirthdays(const QList<QContact> &birthdayContacts);
 
 private:
     CDBirthdayCalendar *mCalendar;
     QContactManager *mManager;
+    QSet<ContactIdType> mPendingChanges;
+    QTimer mUpdateTimer;
+    QTimer mSaveTimer;
+    QElapsedTimer mLastSave;
+    // Fingerprints of the birthdays written to the calendar, see birthdayFingerprint()
+    QHash<ContactIdType, quint32> mFingerprints;
+    bool mFingerprintsValid;
+    bool mFingerprintsDirty;
+    // State of the running paged full sync
+    QList<ContactIdType> mSyncIds;
+    QSet<ContactIdType> mSyncedIds;
+    int mSyncOffset;
+    bool mSyncRunning;
+    bool mSyncPending;
+    bool mSyncByFingerprint;
+    bool mSyncAborted;
+    QElapsedTimer mSyncTimer;
 };
 
 #endif // CDBIRTHDAYCONTROLLER_H
@@ -15,22 +15,77 @@
 
 #include "cdsimcontroller.h"
 #include "cdsimplugin.h"
+#include "base-plugin.h"
 #include "debug.h"
 
 #include <QContactDetailFilter>
 #include <QContactNickname>
 #include <QContactPhoneNumber>
 #include <QContactSyncTarget>
+#include <QContactUnionFilter>
 
 #include <QVersitContactImporter>
 
+#include <QCryptographicHash>
+#include <QDataStream>
+#include <QSaveFile>
+#include <QTextCodec>
+
 using namespace Contactsd;
 
+namespace {
+
+const quint32 SnapshotVersion = 1;
+
+// Number of vCard documents read and reconciled at a time
+const int ImportChunkSize = 50;
+
+QString normalizedNumber(const QContactPhoneNumber &phoneNumber)
+{
+    QStringList contexts;
+    foreach (int context, phoneNumber.contexts()) {
+        contexts.append(QString::number(context));
+    }
+    contexts.sort();
+
+    QStringList subTypes;
+    foreach (int subType, phoneNumber.subTypes()) {
+        subTypes.append(QString::number(subType));
+    }
+    subTypes.sort();
+
+    return phoneNumber.number() + QLatin1Char('|') + contexts.join(QStringLiteral(","))
+                                + QLatin1Char('|') + subTypes.join(QStringLiteral(","));
+}
+
+// The details of a SIM entry that are synced to the store, in a stable form
+QStringList normalizedEntry(const QContact &simContact)
+{
+    QStringList numbers;
+    foreach (const QContactPhoneNumber &phoneNumber, simContact.details<QContactPhoneNumber>()) {
+        numbers.append(normalizedNumber(phoneNumber));
+    }
+    numbers.sort();
+
+    return numbers;
+}
+
+}
+
 CDSimController::CDSimController(QObject *parent)
     : QObject(parent)
     // Temporary override until qtpim supports QTCONTACTS_MANAGER_OVERRIDE
     , m_manager(QStringLiteral("org.nemomobile.contacts.sqlite"))
     , m_simPresent(false)
+    , m_documentOffset(0)
+    , m_readerFinished(true)
+    , m_chunkPending(false)
+    , m_importing(false)
+    , m_removingObsolete(false)
+    , m_removalPending(false)
+    , m_hasSnapshot(false)
+    , m_snapshotPending(false)
+    , m_syncFailed(false)
     , m_busy(false)
 {
     m_fetchIdsRequest.setManager(&m_manager);
@@ -43,6 +98,12 @@ CDSimController::CDSimController(QObject *parent)
     connect(&m_phonebook, SIGNAL(importFailed()),
             this, SLOT(vcardReadFailed()));
 
+    // Phonebook data is passed to the reader as UTF-16, without conversion
+    m_contactReader.setDefaultCodec(QTextCodec::codecForName(QSysInfo::ByteOrder == QSysInfo::BigEndian ? "UTF-16BE" : "UTF-16LE"));
+
+    // Documents are reconciled in chunks while the reader is still producing them
+    connect(&m_contactReader, SIGNAL(resultsAvailable()),
+            this, SLOT(readerResultsAvailable()));
     connect(&m_contactReader, SIGNAL(stateChanged(QVersitReader::State)),
             this, SLOT(readerStateChanged(QVersitReader::State)));
 
@@ -71,6 +132,8 @@ CDSimController::CDSimController(QObject *parent)
     // Resync the contacts list whenever the SIM is inserted/removed
     connect(&m_simManager, SIGNAL(presenceChanged(bool)),
             this, SLOT(simPresenceChanged(bool)));
+    connect(&m_simManager, SIGNAL(cardIdentifierChanged(QString)),
+            this, SLOT(cardIdentifierChanged(QString)));
 }
 
 CDSimController::~CDSimController()
@@ -85,12 +148,6 @@ QContactManager &CDSimController::contactManager()
 void CDSimController::setSyncTarget(const QString &syncTarget)
 {
     m_syncTarget = syncTarget;
-
-    // Search for contacts with this syncTarget
-    QContactDetailFilter syncTargetFilter;
-    syncTargetFilter.setDetailType(QContactSyncTarget::Type, QContactSyncTarget::FieldSyncTarget);
-    syncTargetFilter.setValue(m_syncTarget);
-    m_fetchIdsRequest.setFilter(syncTargetFilter);
 }
 
 void CDSimController::setModemPath(const QString &path)
@@ -98,6 +155,7 @@ void CDSimController::setModemPath(const QString &path)
     qDebug() << "Using modem path:" << path;
     m_modemPath = path;
     m_simManager.setModemPath(m_modemPath);
+    m_cardIdentifier = m_simManager.cardIdentifier();
 
     // Sync the contacts list with the initial state
     simPresenceChanged(m_simManager.present());
@@ -129,31 +187,105 @@ void CDSimController::simPresenceChanged(bool present)
                 if (m_modemPath.isEmpty()) {
                     qWarning() << "No modem path is configured";
                 } else {
+                    // The import reconciles whatever a pending removal was for
+                    m_removalPending = false;
+
                     // Read all contacts from the SIM
                     m_phonebook.setModemPath(m_modemPath);
                     m_phonebook.beginImport();
                     setBusy(true);
                 }
             } else {
-                // Find any contacts that we need to remove
-                if (!m_fetchIdsRequest.isActive()) {
-                    m_contactIds.clear();
-                    m_contacts.clear();
-                    m_fetchIdsRequest.start();
-                    setBusy(true);
+                // Abandon any import in progress
+                m_importing = false;
+                m_removingObsolete = false;
+                m_snapshotPending = false;
+                m_chunkPending = false;
+                m_simContacts.clear();
+
+                if (!m_readerFinished) {
+                    // The phonebook data is released once the reader has stopped
+                    m_contactReader.cancel();
+                }
+
+                // A request of the import may still store SIM contacts; look for the
+                // contacts to remove only once all of them have stopped
+                QContactAbstractRequest *requests[] = { &m_fetchIdsRequest, &m_fetchRequest, &m_saveRequest, &m_removeRequest };
+                for (size_t i = 0; i < sizeof(requests) / sizeof(requests[0]); ++i) {
+                    if (requests[i]->isActive()) {
+                        requests[i]->cancel();
+                    }
                 }
+
+                m_removalPending = true;
+                setBusy(true);
+                startPendingRemoval();
             }
         }
     }
 }
 
+void CDSimController::cardIdentifierChanged(const QString &cardIdentifier)
+{
+    m_cardIdentifier = cardIdentifier;
+}
+
 void CDSimController::vcardDataAvailable(const QString &vcardData)
 {
-    // Create contact records from the SIM VCard data
-    m_simContacts.clear();
-    m_contactReader.setData(vcardData.toUtf8());
-    m_contactReader.startReading();
+    if (!m_readerFinished) {
+        // Start over once the reader has stopped reading the previous phonebook
+        m_importing = false;
+        m_queuedVcardData = vcardData;
+        m_contactReader.cancel();
+        setBusy(true);
+        return;
+    }
+
+    m_simHash = QCryptographicHash::hash(QByteArray::fromRawData(reinterpret_cast<const char *>(vcardData.constData()),
+                                                                 vcardData.size() * sizeof(QChar)),
+                                         QCryptographicHash::Sha1);
+
+    m_syncFailed = false;
+    m_snapshotPending = !m_cardIdentifier.isEmpty();
+    m_hasSnapshot = false;
+    m_snapshotEntries.clear();
+
+    QByteArray snapshotHash;
+    if (m_snapshotPending && loadSnapshot(&snapshotHash, &m_snapshotEntries)) {
+        if (snapshotHash == m_simHash) {
+            // This phonebook has already been synced to the store
+            qDebug() << "SIM phonebook unchanged for card:" << m_cardIdentifier;
+            m_snapshotPending = false;
+            m_snapshotEntries.clear();
+            setBusy(false);
+            return;
+        }
+
+        // Only the entries differing from the snapshot need to be compared with the store
+        m_hasSnapshot = true;
+    }
+
+    // Create contact records from the SIM VCard data, a chunk at a time as it is read.
+    // The reader decodes the UTF-16 data in place; m_vcardData keeps it alive until
+    // the reader is done with it
+    m_vcardData = vcardData;
+    m_documentOffset = 0;
+    m_readerFinished = false;
+    m_chunkPending = false;
+    m_simEntries.clear();
+    m_syncedIds.clear();
+    m_importing = true;
+    m_removingObsolete = false;
     setBusy(true);
+
+    m_contactReader.setData(QByteArray::fromRawData(reinterpret_cast<const char *>(m_vcardData.constData()),
+                                                    m_vcardData.size() * sizeof(QChar)));
+    if (!m_contactReader.startReading()) {
+        qWarning() << "Unable to read VCard data from SIM:" << m_contactReader.error();
+        m_readerFinished = true;
+        m_vcardData.clear();
+        failImport();
+    }
 }
 
 void CDSimController::vcardReadFailed()
@@ -162,28 +294,116 @@ void CDSimController::vcardReadFailed()
     setBusy(false);
 }
 
+void CDSimController::readerResultsAvailable()
+{
+    if (m_importing && !m_chunkPending) {
+        readNextChunk();
+    }
+}
+
 void CDSimController::readerStateChanged(QVersitReader::State state)
 {
-    if (state != QVersitReader::FinishedState)
+    if (state != QVersitReader::FinishedState && state != QVersitReader::CanceledState) {
         return;
+    }
 
-    QList<QVersitDocument> results = m_contactReader.results();
-    if (results.isEmpty()) {
-        qDebug() << "No contacts found in SIM";
-    } else {
-        QVersitContactImporter importer;
-        importer.importDocuments(results);
-        m_simContacts = importer.contacts();
-        if (m_simContacts.isEmpty()) {
-            qDebug() << "No contacts imported from SIM data";
+    // The reader no longer needs the phonebook data
+    m_readerFinished = true;
+    m_vcardData.clear();
+
+    if (!m_queuedVcardData.isNull()) {
+        const QString vcardData(m_queuedVcardData);
+        m_queuedVcardData = QString();
+        vcardDataAvailable(vcardData);
+        return;
+    }
+    if (!m_importing) {
+        // Abandoned meanwhile
+        return;
+    }
+
+    if (state == QVersitReader::CanceledState || m_contactReader.error() != QVersitReader::NoError) {
+        qWarning() << "Unable to read VCard data from SIM:" << m_contactReader.error();
+        failImport();
+    } else if (!m_chunkPending) {
+        readNextChunk();
+    }
+}
+
+void CDSimController::readNextChunk()
+{
+    while (m_importing) {
+        const QList<QVersitDocument> results(m_contactReader.results());
+        const int available = results.count() - m_documentOffset;
+
+        if (available <= 0 && m_readerFinished) {
+            // All entries have been reconciled; remove those no longer on the SIM
+            removeObsoleteSimContacts();
+            return;
+        }
+        if (available < ImportChunkSize && !m_readerFinished) {
+            // Continued once the reader has produced more documents
+            return;
+        }
+
+        const QList<QVersitDocument> documents(results.mid(m_documentOffset, ImportChunkSize));
+        m_documentOffset += documents.count();
+
+        if (reconcileChunk(documents)) {
+            // Continued once the chunk is stored
+            m_chunkPending = true;
+            return;
         }
     }
+}
 
-    // Fetch the set of SIM contact IDs
-    m_contactIds.clear();
-    m_contacts.clear();
-    m_fetchIdsRequest.start();
-    setBusy(true);
+void CDSimController::chunkReconciled()
+{
+    m_chunkPending = false;
+    readNextChunk();
+}
+
+void CDSimController::failImport()
+{
+    // Without the complete phonebook, obsolete contacts cannot be identified
+    m_syncFailed = true;
+    m_importing = false;
+    m_chunkPending = false;
+    finishSync();
+}
+
+bool CDSimController::reconcileChunk(const QList<QVersitDocument> &documents)
+{
+    QVersitContactImporter importer;
+    importer.importDocuments(documents);
+
+    m_simContacts.clear();
+    QSet<QString> nicknames;
+
+    foreach (const QContact &simContact, importer.contacts()) {
+        const QString label(simContact.detail<QContactDisplayLabel>().label());
+        const QStringList entry(normalizedEntry(simContact));
+        m_simEntries.insert(label, entry);
+
+        if (m_hasSnapshot) {
+            QMap<QString, QStringList>::const_iterator it = m_snapshotEntries.constFind(label);
+            if (it != m_snapshotEntries.constEnd() && *it == entry) {
+                // Unchanged since the last sync
+                continue;
+            }
+        }
+
+        m_simContacts.append(simContact);
+        nicknames.insert(label);
+    }
+
+    if (m_simContacts.isEmpty()) {
+        return false;
+    }
+
+    // Fetch the stored contacts for the entries of this chunk
+    fetchSimContactIds(nicknames);
+    return true;
 }
 
 void CDSimController::contactIdsAvailable()
@@ -196,36 +416,57 @@ void CDSimController::contactIdsAvailable()
 
 void CDSimController::requestStateChanged(QContactAbstractRequest::State state)
 {
-    if (state != QContactAbstractRequest::FinishedState)
+    if (state != QContactAbstractRequest::FinishedState && state != QContactAbstractRequest::CanceledState)
+        return;
+
+    if (m_removalPending) {
+        // Whatever this request did, the removal that follows covers it
+        startPendingRemoval();
+        return;
+    }
+    if (state == QContactAbstractRequest::CanceledState)
         return;
 
     QContactAbstractRequest *request = qobject_cast<QContactAbstractRequest *>(sender());
     if (request->error() != QContactManager::NoError) {
         qWarning() << "Error:" << request->error() << "from request:" << *request;
+        m_syncFailed = true;
     }
 
     if (request == &m_fetchIdsRequest) {
-        if (m_simPresent) {
-            if (!m_contactIds.isEmpty()) {
-                // Fetch the contact details so we can compare with the SIM contacts
-                m_fetchRequest.setIds(m_contactIds.toList());
-                m_fetchRequest.start();
-            } else {
-                ensureSimContactsPresent();
-            }
-        } else {
+        if (!m_simPresent) {
             removeAllSimContacts();
+        } else if (m_removingObsolete) {
+            removeUnsyncedSimContacts();
+        } else if (!m_contactIds.isEmpty()) {
+            // Fetch the contact details so we can compare with the SIM contacts
+            m_fetchRequest.setIds(m_contactIds.toList());
+            m_fetchRequest.start();
+        } else {
+            ensureSimContactsPresent();
         }
     } else if (request == &m_fetchRequest) {
+        // If the SIM was removed meanwhile, the removal has its own ID fetch
         if (m_simPresent) {
             // Compare the imported contacts with the SIM contacts
             ensureSimContactsPresent();
-        } else {
-            removeAllSimContacts();
         }
     } else {
+        if (request == &m_saveRequest) {
+            foreach (const QContact &contact, m_saveRequest.contacts()) {
+                if (!contact.id().isNull()) {
+                    m_syncedIds.insert(contact.id());
+                }
+            }
+        }
+
         if (!m_saveRequest.isActive() && !m_removeRequest.isActive()) {
-            setBusy(false);
+            if (m_importing) {
+                // Continue with the next chunk of the phonebook
+                chunkReconciled();
+            } else {
+                finishSync();
+            }
         }
     }
 }
@@ -235,8 +476,26 @@ void CDSimController::contactsAvailable()
     m_contacts.append(m_fetchRequest.contacts());
 }
 
+void CDSimController::startPendingRemoval()
+{
+    if (m_fetchIdsRequest.isActive() || m_fetchRequest.isActive()
+            || m_saveRequest.isActive() || m_removeRequest.isActive()) {
+        // Continued once the remaining requests have stopped
+        return;
+    }
+
+    m_removalPending = false;
+
+    // Find any contacts that we need to remove
+    fetchSimContactIds();
+}
+
 void CDSimController::removeAllSimContacts()
 {
+    // The store will no longer match any SIM
+    m_snapshotPending = false;
+    removeSnapshots();
+
     if (!m_contactIds.isEmpty()) {
         // Remove all SIM contacts from the store
         m_removeRequest.setContactIds(m_contactIds.toList());
@@ -246,9 +505,68 @@ void CDSimController::removeAllSimContacts()
     }
 }
 
+void CDSimController::removeObsoleteSimContacts()
+{
+    m_importing = false;
+    m_removingObsolete = true;
+
+    if (!m_hasSnapshot) {
+        // Any stored SIM contact not synced from this phonebook is obsolete
+        fetchSimContactIds();
+        return;
+    }
+
+    // Only the entries of the snapshot missing from this phonebook can be obsolete
+    QSet<QString> nicknames;
+    foreach (const QString &nickname, m_snapshotEntries.keys()) {
+        if (!m_simEntries.contains(nickname)) {
+            nicknames.insert(nickname);
+        }
+    }
+
+    if (nicknames.isEmpty()) {
+        finishSync();
+    } else {
+        fetchSimContactIds(nicknames);
+    }
+}
+
+void CDSimController::removeUnsyncedSimContacts()
+{
+    QList<QContactId> obsoleteIds;
+    foreach (const QContactId &id, m_contactIds) {
+        if (!m_syncedIds.contains(id)) {
+            obsoleteIds.append(id);
+        }
+    }
+
+    if (obsoleteIds.isEmpty()) {
+        finishSync();
+    } else {
+        // Remove any imported contacts no longer on the SIM
+        m_removeRequest.setContactIds(obsoleteIds);
+        m_removeRequest.start();
+    }
+}
+
+void CDSimController::finishSync()
+{
+    m_removingObsolete = false;
+    m_simContacts.clear();
+    m_contacts.clear();
+    m_syncedIds.clear();
+    m_snapshotEntries.clear();
+
+    if (m_snapshotPending) {
+        saveSnapshot();
+    }
+
+    setBusy(false);
+}
+
 void CDSimController::ensureSimContactsPresent()
 {
-    // Ensure all contacts from the SIM are present in the store
+    // Ensure all contacts from this chunk of the SIM are present in the store
 
     QMap<QString, QContact> existingContacts;
     foreach (const QContact &contact, m_contacts) {
@@ -312,6 +630,7 @@ void CDSimController::ensureSimContactsPresent()
                 importContacts.append(dbContact);
             }
 
+            m_syncedIds.insert(dbContact.id());
             existingContacts.erase(it);
         } else {
             // We need to import this contact
@@ -331,23 +650,102 @@ void CDSimController::ensureSimContactsPresent()
         }
     }
 
+    m_simContacts.clear();
+    m_contacts.clear();
+
     if (!importContacts.isEmpty()) {
         // Import any contacts not currently present
         m_saveRequest.setContacts(importContacts);
         m_saveRequest.start();
+    } else {
+        chunkReconciled();
     }
+}
 
-    if (!existingContacts.isEmpty()) {
-        // Remove any imported contacts no longer on the SIM
-        QList<QContactId> obsoleteIds;
-        foreach (const QContact &contact, existingContacts.values()) {
-            obsoleteIds.append(contact.id());
+void CDSimController::fetchSimContactIds(const QSet<QString> &nicknames)
+{
+    // Search for contacts with this syncTarget
+    QContactDetailFilter syncTargetFilter;
+    syncTargetFilter.setDetailType(QContactSyncTarget::Type, QContactSyncTarget::FieldSyncTarget);
+    syncTargetFilter.setValue(m_syncTarget);
+
+    if (nicknames.isEmpty()) {
+        m_fetchIdsRequest.setFilter(syncTargetFilter);
+    } else {
+        // Limit the search to the named SIM entries
+        QContactUnionFilter nicknameFilter;
+        foreach (const QString &nickname, nicknames) {
+            QContactDetailFilter filter;
+            filter.setDetailType(QContactNickname::Type, QContactNickname::FieldNickname);
+            filter.setValue(nickname);
+            filter.setMatchFlags(QContactFilter::MatchExactly);
+            nicknameFilter.append(filter);
         }
 
-        m_removeRequest.setContactIds(obsoleteIds);
-        m_removeRequest.start();
+        m_fetchIdsRequest.setFilter(syncTargetFilter & nicknameFilter);
     }
 
-    setBusy(!importContacts.isEmpty() || !existingContacts.isEmpty());
+    m_contactIds.clear();
+    m_contacts.clear();
+    m_fetchIdsRequest.start();
+    setBusy(true);
+}
+
+QString CDSimController::snapshotFilePath() const
+{
+    return BasePlugin::cacheFileName(QStringLiteral("sim-%1.snapshot").arg(m_cardIdentifier));
+}
+
+bool CDSimController::loadSnapshot(QByteArray *hash, QMap<QString, QStringList> *entries) const
+{
+    QFile file(snapshotFilePath());
+    if (!file.open(QIODevice::ReadOnly)) {
+        return false;
+    }
+
+    QDataStream stream(&file);
+
+    quint32 version = 0;
+    stream >> version;
+    if (version != SnapshotVersion) {
+        qWarning() << "Ignoring SIM snapshot with unsupported version:" << version;
+        return false;
+    }
+
+    stream >> *hash >> *entries;
+    return stream.status() == QDataStream::Ok;
+}
+
+void CDSimController::saveSnapshot()
+{
+    m_snapshotPending = false;
+
+    if (m_syncFailed || m_cardIdentifier.isEmpty()) {
+        return;
+    }
+
+    // The store holds the contacts of one SIM at a time
+    removeSnapshots();
+
+    QSaveFile file(snapshotFilePath());
+    if (!file.open(QIODevice::WriteOnly)) {
+        qWarning() << "Unable to write SIM snapshot:" << file.errorString();
+        return;
+    }
+
+    QDataStream stream(&file);
+    stream << SnapshotVersion << m_simHash << m_simEntries;
+
+    if (!file.commit()) {
+        qWarning() << "Unable to write SIM snapshot:" << file.errorString();
+    }
+}
+
+void CDSimController::removeSnapshots()
+{
+    QDir cacheDir(BasePlugin::cacheDir());
+    foreach (const QString &fileName, cacheDir.entryList(QStringList() << QStringLiteral("sim-*.snapshot"), QDir::Files)) {
+        cacheDir.remove(fileName);
+    }
 }
 
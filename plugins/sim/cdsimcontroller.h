@@ -57,17 +57,33 @@ Q_SIGNALS:
 
 public Q_SLOTS:
     void simPresenceChanged(bool present);
+    void cardIdentifierChanged(const QString &cardIdentifier);
     void vcardDataAvailable(const QString &vcardData);
     void vcardReadFailed();
-    void readerStateChanged(QVersitReader::State state);
     void contactIdsAvailable();
     void requestStateChanged(QContactAbstractRequest::State state);
     void contactsAvailable();
+    void readerResultsAvailable();
+    void readerStateChanged(QVersitReader::State state);
 
 private:
     void setBusy(bool busy);
+    void readNextChunk();
+    bool reconcileChunk(const QList<QVersitDocument> &documents);
+    void chunkReconciled();
+    void failImport();
+    void startPendingRemoval();
     void removeAllSimContacts();
+    void removeObsoleteSimContacts();
+    void removeUnsyncedSimContacts();
+    void finishSync();
     void ensureSimContactsPresent();
+    void fetchSimContactIds(const QSet<QString> &nicknames = QSet<QString>());
+
+    QString snapshotFilePath() const;
+    bool loadSnapshot(QByteArray *hash, QMap<QString, QStringList> *entries) const;
+    void saveSnapshot();
+    void removeSnapshots();
 
 private:
     QContactManager m_manager;
@@ -80,6 +96,7 @@ private:
 
     QOfonoSimManager m_simManager;
     bool m_simPresent;
+    QString m_cardIdentifier;
 
     QString m_syncTarget;
     QString m_modemPath;
@@ -87,7 +104,26 @@ private:
 
     QSet<QContactId> m_contactIds;
     QList<QContact> m_contacts;
+    // The phonebook being read, the documents of it already reconciled, and the
+    // contacts of the chunk being reconciled
+    QString m_vcardData;
+    QString m_queuedVcardData;
+    int m_documentOffset;
+    bool m_readerFinished;
+    bool m_chunkPending;
     QList<QContact> m_simContacts;
+    QSet<QContactId> m_syncedIds;
+    bool m_importing;
+    bool m_removingObsolete;
+    bool m_removalPending;
+    // Content hash and normalized entries of the phonebook being synced,
+    // persisted per ICCID once the store matches them
+    QByteArray m_simHash;
+    QMap<QString, QStringList> m_simEntries;
+    QMap<QString, QStringList> m_snapshotEntries;
+    bool m_hasSnapshot;
+    bool m_snapshotPending;
+    bool m_syncFailed;
     bool m_busy;
 };
 
@@ -21,6 +21,7 @@
  ** conditions contained in a signed written agreement between you and Nokia.
  **/
 
+#include <TelepathyQt/AvatarData>
 #include <TelepathyQt/ContactManager>
 #include <TelepathyQt/PendingContacts>
 #include <TelepathyQt/PendingOperation>
@@ -35,12 +36,25 @@
 
 static const int DisconnectGracePeriod = 30 * 1000; // ms
 
+// Contacts are upgraded to the expensive features by batches of this size
+static const int UpgradeBatchSize = 100;
+
+// Cached ContactInfo older than this is refreshed when the roster comes in
+static const int InfoRefreshAge = 7; // days
+
+// Visibility changes arriving within this window are reported together
+static const int VisibilityBatchTimeout = 100; // ms
+
 using namespace Contactsd;
 
-CDTpAccount::CDTpAccount(const Tp::AccountPtr &account, const QStringList &toAvoid, bool newAccount, QObject *parent)
+CDTpAccount::CDTpAccount(const Tp::AccountPtr &account, const QSet<QString> &toAvoid, bool newAccount, QObject *parent)
     : QObject(parent),
       mAccount(account),
+      mAccountPath(account->objectPath()),
       mContactsToAvoid(toAvoid),
+      mUpgradedContacts(0),
+      mUpgradeBatches(0),
+      mUpgrading(false),
       mHasRoster(false),
       mNewAccount(newAccount),
       mImporting(false)
@@ -76,6 +90,11 @@ CDTpAccount::CDTpAccount(const Tp::AccountPtr &account, const QStringList &toAvo
     mDisconnectTimeout.setSingleShot(true);
 
     connect(&mDisconnectTimeout, SIGNAL(timeout()), SLOT(onDisconnectTimeout()));
+
+    mVisibilityTimer.setInterval(VisibilityBatchTimeout);
+    mVisibilityTimer.setSingleShot(true);
+
+    connect(&mVisibilityTimer, SIGNAL(timeout()), SLOT(onVisibilityTimeout()));
 }
 
 CDTpAccount::~CDTpAccount()
@@ -118,7 +137,7 @@ QHash<QString, CDTpContact::Changes> CDTpAccount::rosterChanges() const
             continue;
         }
 
-        changes.insert(contactId, contact->info().diff(*it));
+        changes.insert(contactId, contactInfo(contact).diff(*it));
     }
 
     cachedAddresses.subtract(currentAddresses);
@@ -132,12 +151,13 @@ QHash<QString, CDTpContact::Changes> CDTpAccount::rosterChanges() const
     return changes;
 }
 
-void CDTpAccount::setContactsToAvoid(const QStringList &contactIds)
+void CDTpAccount::setContactsToAvoid(const QSet<QString> &contactIds)
 {
     mContactsToAvoid = contactIds;
     Q_FOREACH (const QString &id, contactIds) {
         CDTpContactPtr contactWrapper = mContacts.take(id);
         if (contactWrapper) {
+            mVisibilityChanges.remove(contactWrapper);
             contactWrapper->setRemoved(true);
         }
     }
@@ -210,6 +230,9 @@ void CDTpAccount::setConnection(const Tp::ConnectionPtr &connection)
     }
 
     mContacts.clear();
+    mUpgradeQueue.clear();
+    mVisibilityChanges.clear();
+    mVisibilityTimer.stop();
     mHasRoster = false;
     mCurrentConnection = connection;
 
@@ -285,15 +308,28 @@ void CDTpAccount::setContactManager(const Tp::ContactManagerPtr &contactManager)
             SIGNAL(allKnownContactsChanged(const Tp::Contacts &, const Tp::Contacts &, const Tp::Channel::GroupMemberChangeDetails &)),
             SLOT(onAllKnownContactsChanged(const Tp::Contacts &, const Tp::Contacts &)));
 
+    // Only the contacts we know nothing about yet, or whose cached avatar or
+    // info is outdated, are upgraded to the expensive features; the others are
+    // served from the roster cache
+    const QDateTime infoRefreshLimit = QDateTime::currentDateTimeUtc().addDays(-InfoRefreshAge);
     Q_FOREACH (const Tp::ContactPtr &contact, contactManager->allKnownContacts()) {
         if (mContactsToAvoid.contains(contact->id())) {
             continue;
         }
         insertContact(contact);
-        if (mNewAccount) {
-            maybeRequestExtraInfo(contact);
+
+        const QHash<QString, CDTpContact::Info>::ConstIterator it = mRosterCache.find(contact->id());
+        if (mNewAccount || it == mRosterCache.constEnd() || !it->isContactInfoKnown()
+         || (contact->isAvatarTokenKnown() && contact->avatarToken() != it->avatarToken())
+         || !it->infoTimestamp().isValid() || it->infoTimestamp() < infoRefreshLimit) {
+            mUpgradeQueue.insert(contact);
         }
     }
+
+    debug() << "Account" << mAccount->objectPath() << "-" << mContacts.count() << "contacts,"
+            << mUpgradeQueue.count() << "to upgrade";
+
+    startUpgrade();
 }
 
 void CDTpAccount::emitSyncEnded(int contactsAdded, int contactsRemoved)
@@ -330,7 +366,7 @@ void CDTpAccount::onAllKnownContactsChanged(const Tp::Contacts &contactsAdded,
         if (mContactsToAvoid.contains(contact->id())) {
             continue;
         }
-        maybeRequestExtraInfo(contact);
+        mUpgradeQueue.insert(contact);
         CDTpContactPtr contactWrapper = insertContact(contact);
         if (contactWrapper->isVisible()) {
             added << contactWrapper;
@@ -349,12 +385,15 @@ void CDTpAccount::onAllKnownContactsChanged(const Tp::Contacts &contactsAdded,
         if (contactWrapper->isVisible()) {
             removed << contactWrapper;
         }
+        mVisibilityChanges.remove(contactWrapper);
         contactWrapper->setRemoved(true);
     }
 
     if (!added.isEmpty() || !removed.isEmpty()) {
         Q_EMIT rosterUpdated(CDTpAccountPtr(this), added, removed);
     }
+
+    startUpgrade();
 }
 
 void CDTpAccount::onAccountContactChanged(CDTpContactPtr contactWrapper,
@@ -362,18 +401,16 @@ void CDTpAccount::onAccountContactChanged(CDTpContactPtr contactWrapper,
 {
     if ((changes & CDTpContact::Visibility) != 0) {
         // Visibility of this contact changed. Transform this update operation
-        // to an add/remove operation
+        // to an add/remove operation, batched with the other contacts whose
+        // visibility changes shortly after, e.g. during a block list import
         debug() << "Visibility changed for contact" << contactWrapper->contact()->id();
 
-        QList<CDTpContactPtr> added;
-        QList<CDTpContactPtr> removed;
-        if (contactWrapper->isVisible()) {
-            added << contactWrapper;
-        } else {
-            removed << contactWrapper;
+        if (!mVisibilityChanges.contains(contactWrapper)) {
+            mVisibilityChanges.insert(contactWrapper, !contactWrapper->isVisible());
+        }
+        if (!mVisibilityTimer.isActive()) {
+            mVisibilityTimer.start();
         }
-
-        Q_EMIT rosterUpdated(CDTpAccountPtr(this), added, removed);
 
         return;
     }
@@ -384,6 +421,37 @@ void CDTpAccount::onAccountContactChanged(CDTpContactPtr contactWrapper,
     }
 }
 
+void CDTpAccount::onVisibilityTimeout()
+{
+    QList<CDTpContactPtr> added;
+    QList<CDTpContactPtr> removed;
+
+    QHash<CDTpContactPtr, bool>::ConstIterator it = mVisibilityChanges.constBegin(), end = mVisibilityChanges.constEnd();
+    for ( ; it != end; ++it) {
+        const CDTpContactPtr &contactWrapper(it.key());
+
+        // Removed contacts were already reported with the roster change, and
+        // contacts flipping back within the window have nothing to report
+        if (contactWrapper->isRemoved() || contactWrapper->isVisible() == it.value()) {
+            continue;
+        }
+        if (contactWrapper->isVisible()) {
+            added << contactWrapper;
+        } else {
+            removed << contactWrapper;
+        }
+    }
+
+    mVisibilityChanges.clear();
+
+    debug() << "Account" << mAccount->objectPath() << "visibility changes:"
+            << added.count() << "contacts added," << removed.count() << "removed";
+
+    if (!added.isEmpty() || !removed.isEmpty()) {
+        Q_EMIT rosterUpdated(CDTpAccountPtr(this), added, removed);
+    }
+}
+
 CDTpContactPtr CDTpAccount::insertContact(const Tp::ContactPtr &contact)
 {
     debug() << "  creating wrapper for contact" << contact->id();
@@ -392,6 +460,14 @@ CDTpContactPtr CDTpAccount::insertContact(const Tp::ContactPtr &contact)
     connect(contactWrapper.data(),
             SIGNAL(changed(CDTpContactPtr, CDTpContact::Changes)),
             SLOT(onAccountContactChanged(CDTpContactPtr, CDTpContact::Changes)));
+
+    // The cached info is what was stored for this contact last time, so it
+    // can be used to avoid rewriting unchanged info fields
+    const QHash<QString, CDTpContact::Info>::ConstIterator it = mRosterCache.find(contact->id());
+    if (it != mRosterCache.constEnd() && it->isContactInfoKnown()) {
+        contactWrapper->setAppliedInfoFingerprints(CDTpContact::infoFingerprints(it->infoFields()));
+    }
+
     mContacts.insert(contact->id(), contactWrapper);
     return contactWrapper;
 }
@@ -408,13 +484,108 @@ void CDTpAccount::maybeRequestExtraInfo(Tp::ContactPtr contact)
     }
 }
 
+Tp::Features CDTpAccount::upgradeFeatures()
+{
+    return Tp::Features() << Tp::Contact::FeatureAvatarData
+                          << Tp::Contact::FeatureInfo;
+}
+
+/* Queue a contact for upgrade to the features left out of the contact
+ * factory, which cost a lot of D-Bus traffic on big rosters. */
+void CDTpAccount::requestUpgrade(const Tp::ContactPtr &contact)
+{
+    if (!mContacts.contains(contact->id())) {
+        return;
+    }
+
+    mUpgradeQueue.insert(contact);
+    startUpgrade();
+}
+
+void CDTpAccount::startUpgrade()
+{
+    if (mUpgrading || mUpgradeQueue.isEmpty() || mCurrentConnection.isNull()) {
+        return;
+    }
+
+    QList<Tp::ContactPtr> batch;
+    Tp::Contacts::Iterator it = mUpgradeQueue.begin();
+    while (it != mUpgradeQueue.end() && batch.count() < UpgradeBatchSize) {
+        batch.append(*it);
+        it = mUpgradeQueue.erase(it);
+    }
+
+    mUpgrading = true;
+    mUpgradedContacts += batch.count();
+    ++mUpgradeBatches;
+
+    Tp::PendingContacts *op = mCurrentConnection->contactManager()->upgradeContacts(batch, upgradeFeatures());
+    connect(op,
+            SIGNAL(finished(Tp::PendingOperation *)),
+            SLOT(onUpgradeFinished(Tp::PendingOperation *)));
+}
+
+void CDTpAccount::onUpgradeFinished(Tp::PendingOperation *op)
+{
+    mUpgrading = false;
+
+    if (op->isError()) {
+        warning() << "Account" << mAccount->objectPath() << "- could not upgrade contacts:"
+                  << op->errorName() << "-" << op->errorMessage();
+    } else {
+        Tp::PendingContacts *pc = qobject_cast<Tp::PendingContacts *>(op);
+        Q_FOREACH (const Tp::ContactPtr &contact, pc->contacts()) {
+            // Skip contacts removed, or from a previous connection
+            CDTpContactPtr contactWrapper = mContacts.value(contact->id());
+            if (!contactWrapper || contactWrapper->contact() != contact) {
+                continue;
+            }
+
+            maybeRequestExtraInfo(contact);
+
+            // Report what the upgrade brought in; nothing was stored for it yet
+            CDTpContact::Changes changes = 0;
+            if (!contact->avatarData().fileName.isEmpty()) {
+                changes |= CDTpContact::DefaultAvatar;
+            }
+            if (!contact->infoFields().allFields().isEmpty()) {
+                changes |= CDTpContact::Information;
+            }
+            if (changes) {
+                contactWrapper->emitChanged(changes);
+            }
+        }
+    }
+
+    if (mUpgradeQueue.isEmpty()) {
+        debug() << "Account" << mAccount->objectPath() << "- upgraded" << mUpgradedContacts
+                << "contacts in" << mUpgradeBatches << "batches";
+    }
+
+    startUpgrade();
+}
+
+CDTpContact::Info CDTpAccount::contactInfo(const CDTpContactPtr &contactWrapper) const
+{
+    CDTpContact::Info info = contactWrapper->info();
+
+    const QHash<QString, CDTpContact::Info>::ConstIterator it = mRosterCache.find(contactWrapper->contact()->id());
+    if (it != mRosterCache.constEnd()) {
+        info.restoreUnloaded(*it, contactWrapper->contact()->actualFeatures());
+    }
+
+    return info;
+}
+
 void CDTpAccount::makeRosterCache()
 {
-    mRosterCache.clear();
+    QHash<QString, CDTpContact::Info> cache;
 
     Q_FOREACH (const CDTpContactPtr &ptr, mContacts) {
-        mRosterCache.insert(ptr->contact()->id(), ptr->info());
+        cache.insert(ptr->contact()->id(), contactInfo(ptr));
     }
+
+    mRosterCache = cache;
 }
 
 CDTpContactPtr CDTpAccount::contact(const QString &id) const
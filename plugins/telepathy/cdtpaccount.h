@@ -24,7 +24,10 @@
 #ifndef CDTPACCOUNT_H
 #define CDTPACCOUNT_H
 
+#include <QHash>
 #include <QObject>
+#include <QSet>
+#include <QTimer>
 
 #include <TelepathyQt/Account>
 #include <TelepathyQt/Constants>
@@ -51,21 +54,24 @@ public:
     Q_DECLARE_FLAGS(Changes, Change)
 
     CDTpAccount(const Tp::AccountPtr &account,
-            const QStringList &contactsToAvoid = QStringList(),
+            const QSet<QString> &contactsToAvoid = QSet<QString>(),
             bool newAccount = false, QObject *parent = 0);
     ~CDTpAccount();
 
     Tp::AccountPtr account() const { return mAccount; }
+    const QString & accountPath() const { return mAccountPath; }
     QList<CDTpContactPtr> contacts() const;
     QHash<QString, CDTpContact::Changes> rosterChanges() const;
     CDTpContactPtr contact(const QString &id) const;
     bool hasRoster() const { return mHasRoster; };
     bool isNewAccount() const { return mNewAccount; };
     bool isEnabled() const { return mAccount->isEnabled(); };
-    QStringList contactsToAvoid() const { return mContactsToAvoid; }
-    void setContactsToAvoid(const QStringList &contactIds);
+    const QSet<QString> & contactsToAvoid() const { return mContactsToAvoid; }
+    void setContactsToAvoid(const QSet<QString> &contactIds);
 
     void emitSyncEnded(int contactsAdded, int contactsRemoved);
+    void requestUpgrade(const Tp::ContactPtr &contact);
+    static Tp::Features upgradeFeatures();
     QHash<QString, CDTpContact::Info> rosterCache() const;
     void setRosterCache(const QHash<QString, CDTpContact::Info> &rosterCache);
 
@@ -92,21 +98,33 @@ private Q_SLOTS:
     void onAllKnownContactsChanged(const Tp::Contacts &contactsAdded,
             const Tp::Contacts &contactsRemoved);
     void onDisconnectTimeout();
+    void onUpgradeFinished(Tp::PendingOperation *op);
+    void onVisibilityTimeout();
 
 private:
     void setConnection(const Tp::ConnectionPtr &connection);
     void setContactManager(const Tp::ContactManagerPtr &contactManager);
     CDTpContactPtr insertContact(const Tp::ContactPtr &contact);
     void maybeRequestExtraInfo(Tp::ContactPtr contact);
+    void startUpgrade();
+    CDTpContact::Info contactInfo(const CDTpContactPtr &contactWrapper) const;
     void makeRosterCache();
 
 private:
     Tp::AccountPtr mAccount;
+    const QString mAccountPath;
     Tp::ConnectionPtr mCurrentConnection;
     QHash<QString, CDTpContactPtr> mContacts;
     QHash<QString, CDTpContact::Info> mRosterCache;
-    QStringList mContactsToAvoid;
+    QSet<QString> mContactsToAvoid;
+    Tp::Contacts mUpgradeQueue;
+    int mUpgradedContacts;
+    int mUpgradeBatches;
+    bool mUpgrading;
     QTimer mDisconnectTimeout;
+    // Contacts whose visibility flipped, with their visibility before that
+    QHash<CDTpContactPtr, bool> mVisibilityChanges;
+    QTimer mVisibilityTimer;
     bool mHasRoster;
     bool mNewAccount;
     bool mImporting;
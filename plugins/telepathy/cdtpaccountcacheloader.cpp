@@ -37,7 +37,7 @@ CDTpAccountCacheLoader::CDTpAccountCacheLoader(CDTpAccount *account, QObject *pa
 
 void CDTpAccountCacheLoader::run()
 {
-    const QString accountPath = mAccount->account()->objectPath();
+    const QString accountPath = mAccount->accountPath();
     QFile cacheFile(CDTpAccountCache::cacheFilePath(mAccount));
 
     if (not cacheFile.exists()) {
@@ -68,6 +68,7 @@ void CDTpAccountCacheLoader::run()
     if (cacheVersion != CDTpAccountCache::Version) {
         warning() << "Wrong cache version for file" << cacheFile.fileName();
         cacheFile.remove();
+        return;
     }
 
     QHash<QString, CDTpContact::Info> cache;
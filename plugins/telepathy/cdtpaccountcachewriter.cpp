@@ -44,7 +44,7 @@ CDTpAccountCacheWriter::CDTpAccountCacheWriter(const CDTpAccount *account,
 
 void CDTpAccountCacheWriter::run()
 {
-    const QString accountPath = mAccount->account()->objectPath();
+    const QString accountPath = mAccount->accountPath();
     const QString rosterFileName = CDTpAccountCache::cacheFilePath(mAccount);
     const QHash<QString, CDTpContact::Info> cache = mAccount->rosterCache();
 
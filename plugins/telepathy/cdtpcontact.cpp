@@ -41,11 +41,13 @@ public:
     Tp::Presence presence;
     int capabilities;
     QString avatarPath;
+    QString avatarToken;
     QString largeAvatarPath;
     QString squareAvatarPath;
     Tp::Contact::PresenceState subscriptionState;
     Tp::Contact::PresenceState publishState;
     Tp::ContactInfoFieldList infoFields;
+    QDateTime infoTimestamp;
     bool isSubscriptionStateKnown : 1;
     bool isPublishStateKnown : 1;
     bool isContactInfoKnown : 1;
@@ -101,6 +103,7 @@ CDTpContact::Info::Info(const CDTpContact *contact)
     d->presence = c->presence();
     d->capabilities = makeInfoCaps(c->capabilities());
     d->avatarPath = c->avatarData().fileName;
+    d->avatarToken = c->avatarToken();
     d->subscriptionState = c->subscriptionState();
     d->publishState = c->publishState();
     d->infoFields = c->infoFields().allFields();
@@ -108,6 +111,11 @@ CDTpContact::Info::Info(const CDTpContact *contact)
     d->isPublishStateKnown = c->isPublishStateKnown();
     d->isContactInfoKnown = c->isContactInfoKnown();
     d->isVisible = contact->isVisible();
+
+    // Info fields loaded for the contact are kept current by change notifications
+    if (d->isContactInfoKnown) {
+        d->infoTimestamp = QDateTime::currentDateTimeUtc();
+    }
 }
 
 CDTpContact::Info::Info(const CDTpContact::Info &other)
@@ -164,12 +172,66 @@ CDTpContact::Changes CDTpContact::Info::diff(const CDTpContact::Info &other) con
     return changes;
 }
 
+/* Take the fields of features the contact was not upgraded to from the
+ * cached info, so they are neither reported as changed nor lost from the
+ * cache. */
+void CDTpContact::Info::restoreUnloaded(const CDTpContact::Info &cached, const Tp::Features &loaded)
+{
+    if (!loaded.contains(Tp::Contact::FeatureAvatarData)) {
+        d->avatarPath = cached.d->avatarPath;
+        d->avatarToken = cached.d->avatarToken;
+    }
+    if (!loaded.contains(Tp::Contact::FeatureInfo)) {
+        d->infoFields = cached.d->infoFields;
+        d->infoTimestamp = cached.d->infoTimestamp;
+        d->isContactInfoKnown = cached.d->isContactInfoKnown;
+    }
+}
+
+bool CDTpContact::Info::isContactInfoKnown() const
+{
+    return d->isContactInfoKnown;
+}
+
+Tp::ContactInfoFieldList CDTpContact::Info::infoFields() const
+{
+    return d->infoFields;
+}
+
+QString CDTpContact::Info::avatarToken() const
+{
+    return d->avatarToken;
+}
+
+QDateTime CDTpContact::Info::infoTimestamp() const
+{
+    return d->infoTimestamp;
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 
+// Changes compared against the last emitted value before being emitted
+static const CDTpContact::Change comparedChanges[] = {
+    CDTpContact::Alias,
+    CDTpContact::Presence,
+    CDTpContact::Capabilities,
+    CDTpContact::DefaultAvatar,
+    CDTpContact::Authorization,
+    CDTpContact::Information,
+    CDTpContact::Blocked
+};
+
+static const int comparedChangesCount = sizeof(comparedChanges) / sizeof(comparedChanges[0]);
+
+int CDTpContact::mSuppressedChanges = 0;
+
 CDTpContact::CDTpContact(Tp::ContactPtr contact, CDTpAccount *accountWrapper)
     : QObject(),
       mContact(contact),
       mAccountWrapper(accountWrapper),
+      mAccountPath(accountWrapper->accountPath()),
+      mAddress(imAddress(mAccountPath, contact->id())),
+      mPresenceUri(imPresence(mAccountPath, contact->id())),
       mRemoved(false),
       mQueuedChanges(0)
 {
@@ -179,6 +241,11 @@ CDTpContact::CDTpContact(Tp::ContactPtr contact, CDTpAccount *accountWrapper)
 
     updateVisibility();
 
+    // The roster sync stores the values the contact starts with
+    for (int i = 0; i < comparedChangesCount; ++i) {
+        mEmittedValues.insert(comparedChanges[i], changeValue(comparedChanges[i]));
+    }
+
     connect(contact.data(),
             SIGNAL(aliasChanged(const QString &)),
             SLOT(onContactAliasChanged()));
@@ -188,6 +255,9 @@ CDTpContact::CDTpContact(Tp::ContactPtr contact, CDTpAccount *accountWrapper)
     connect(contact.data(),
             SIGNAL(capabilitiesChanged(const Tp::ContactCapabilities &)),
             SLOT(onContactCapabilitiesChanged()));
+    connect(contact.data(),
+            SIGNAL(avatarTokenChanged(const QString &)),
+            SLOT(onContactAvatarTokenChanged()));
     connect(contact.data(),
             SIGNAL(avatarDataChanged(const Tp::AvatarData &)),
             SLOT(onContactAvatarDataChanged()));
@@ -214,6 +284,16 @@ CDTpAccountPtr CDTpContact::accountWrapper() const
     return CDTpAccountPtr(mAccountWrapper.data());
 }
 
+QString CDTpContact::imAddress(const QString &accountPath, const QString &contactId)
+{
+    return accountPath + QLatin1Char('!') + (contactId.isEmpty() ? QString::fromLatin1("self") : contactId);
+}
+
+QString CDTpContact::imPresence(const QString &accountPath, const QString &contactId)
+{
+    return imAddress(accountPath, contactId) + QLatin1String("!presence");
+}
+
 bool CDTpContact::isAvatarKnown() const
 {
     if (!mContact->isAvatarTokenKnown()) {
@@ -230,6 +310,13 @@ bool CDTpContact::isAvatarKnown() const
     return true;
 }
 
+/* Avatar data is only loaded for the contacts upgraded to it, see
+ * CDTpAccount::requestUpgrade() */
+bool CDTpContact::isAvatarDataLoaded() const
+{
+    return mContact->actualFeatures().contains(Tp::Contact::FeatureAvatarData);
+}
+
 bool CDTpContact::isInformationKnown() const
 {
     return mContact->isContactInfoKnown();
@@ -252,6 +339,88 @@ void CDTpContact::setSquareAvatarPath(const QString &path)
     emitChanged(SquareAvatar);
 }
 
+CDTpContact::Changes CDTpContact::infoFieldChanges(const QString &fieldName)
+{
+    if (fieldName == QLatin1String("tel")) {
+        return InfoPhone;
+    } else if (fieldName == QLatin1String("adr")) {
+        return InfoAddress;
+    } else if (fieldName == QLatin1String("email")) {
+        return InfoEmail;
+    } else if (fieldName == QLatin1String("url")) {
+        return InfoUrl;
+    } else if (fieldName == QLatin1String("title")
+            || fieldName == QLatin1String("role")
+            || fieldName == QLatin1String("org")) {
+        return InfoOrganization;
+    } else if (fieldName == QLatin1String("n")
+            || fieldName == QLatin1String("fn")) {
+        return InfoName;
+    } else if (fieldName == QLatin1String("nickname")) {
+        // The nickname is also the fallback custom label of the name
+        return InfoNickname | InfoName;
+    } else if (fieldName == QLatin1String("note")
+            || fieldName == QLatin1String("desc")) {
+        return InfoNote;
+    } else if (fieldName == QLatin1String("bday")) {
+        return InfoBirthday;
+    } else if (fieldName == QLatin1String("x-gender")) {
+        return InfoGender;
+    }
+
+    return 0;
+}
+
+CDTpContact::InfoFingerprints CDTpContact::infoFingerprints(const Tp::ContactInfoFieldList &fields)
+{
+    InfoFingerprints fingerprints;
+
+    // Every category gets a fingerprint, so that a category without fields
+    // can be told apart from one which was never applied
+    for (int change = InfoAddress; change <= InfoUrl; change <<= 1) {
+        fingerprints.insert(change, 0);
+    }
+
+    foreach (const Tp::ContactInfoField &field, fields) {
+        const Changes changes = infoFieldChanges(field.fieldName);
+        if (changes == 0) {
+            continue;
+        }
+
+        uint hash = qHash(field.fieldName);
+        foreach (const QString &parameter, field.parameters) {
+            hash = qHash(parameter, hash * 31);
+        }
+        foreach (const QString &value, field.fieldValue) {
+            hash = qHash(value, hash * 31);
+        }
+
+        // Field order is significant for the resulting details
+        for (int change = InfoAddress; change <= InfoUrl; change <<= 1) {
+            if (changes & change) {
+                uint &fingerprint = fingerprints[change];
+                fingerprint = (fingerprint * 31) ^ hash;
+            }
+        }
+    }
+
+    return fingerprints;
+}
+
+void CDTpContact::setAppliedInfoFingerprints(const InfoFingerprints &fingerprints)
+{
+    mAppliedInfoFingerprints = fingerprints;
+}
+
+void CDTpContact::forgetEmittedChanges(CDTpContact::Changes changes)
+{
+    for (int i = 0; i < comparedChangesCount; ++i) {
+        if (changes & comparedChanges[i]) {
+            mEmittedValues.remove(comparedChanges[i]);
+        }
+    }
+}
+
 void CDTpContact::onContactAliasChanged()
 {
     emitChanged(Alias);
@@ -267,6 +436,14 @@ void CDTpContact::onContactCapabilitiesChanged()
     emitChanged(Capabilities);
 }
 
+void CDTpContact::onContactAvatarTokenChanged()
+{
+    // The new avatar can only be fetched once the contact is upgraded
+    if (!isAvatarDataLoaded() && mAccountWrapper) {
+        mAccountWrapper->requestUpgrade(mContact);
+    }
+}
+
 void CDTpContact::onContactAvatarDataChanged()
 {
     emitChanged(DefaultAvatar);
@@ -296,8 +473,58 @@ void CDTpContact::emitChanged(CDTpContact::Changes changes)
     }
 }
 
+/* The values a change category is stored from. Connection managers often
+ * re-announce identical values, e.g. presence on MUC joins. Cheap values are
+ * kept as they are; only the contact info is reduced to a fingerprint. */
+QVariant CDTpContact::changeValue(Change change) const
+{
+    switch (change) {
+    case Alias:
+        return mContact->alias();
+    case Presence: {
+        const Tp::Presence presence(mContact->presence());
+        return QVariantList() << uint(presence.type()) << presence.status() << presence.statusMessage();
+    }
+    case Capabilities:
+        return uint(makeInfoCaps(mContact->capabilities()));
+    case DefaultAvatar:
+        return mContact->avatarData().fileName;
+    case Authorization:
+        return (uint(mContact->subscriptionState()) << 8) | (uint(mContact->publishState()) << 2)
+             | (mContact->isSubscriptionStateKnown() ? 2 : 0) | (mContact->isPublishStateKnown() ? 1 : 0);
+    case Information: {
+        // Combine the per-category fingerprints the storage applies the info by
+        const InfoFingerprints fingerprints(infoFingerprints(mContact->infoFields().allFields()));
+        uint hash = mContact->isContactInfoKnown() ? 1 : 0;
+        for (int info = InfoAddress; info <= InfoUrl; info <<= 1) {
+            hash = (hash * 31) ^ fingerprints.value(info);
+        }
+        return hash;
+    }
+    case Blocked:
+        return mContact->isBlocked();
+    default:
+        return QVariant();
+    }
+}
+
 void CDTpContact::onQueuedChangesTimeout()
 {
+    // Drop the changes whose value is the one we emitted last time
+    for (int i = 0; i < comparedChangesCount; ++i) {
+        const Change change = comparedChanges[i];
+        if (mQueuedChanges & change) {
+            const QVariant value = changeValue(change);
+            QVariant &emitted = mEmittedValues[change];
+            if (value == emitted) {
+                mQueuedChanges &= ~change;
+                ++mSuppressedChanges;
+            } else {
+                emitted = value;
+            }
+        }
+    }
+
     // Check if this change also modified the visibility
     bool wasVisible = mVisible;
     updateVisibility();
@@ -305,6 +532,12 @@ void CDTpContact::onQueuedChangesTimeout()
         mQueuedChanges |= Visibility;
     }
 
+    if (mQueuedChanges == 0) {
+        debug() << "Suppressed duplicate changes for contact" << mContact->id()
+                << "- total suppressed:" << mSuppressedChanges;
+        return;
+    }
+
     Q_EMIT changed(CDTpContactPtr(this), mQueuedChanges);
 
     mQueuedChanges = 0;
@@ -356,6 +589,7 @@ QDataStream& operator<<(QDataStream &stream, const CDTpContact::Info &info)
     stream << info.d->presence;
     stream << info.d->capabilities;
     stream << info.d->avatarPath;
+    stream << info.d->avatarToken;
     stream << info.d->largeAvatarPath;
     stream << info.d->squareAvatarPath;
     stream << info.d->isSubscriptionStateKnown;
@@ -364,6 +598,7 @@ QDataStream& operator<<(QDataStream &stream, const CDTpContact::Info &info)
     stream << uint(info.d->publishState);
     stream << info.d->isContactInfoKnown;
     stream << info.d->infoFields;
+    stream << info.d->infoTimestamp;
     stream << info.d->isVisible;
 
     return stream;
@@ -412,6 +647,7 @@ QDataStream& operator>>(QDataStream &stream, CDTpContact::Info &info)
     stream >> info.d->presence;
     stream >> info.d->capabilities;
     stream >> info.d->avatarPath;
+    stream >> info.d->avatarToken;
     stream >> info.d->largeAvatarPath;
     stream >> info.d->squareAvatarPath;
     stream >> isSubscriptionStateKnown;
@@ -420,6 +656,7 @@ QDataStream& operator>>(QDataStream &stream, CDTpContact::Info &info)
     stream >> info.d->publishState;
     stream >> isContactInfoKnown;
     stream >> info.d->infoFields;
+    stream >> info.d->infoTimestamp;
     stream >> isVisible;
 
     info.d->isSubscriptionStateKnown = isSubscriptionStateKnown;
@@ -24,7 +24,10 @@
 #ifndef CDTPCONTACT_H
 #define CDTPCONTACT_H
 
+#include <QDateTime>
+#include <QHash>
 #include <QObject>
+#include <QVariant>
 
 #include <TelepathyQt/Contact>
 #include <TelepathyQt/Presence>
@@ -50,6 +53,20 @@ public:
         SquareAvatar  = (1 << 9),
         All           = (1 << 10) - 1,
 
+        // Information broken down by the contact details it maps to. These
+        // are never emitted by the contact; CDTpStorage resolves Information
+        // into them by comparing info field fingerprints.
+        InfoAddress      = (1 << 10),
+        InfoBirthday     = (1 << 11),
+        InfoEmail        = (1 << 12),
+        InfoGender       = (1 << 13),
+        InfoName         = (1 << 14),
+        InfoNickname     = (1 << 15),
+        InfoNote         = (1 << 16),
+        InfoOrganization = (1 << 17),
+        InfoPhone        = (1 << 18),
+        InfoUrl          = (1 << 19),
+
         // Special values
         Avatar        = (DefaultAvatar | LargeAvatar | SquareAvatar),
 
@@ -86,6 +103,14 @@ public:
 
     public:
         CDTpContact::Changes diff(const CDTpContact::Info &other) const;
+        void restoreUnloaded(const CDTpContact::Info &cached, const Tp::Features &loaded);
+
+        bool isContactInfoKnown() const;
+        Tp::ContactInfoFieldList infoFields() const;
+
+        // Token of the avatar stored in avatarPath, and when the info fields were last known current
+        QString avatarToken() const;
+        QDateTime infoTimestamp() const;
 
     private:
         friend QDataStream& operator<<(QDataStream &stream, const CDTpContact::Info &info);
@@ -94,15 +119,27 @@ public:
         QSharedDataPointer<InfoData> d;
     };
 
+    // Fingerprints of the info fields, keyed by the Info* change they map to
+    typedef QHash<int, uint> InfoFingerprints;
+
      CDTpContact(Tp::ContactPtr contact, CDTpAccount *accountWrapper);
     ~CDTpContact();
 
     Tp::ContactPtr contact() const { return mContact; }
 
+    // Storage identifiers, built once since they are needed for every update
+    const QString & accountPath() const { return mAccountPath; }
+    const QString & address() const { return mAddress; }
+    const QString & presenceUri() const { return mPresenceUri; }
+
+    static QString imAddress(const QString &accountPath, const QString &contactId);
+    static QString imPresence(const QString &accountPath, const QString &contactId);
+
     CDTpAccountPtr accountWrapper() const;
     bool isRemoved() const { return mRemoved; }
     bool isVisible() const { return mVisible; }
     bool isAvatarKnown() const;
+    bool isAvatarDataLoaded() const;
     bool isInformationKnown() const;
 
     Info info() const;
@@ -113,6 +150,19 @@ public:
     void setSquareAvatarPath(const QString &path);
     const QString & squareAvatarPath() const { return mSquareAvatarPath; }
 
+    static Changes infoFieldChanges(const QString &fieldName);
+    static InfoFingerprints infoFingerprints(const Tp::ContactInfoFieldList &fields);
+
+    const InfoFingerprints & appliedInfoFingerprints() const { return mAppliedInfoFingerprints; }
+    void setAppliedInfoFingerprints(const InfoFingerprints &fingerprints);
+
+    // Announce these changes again even if their value is the one emitted last
+    // time, e.g. because that value could not be stored
+    void forgetEmittedChanges(CDTpContact::Changes changes);
+
+    // Number of re-announced identical values dropped by all contacts
+    static int suppressedChanges() { return mSuppressedChanges; }
+
 Q_SIGNALS:
     void changed(CDTpContactPtr contact, CDTpContact::Changes changes);
 
@@ -120,6 +170,7 @@ private Q_SLOTS:
     void onContactAliasChanged();
     void onContactPresenceChanged();
     void onContactCapabilitiesChanged();
+    void onContactAvatarTokenChanged();
     void onContactAvatarDataChanged();
     void onContactAuthorizationChanged();
     void onContactInfoChanged();
@@ -128,14 +179,21 @@ private Q_SLOTS:
 
 private:
     void emitChanged(CDTpContact::Changes changes);
+    QVariant changeValue(Change change) const;
     void updateVisibility();
     void setRemoved(bool value);
 
     friend class CDTpAccount;
     Tp::ContactPtr mContact;
     QPointer<CDTpAccount> mAccountWrapper;
+    QString mAccountPath;
+    QString mAddress;
+    QString mPresenceUri;
     QString mLargeAvatarPath;
     QString mSquareAvatarPath;
+    InfoFingerprints mAppliedInfoFingerprints;
+    QHash<int, QVariant> mEmittedValues;
+    static int mSuppressedChanges;
     bool mRemoved;
     bool mVisible;
     Changes mQueuedChanges;
@@ -31,6 +31,9 @@
 #include <TelepathyQt/ContactManager>
 #include <TelepathyQt/PendingContacts>
 
+#include <QDBusArgument>
+
+#include "base-plugin.h"
 #include "buddymanagementadaptor.h"
 #include "cdtpcontroller.h"
 #include "debug.h"
@@ -38,19 +41,46 @@
 using namespace Contactsd;
 
 const QLatin1String DBusObjectPath("/telepathy");
-static const QString offlineRemovals = QString::fromLatin1("OfflineRemovals");
-static const QString offlineInvitations = QString::fromLatin1("OfflineInvitations");
+
+// Time spent loading account caches before yielding to the event loop at startup
+static const int BringUpSlice = 10; // ms
+
+/* A batch request is either the list of IM ids of an account, or a map with
+ * the "imIds" list and the optional local contact id "localId" to link the
+ * invited buddies to. */
+static QStringList batchRequestIds(const QVariant &request, uint *localId)
+{
+    QVariant value(request);
+    if (value.userType() == qMetaTypeId<QDBusArgument>()) {
+        value = qdbus_cast<QVariantMap>(value.value<QDBusArgument>());
+    }
+
+    *localId = 0;
+    if (value.type() != QVariant::Map) {
+        return value.toStringList();
+    }
+
+    const QVariantMap map(value.toMap());
+    *localId = map.value(QLatin1String("localId")).toUInt();
+    return map.value(QLatin1String("imIds")).toStringList();
+}
 
 CDTpController::CDTpController(QObject *parent) : QObject(parent)
 {
+    mStartupTimer.start();
+
     debug() << "Creating storage";
     mStorage = new CDTpStorage(this);
-    mOfflineRosterBuffer = new QSettings(QSettings::IniFormat,
-            QSettings::UserScope, QLatin1String("Nokia"),
-            QLatin1String("Contactsd"));
+    mOfflineRosterBuffer = new CDTpRosterBuffer(BasePlugin::cacheFileName(QLatin1String("telepathy-roster-buffer.journal")));
     connect(mStorage,
             SIGNAL(error(int, const QString &)),
             SIGNAL(error(int, const QString &)));
+    connect(mStorage,
+            SIGNAL(importStarted(const QString &, const QString &)),
+            SIGNAL(importStarted(const QString &, const QString &)));
+    connect(mStorage,
+            SIGNAL(importEnded(const QString &, const QString &, int, int, int)),
+            SIGNAL(importEnded(const QString &, const QString &, int, int, int)));
 
     debug() << "Creating account manager";
     const QDBusConnection &bus = QDBusConnection::sessionBus();
@@ -63,17 +93,23 @@ CDTpController::CDTpController(QObject *parent) : QObject(parent)
                            << Tp::Connection::FeatureCore
                            << Tp::Connection::FeatureRoster);
     Tp::ChannelFactoryPtr channelFactory = Tp::ChannelFactory::create(bus);
+    // Avatar data and contact info are only requested for the contacts that
+    // need them, see CDTpAccount::upgradeFeatures()
     Tp::ContactFactoryPtr contactFactory = Tp::ContactFactory::create(
             Tp::Features() << Tp::Contact::FeatureAlias
                            << Tp::Contact::FeatureAvatarToken
-                           << Tp::Contact::FeatureAvatarData
                            << Tp::Contact::FeatureSimplePresence
-                           << Tp::Contact::FeatureInfo
-                           << Tp::Contact::FeatureLocation
                            << Tp::Contact::FeatureCapabilities);
     mAM = Tp::AccountManager::create(bus, accountFactory, connectionFactory,
             channelFactory, contactFactory);
 
+    // Startup accounts are brought up in short slices, so that the accounts
+    // already up get their connection and roster signals handled while the
+    // others are still loading
+    mBringUpTimer.setInterval(0);
+    mBringUpTimer.setSingleShot(true);
+    connect(&mBringUpTimer, SIGNAL(timeout()), SLOT(onBringUpTimeout()));
+
     // Wait for AM to become ready
     connect(mAM->becomeReady(Tp::AccountManager::FeatureCore),
             SIGNAL(finished(Tp::PendingOperation*)),
@@ -99,7 +135,7 @@ void CDTpController::onAccountManagerReady(Tp::PendingOperation *op)
         return;
     }
 
-    debug() << "Account manager ready";
+    debug() << "Account manager ready - elapsed:" << mStartupTimer.elapsed();
 
     Tp::AccountPropertyFilterPtr propFilter;
     Tp::AccountFilterPtr notFilter;
@@ -134,11 +170,82 @@ void CDTpController::onAccountManagerReady(Tp::PendingOperation *op)
             SIGNAL(accountRemoved(const Tp::AccountPtr &)),
              SLOT(onAccountRemoved(const Tp::AccountPtr &)));
 
+    // Accounts that are already connected go first, so their roster work
+    // can start as early as possible
     Q_FOREACH (const Tp::AccountPtr &account, mAccountSet->accounts()) {
-        insertAccount(account, false);
+        if (account->connection()) {
+            mPendingAccounts.prepend(account);
+        } else {
+            mPendingAccounts.append(account);
+        }
+        connect(account.data(),
+                SIGNAL(connectionChanged(const Tp::ConnectionPtr &)),
+                SLOT(onPendingAccountConnectionChanged(const Tp::ConnectionPtr &)));
+    }
+
+    onBringUpTimeout();
+}
+
+void CDTpController::onBringUpTimeout()
+{
+    if (mPendingAccounts.isEmpty()) {
+        // All accounts are known now; synchronize them with the self contact in a
+        // single pass, which also drops the ones removed while we were not running
+        mStorage->syncAccounts(mAccounts.values());
+
+        debug() << "All" << mAccounts.count() << "accounts synchronized - elapsed:" << mStartupTimer.elapsed();
+        return;
+    }
+
+    // Load as many account caches as fit in the time slice
+    QElapsedTimer slice;
+    slice.start();
+
+    QList<CDTpAccountPtr> loadedAccounts;
+    while (!mPendingAccounts.isEmpty() && (loadedAccounts.isEmpty() || slice.elapsed() < BringUpSlice)) {
+        const Tp::AccountPtr account = mPendingAccounts.takeFirst();
+        disconnect(account.data(), SIGNAL(connectionChanged(const Tp::ConnectionPtr &)),
+                   this, SLOT(onPendingAccountConnectionChanged(const Tp::ConnectionPtr &)));
+
+        loadedAccounts.append(insertAccount(account, false));
+        debug() << "Account" << account->objectPath() << "cache loaded - elapsed:" << mStartupTimer.elapsed();
+    }
+
+    Q_FOREACH (const CDTpAccountPtr &accountWrapper, loadedAccounts) {
+        if (accountWrapper->hasRoster()) {
+            debug() << "Account" << accountWrapper->accountPath() << "roster ready - elapsed:" << mStartupTimer.elapsed();
+        } else {
+            mAwaitingRoster.insert(accountWrapper->accountPath());
+        }
+    }
+
+    mBringUpTimer.start();
+}
+
+void CDTpController::onPendingAccountConnectionChanged(const Tp::ConnectionPtr &connection)
+{
+    if (!connection) {
+        return;
     }
 
-    mStorage->syncAccounts(mAccounts.values());
+    // Move the account to the front of the queue, so its roster work starts
+    // as soon as possible
+    Tp::Account *account = qobject_cast<Tp::Account *>(sender());
+    const int index = account ? pendingAccountIndex(account->objectPath()) : -1;
+    if (index > 0) {
+        mPendingAccounts.move(index, 0);
+    }
+}
+
+int CDTpController::pendingAccountIndex(const QString &accountPath) const
+{
+    for (int i = 0; i < mPendingAccounts.count(); ++i) {
+        if (mPendingAccounts.at(i)->objectPath() == accountPath) {
+            return i;
+        }
+    }
+
+    return -1;
 }
 
 void CDTpController::onAccountAdded(const Tp::AccountPtr &account)
@@ -154,25 +261,25 @@ void CDTpController::onAccountAdded(const Tp::AccountPtr &account)
 
 void CDTpController::onAccountRemoved(const Tp::AccountPtr &account)
 {
+    const int index = pendingAccountIndex(account->objectPath());
+    if (index != -1) {
+        // Not brought up yet, it will be purged with the obsolete accounts
+        mPendingAccounts.removeAt(index);
+        disconnect(account.data(), SIGNAL(connectionChanged(const Tp::ConnectionPtr &)),
+                   this, SLOT(onPendingAccountConnectionChanged(const Tp::ConnectionPtr &)));
+        return;
+    }
+
     CDTpAccountPtr accountWrapper(mAccounts.take(account->objectPath()));
     if (not accountWrapper) {
         warning() << "Internal error, account was not in controller";
         return;
     }
     mStorage->removeAccount(accountWrapper);
+    mAwaitingRoster.remove(accountWrapper->accountPath());
 
     // Drop pending offline operations
-    QString accountPath = accountWrapper->account()->objectPath();
-
-    mOfflineRosterBuffer->beginGroup(offlineRemovals);
-    mOfflineRosterBuffer->remove(accountPath);
-    mOfflineRosterBuffer->endGroup();
-
-    mOfflineRosterBuffer->beginGroup(offlineInvitations);
-    mOfflineRosterBuffer->remove(accountPath);
-    mOfflineRosterBuffer->endGroup();
-
-    mOfflineRosterBuffer->sync();
+    mOfflineRosterBuffer->removeAccount(accountWrapper->accountPath());
 }
 
 CDTpAccountPtr CDTpController::insertAccount(const Tp::AccountPtr &account, bool newAccount)
@@ -180,9 +287,7 @@ CDTpAccountPtr CDTpController::insertAccount(const Tp::AccountPtr &account, bool
     debug() << "Creating wrapper for account" << account->objectPath();
 
     // Get the list of contact ids waiting to be removed from server
-    mOfflineRosterBuffer->beginGroup(offlineRemovals);
-    QStringList idsToRemove = mOfflineRosterBuffer->value(account->objectPath()).toStringList();
-    mOfflineRosterBuffer->endGroup();
+    const QSet<QString> idsToRemove = mOfflineRosterBuffer->contactIds(CDTpRosterBuffer::Removal, account->objectPath());
 
     CDTpAccountPtr accountWrapper = CDTpAccountPtr(new CDTpAccount(account, idsToRemove, newAccount, this));
     mAccounts.insert(account->objectPath(), accountWrapper);
@@ -232,6 +337,10 @@ void CDTpController::onSyncEnded(Tp::AccountPtr account, int contactsAdded, int
 
 void CDTpController::onRosterChanged(CDTpAccountPtr accountWrapper)
 {
+    if (accountWrapper->hasRoster() && mAwaitingRoster.remove(accountWrapper->accountPath())) {
+        debug() << "Account" << accountWrapper->accountPath() << "roster ready - elapsed:" << mStartupTimer.elapsed();
+    }
+
     mStorage->syncAccountContacts(accountWrapper);
     maybeStartOfflineOperations(accountWrapper);
 }
@@ -242,26 +351,25 @@ void CDTpController::maybeStartOfflineOperations(CDTpAccountPtr accountWrapper)
         return;
     }
 
-    Tp::AccountPtr account = accountWrapper->account();
+    const QString &accountPath(accountWrapper->accountPath());
 
     // Start removal operation
-    mOfflineRosterBuffer->beginGroup(offlineRemovals);
-    QStringList idsToRemove = mOfflineRosterBuffer->value(account->objectPath()).toStringList();
-    mOfflineRosterBuffer->endGroup();
+    const QSet<QString> idsToRemove = mOfflineRosterBuffer->contactIds(CDTpRosterBuffer::Removal, accountPath);
     if (!idsToRemove.isEmpty()) {
-        CDTpRemovalOperation *op = new CDTpRemovalOperation(accountWrapper, idsToRemove);
+        CDTpRemovalOperation *op = new CDTpRemovalOperation(accountWrapper, idsToRemove.toList());
         connect(op,
                 SIGNAL(finished(Tp::PendingOperation *)),
                 SLOT(onRemovalFinished(Tp::PendingOperation *)));
     }
 
-    // Start invitation operation
-    mOfflineRosterBuffer->beginGroup(offlineInvitations);
-    QStringList idsToInvite = mOfflineRosterBuffer->value(account->objectPath()).toStringList();
-    mOfflineRosterBuffer->endGroup();
-    if (!idsToInvite.isEmpty()) {
-        // FIXME: We should also save the localId for offline operations
-        CDTpInvitationOperation *op = new CDTpInvitationOperation(mStorage, accountWrapper, idsToInvite, 0);
+    // Start one invitation operation per local contact the ids are linked to
+    QHash<uint, QStringList> idsToInvite;
+    const CDTpRosterBuffer::Entries invitations = mOfflineRosterBuffer->entries(CDTpRosterBuffer::Invitation, accountPath);
+    for (CDTpRosterBuffer::Entries::ConstIterator it = invitations.constBegin(); it != invitations.constEnd(); ++it) {
+        idsToInvite[it.value()].append(it.key());
+    }
+    for (QHash<uint, QStringList>::ConstIterator it = idsToInvite.constBegin(); it != idsToInvite.constEnd(); ++it) {
+        CDTpInvitationOperation *op = new CDTpInvitationOperation(mStorage, accountWrapper, it.value(), it.key());
         connect(op,
                 SIGNAL(finished(Tp::PendingOperation *)),
                 SLOT(onInvitationFinished(Tp::PendingOperation *)));
@@ -274,16 +382,21 @@ void CDTpController::inviteBuddies(const QString &accountPath, const QStringList
 }
 
 void CDTpController::inviteBuddiesOnContact(const QString &accountPath, const QStringList &imIds, uint localId)
+{
+    startInvitation(accountPath, imIds, localId);
+}
+
+Tp::PendingOperation *CDTpController::startInvitation(const QString &accountPath, const QStringList &imIds, uint localId)
 {
     debug() << "InviteBuddies:" << accountPath << imIds.join(QLatin1String(", "));
 
-    // Add ids to offlineInvitations, in case operation does not succeed now
-    updateOfflineRosterBuffer(offlineInvitations, accountPath, imIds, QStringList());
+    // Buffer the invitations, in case operation does not succeed now
+    mOfflineRosterBuffer->add(CDTpRosterBuffer::Invitation, accountPath, imIds, localId);
 
-    CDTpAccountPtr accountWrapper = mAccounts[accountPath];
+    CDTpAccountPtr accountWrapper = mAccounts.value(accountPath);
     if (!accountWrapper) {
         debug() << "Account not found";
-        return;
+        return 0;
     }
 
     // Start invitation operation
@@ -292,7 +405,9 @@ void CDTpController::inviteBuddiesOnContact(const QString &accountPath, const QS
         connect(op,
                 SIGNAL(finished(Tp::PendingOperation *)),
                 SLOT(onInvitationFinished(Tp::PendingOperation *)));
+        return op;
     }
+    return 0;
 }
 
 void CDTpController::onInvitationFinished(Tp::PendingOperation *op)
@@ -308,28 +423,32 @@ void CDTpController::onInvitationFinished(Tp::PendingOperation *op)
     debug() << "Contacts invited:" << iop->contactIds().join(QLatin1String(", "));
 
     CDTpAccountPtr accountWrapper = iop->accountWrapper();
-    const QString accountPath = accountWrapper->account()->objectPath();
-    updateOfflineRosterBuffer(offlineInvitations, accountPath, QStringList(), iop->contactIds());
+    mOfflineRosterBuffer->remove(CDTpRosterBuffer::Invitation, accountWrapper->accountPath(), iop->contactIds());
 }
 
 void CDTpController::removeBuddies(const QString &accountPath, const QStringList &imIds)
+{
+    startRemoval(accountPath, imIds);
+}
+
+Tp::PendingOperation *CDTpController::startRemoval(const QString &accountPath, const QStringList &imIds)
 {
     debug() << "RemoveBuddies:" << accountPath << imIds.join(QLatin1String(", "));
 
-    // Add ids to offlineRemovals, in case it does not get removed right now from server
-    QStringList currentList = updateOfflineRosterBuffer(offlineRemovals, accountPath, imIds, QStringList());
+    // Buffer the removals, in case they do not get removed right now from server
+    mOfflineRosterBuffer->add(CDTpRosterBuffer::Removal, accountPath, imIds);
 
-    CDTpAccountPtr accountWrapper = mAccounts[accountPath];
+    CDTpAccountPtr accountWrapper = mAccounts.value(accountPath);
     if (!accountWrapper) {
         debug() << "Account not found";
-        return;
+        return 0;
     }
 
     // Remove ids from storage
     mStorage->removeAccountContacts(accountWrapper, imIds);
 
     // Add contact to account's avoid list
-    accountWrapper->setContactsToAvoid(currentList);
+    accountWrapper->setContactsToAvoid(mOfflineRosterBuffer->contactIds(CDTpRosterBuffer::Removal, accountPath));
 
     // Start removal operation
     if (accountWrapper->hasRoster()) {
@@ -337,7 +456,79 @@ void CDTpController::removeBuddies(const QString &accountPath, const QStringList
         connect(op,
                 SIGNAL(finished(Tp::PendingOperation *)),
                 SLOT(onRemovalFinished(Tp::PendingOperation *)));
+        return op;
     }
+    return 0;
+}
+
+QVariantMap CDTpController::inviteBuddiesBatch(const QVariantMap &requests)
+{
+    return runBatch(requests, false);
+}
+
+QVariantMap CDTpController::removeBuddiesBatch(const QVariantMap &requests)
+{
+    return runBatch(requests, true);
+}
+
+/* Start the operations of all accounts at once; when called over D-Bus the
+ * reply is delayed until all of them have finished. In-process callers get
+ * the results right away, with "pending" for the operations still running. */
+QVariantMap CDTpController::runBatch(const QVariantMap &requests, bool removal)
+{
+    CDTpBuddyBatchReply *reply = 0;
+    if (calledFromDBus()) {
+        setDelayedReply(true);
+        reply = new CDTpBuddyBatchReply(connection(), message(), this);
+    }
+
+    QVariantMap results;
+
+    QVariantMap::ConstIterator it = requests.constBegin(), end = requests.constEnd();
+    for ( ; it != end; ++it) {
+        const QString &accountPath(it.key());
+        uint localId;
+        const QStringList imIds(batchRequestIds(it.value(), &localId));
+        if (imIds.isEmpty()) {
+            continue;
+        }
+
+        QString result;
+        Tp::PendingOperation *op = 0;
+        if (!mAccounts.contains(accountPath) && pendingAccountIndex(accountPath) == -1) {
+            // Nothing is stored or deferred for an account we do not know
+            result = QString::fromLatin1("unknownAccount");
+        } else {
+            if (removal) {
+                op = startRemoval(accountPath, imIds);
+            } else {
+                op = startInvitation(accountPath, imIds, localId);
+            }
+            if (!op) {
+                result = QString::fromLatin1("deferred");
+            }
+        }
+
+        if (reply && op) {
+            reply->track(op, accountPath, imIds);
+        } else if (reply) {
+            reply->setResult(accountPath, imIds, result);
+        } else {
+            if (op) {
+                result = QString::fromLatin1("pending");
+            }
+            QVariantMap accountResults;
+            Q_FOREACH (const QString &id, imIds) {
+                accountResults.insert(id, result);
+            }
+            results.insert(accountPath, accountResults);
+        }
+    }
+
+    if (reply) {
+        reply->start();
+    }
+    return results;
 }
 
 void CDTpController::onRemovalFinished(Tp::PendingOperation *op)
@@ -353,35 +544,11 @@ void CDTpController::onRemovalFinished(Tp::PendingOperation *op)
     debug() << "Contacts removed from server:" << rop->contactIds().join(QLatin1String(", "));
 
     CDTpAccountPtr accountWrapper = rop->accountWrapper();
-    const QString accountPath = accountWrapper->account()->objectPath();
-    QStringList currentList = updateOfflineRosterBuffer(offlineRemovals, accountPath, QStringList(), rop->contactIds());
+    const QString accountPath = accountWrapper->accountPath();
+    mOfflineRosterBuffer->remove(CDTpRosterBuffer::Removal, accountPath, rop->contactIds());
 
     // Update account's avoid list, in case they get added back
-    accountWrapper->setContactsToAvoid(currentList);
-}
-
-QStringList CDTpController::updateOfflineRosterBuffer(const QString group, const QString accountPath,
-        const QStringList idsToAdd, const QStringList idsToRemove)
-{
-    mOfflineRosterBuffer->beginGroup(group);
-    QStringList currentList = mOfflineRosterBuffer->value(accountPath).toStringList();
-    Q_FOREACH (const QString &id, idsToAdd) {
-        if (!currentList.contains(id)) {
-            currentList << id;
-        }
-    }
-    Q_FOREACH (const QString id, idsToRemove) {
-        currentList.removeOne(id);
-    }
-    if (currentList.isEmpty()) {
-        mOfflineRosterBuffer->remove(accountPath);
-    } else {
-        mOfflineRosterBuffer->setValue(accountPath, currentList);
-    }
-    mOfflineRosterBuffer->endGroup();
-    mOfflineRosterBuffer->sync();
-
-    return currentList;
+    accountWrapper->setContactsToAvoid(mOfflineRosterBuffer->contactIds(CDTpRosterBuffer::Removal, accountPath));
 }
 
 bool CDTpController::registerDBusObject()
@@ -400,6 +567,56 @@ bool CDTpController::registerDBusObject()
     return true;
 }
 
+CDTpBuddyBatchReply::CDTpBuddyBatchReply(const QDBusConnection &connection, const QDBusMessage &message, QObject *parent)
+    : QObject(parent)
+    , mConnection(connection)
+    , mMessage(message)
+    , mStarted(false)
+{
+}
+
+void CDTpBuddyBatchReply::setResult(const QString &accountPath, const QStringList &imIds, const QString &result)
+{
+    QVariantMap accountResults(mResults.value(accountPath).toMap());
+    Q_FOREACH (const QString &id, imIds) {
+        accountResults.insert(id, result);
+    }
+    mResults.insert(accountPath, accountResults);
+}
+
+void CDTpBuddyBatchReply::track(Tp::PendingOperation *op, const QString &accountPath, const QStringList &imIds)
+{
+    mOperations.insert(op, qMakePair(accountPath, imIds));
+    connect(op,
+            SIGNAL(finished(Tp::PendingOperation *)),
+            SLOT(onOperationFinished(Tp::PendingOperation *)));
+}
+
+void CDTpBuddyBatchReply::start()
+{
+    mStarted = true;
+    maybeSendReply();
+}
+
+void CDTpBuddyBatchReply::onOperationFinished(Tp::PendingOperation *op)
+{
+    const QPair<QString, QStringList> request(mOperations.take(op));
+    setResult(request.first, request.second, op->isError() ? op->errorName() : QString());
+    maybeSendReply();
+}
+
+void CDTpBuddyBatchReply::maybeSendReply()
+{
+    if (!mStarted || !mOperations.isEmpty()) {
+        return;
+    }
+
+    if (!mConnection.send(mMessage.createReply(QVariant(mResults)))) {
+        warning() << "Could not send buddy management batch reply:" << mConnection.lastError();
+    }
+    deleteLater();
+}
+
 CDTpRemovalOperation::CDTpRemovalOperation(CDTpAccountPtr accountWrapper,
         const QStringList &contactIds) : PendingOperation(accountWrapper),
         mContactIds(contactIds), mAccountWrapper(accountWrapper)
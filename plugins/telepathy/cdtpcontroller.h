@@ -26,17 +26,24 @@
 
 #include "cdtpaccount.h"
 #include "cdtpcontact.h"
+#include "cdtprosterbuffer.h"
 #include "cdtpstorage.h"
 
 #include <TelepathyQt/Types>
 
+#include <QDBusConnection>
+#include <QDBusContext>
+#include <QDBusMessage>
+#include <QElapsedTimer>
 #include <QList>
 #include <QObject>
-#include <QSettings>
+#include <QSet>
+#include <QTimer>
+#include <QVariantMap>
 
 class PendingOfflineRemoval;
 
-class CDTpController : public QObject
+class CDTpController : public QObject, protected QDBusContext
 {
     Q_OBJECT
 
@@ -53,10 +60,14 @@ public Q_SLOTS:
     void inviteBuddies(const QString &accountPath, const QStringList &imIds);
     void inviteBuddiesOnContact(const QString &accountPath, const QStringList &imIds, uint localId);
     void removeBuddies(const QString &accountPath, const QStringList &imIds);
+    QVariantMap inviteBuddiesBatch(const QVariantMap &requests);
+    QVariantMap removeBuddiesBatch(const QVariantMap &requests);
     void onRosterChanged(CDTpAccountPtr accountWrapper);
 
 private Q_SLOTS:
     void onAccountManagerReady(Tp::PendingOperation *op);
+    void onBringUpTimeout();
+    void onPendingAccountConnectionChanged(const Tp::ConnectionPtr &connection);
     void onAccountAdded(const Tp::AccountPtr &account);
     void onAccountRemoved(const Tp::AccountPtr &account);
     void onSyncStarted(Tp::AccountPtr account);
@@ -67,9 +78,11 @@ private Q_SLOTS:
 private:
     CDTpAccountPtr insertAccount(const Tp::AccountPtr &account, bool newAccount);
     void removeAccount(const QString &accountObjectPath);
+    int pendingAccountIndex(const QString &accountPath) const;
     void maybeStartOfflineOperations(CDTpAccountPtr accountWrapper);
-    QStringList updateOfflineRosterBuffer(const QString group, const QString accountPath,
-        const QStringList idsToAdd, const QStringList idsToRemove);
+    Tp::PendingOperation *startInvitation(const QString &accountPath, const QStringList &imIds, uint localId);
+    Tp::PendingOperation *startRemoval(const QString &accountPath, const QStringList &imIds);
+    QVariantMap runBatch(const QVariantMap &requests, bool removal);
     bool registerDBusObject();
 
 private:
@@ -77,7 +90,39 @@ private:
     Tp::AccountManagerPtr mAM;
     Tp::AccountSetPtr mAccountSet;
     QHash<QString, CDTpAccountPtr> mAccounts;
-    QSettings *mOfflineRosterBuffer;
+    CDTpRosterBuffer *mOfflineRosterBuffer;
+
+    // Startup accounts not inserted yet, connected ones first
+    QList<Tp::AccountPtr> mPendingAccounts;
+    QTimer mBringUpTimer;
+    QElapsedTimer mStartupTimer;
+    QSet<QString> mAwaitingRoster;
+};
+
+/* Collects the per-id results of a batch of buddy operations and sends
+ * them as the delayed reply to the D-Bus call that started the batch. */
+class CDTpBuddyBatchReply : public QObject
+{
+    Q_OBJECT
+
+public:
+    CDTpBuddyBatchReply(const QDBusConnection &connection, const QDBusMessage &message, QObject *parent = 0);
+
+    void setResult(const QString &accountPath, const QStringList &imIds, const QString &result);
+    void track(Tp::PendingOperation *op, const QString &accountPath, const QStringList &imIds);
+    void start();
+
+private Q_SLOTS:
+    void onOperationFinished(Tp::PendingOperation *op);
+
+private:
+    void maybeSendReply();
+
+    QDBusConnection mConnection;
+    QDBusMessage mMessage;
+    QVariantMap mResults;
+    QHash<Tp::PendingOperation *, QPair<QString, QStringList> > mOperations;
+    bool mStarted;
 };
 
 class CDTpRemovalOperation : public Tp::PendingOperation
@@ -0,0 +1,340 @@
+/** This file is part of Contacts daemon
+ **
+ ** Copyright (c) 2010-2011 Nokia Corporation and/or its subsidiary(-ies).
+ **
+ ** Contact:  Nokia Corporation (info@qt.nokia.com)
+ **
+ ** GNU Lesser General Public License Usage
+ ** This file may be used under the terms of the GNU Lesser General Public License
+ ** version 2.1 as published by the Free Software Foundation and appearing in the
+ ** file LICENSE.LGPL included in the packaging of this file.  Please review the
+ ** following information to ensure the GNU Lesser General Public License version
+ ** 2.1 requirements will be met:
+ ** http://www.gnu.org/licenses/old-licenses/lgpl-2.1.html.
+ **
+ ** In addition, as a special exception, Nokia gives you certain additional rights.
+ ** These rights are described in the Nokia Qt LGPL Exception version 1.1, included
+ ** in the file LGPL_EXCEPTION.txt in this package.
+ **
+ ** Other Usage
+ ** Alternatively, this file may be used in accordance with the terms and
+ ** conditions contained in a signed written agreement between you and Nokia.
+ **/
+
+#include "cdtprosterbuffer.h"
+
+#include <debug.h>
+
+#include <QDataStream>
+#include <QFile>
+#include <QSettings>
+#include <QTemporaryFile>
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+using namespace Contactsd;
+
+static const int JournalVersion = 1;
+
+// Rewrite the journal once it holds this many obsolete records, and at least
+// as many as live ones
+static const int CompactionThreshold = 256;
+
+///////////////////////////////////////////////////////////////////////////////
+
+CDTpRosterBuffer::CDTpRosterBuffer(const QString &fileName)
+    : mFileName(fileName)
+    , mRecordCount(0)
+{
+    replay();
+    migrateSettings();
+    maybeCompact();
+}
+
+CDTpRosterBuffer::~CDTpRosterBuffer()
+{
+}
+
+void CDTpRosterBuffer::add(Operation operation, const QString &accountPath, const QStringList &contactIds, uint localId)
+{
+    QByteArray records;
+    QDataStream stream(&records, QIODevice::WriteOnly);
+
+    Entries &entries(mEntries[operation][accountPath]);
+    Q_FOREACH (const QString &id, contactIds) {
+        entries.insert(id, localId);
+        stream << quint8(AddEntry) << quint8(operation) << accountPath << id << quint32(localId);
+    }
+
+    // Adding a contact again makes its previous record obsolete
+    append(records, contactIds.count());
+    maybeCompact();
+}
+
+void CDTpRosterBuffer::remove(Operation operation, const QString &accountPath, const QStringList &contactIds)
+{
+    QHash<QString, Entries>::Iterator it = mEntries[operation].find(accountPath);
+    if (it == mEntries[operation].end()) {
+        return;
+    }
+
+    QByteArray records;
+    QDataStream stream(&records, QIODevice::WriteOnly);
+    int recordCount = 0;
+
+    Q_FOREACH (const QString &id, contactIds) {
+        if (it->remove(id)) {
+            stream << quint8(RemoveEntry) << quint8(operation) << accountPath << id << quint32(0);
+            ++recordCount;
+        }
+    }
+    if (it->isEmpty()) {
+        mEntries[operation].erase(it);
+    }
+
+    append(records, recordCount);
+    maybeCompact();
+}
+
+void CDTpRosterBuffer::removeAccount(const QString &accountPath)
+{
+    bool found = false;
+    for (int operation = 0; operation < OperationCount; ++operation) {
+        found |= (mEntries[operation].remove(accountPath) != 0);
+    }
+    if (!found) {
+        return;
+    }
+
+    QByteArray records;
+    QDataStream stream(&records, QIODevice::WriteOnly);
+    stream << quint8(RemoveAccount) << quint8(0) << accountPath << QString() << quint32(0);
+
+    append(records, 1);
+    maybeCompact();
+}
+
+CDTpRosterBuffer::Entries CDTpRosterBuffer::entries(Operation operation, const QString &accountPath) const
+{
+    return mEntries[operation].value(accountPath);
+}
+
+QSet<QString> CDTpRosterBuffer::contactIds(Operation operation, const QString &accountPath) const
+{
+    QSet<QString> ids;
+
+    const Entries entries(mEntries[operation].value(accountPath));
+    ids.reserve(entries.count());
+    for (Entries::ConstIterator it = entries.constBegin(); it != entries.constEnd(); ++it) {
+        ids.insert(it.key());
+    }
+
+    return ids;
+}
+
+void CDTpRosterBuffer::append(const QByteArray &records, int recordCount)
+{
+    if (records.isEmpty()) {
+        return;
+    }
+
+    QFile journalFile(mFileName);
+    if (not journalFile.open(QIODevice::WriteOnly | QIODevice::Append)) {
+        warning() << "Could not open roster buffer" << mFileName << "for writing:"
+                  << journalFile.errorString();
+        return;
+    }
+
+    if (journalFile.size() == 0) {
+        QDataStream stream(&journalFile);
+        stream << JournalVersion;
+    }
+
+    if (journalFile.write(records) != records.size()
+     || not journalFile.flush()
+     || ::fdatasync(journalFile.handle()) != 0) {
+        warning() << "Could not append to roster buffer" << mFileName << ":" << journalFile.errorString();
+        return;
+    }
+
+    mRecordCount += recordCount;
+}
+
+void CDTpRosterBuffer::replay()
+{
+    QFile journalFile(mFileName);
+    if (not journalFile.exists()) {
+        return;
+    }
+
+    if (not journalFile.open(QIODevice::ReadOnly)) {
+        warning() << "Could not open roster buffer" << mFileName << "for reading:"
+                  << journalFile.errorString();
+        return;
+    }
+
+    QDataStream stream(&journalFile);
+
+    if (stream.atEnd()) {
+        return;
+    }
+
+    int version;
+    stream >> version;
+
+    if (version != JournalVersion) {
+        warning() << "Wrong roster buffer version for file" << mFileName;
+        journalFile.close();
+        journalFile.remove();
+        return;
+    }
+
+    while (not stream.atEnd()) {
+        quint8 action;
+        quint8 operation;
+        QString accountPath;
+        QString id;
+        quint32 localId;
+
+        stream >> action >> operation >> accountPath >> id >> localId;
+
+        if (stream.status() != QDataStream::Ok || operation >= OperationCount) {
+            // Force a rewrite, so that later appends do not follow the torn record
+            warning() << "Discarding incomplete record in roster buffer" << mFileName;
+            mRecordCount = CompactionThreshold + 2 * entryCount();
+            break;
+        }
+
+        ++mRecordCount;
+
+        switch (action) {
+        case AddEntry:
+            mEntries[operation][accountPath].insert(id, localId);
+            break;
+        case RemoveEntry: {
+            QHash<QString, Entries>::Iterator it = mEntries[operation].find(accountPath);
+            if (it != mEntries[operation].end()) {
+                it->remove(id);
+                if (it->isEmpty()) {
+                    mEntries[operation].erase(it);
+                }
+            }
+            break;
+        }
+        case RemoveAccount:
+            for (int i = 0; i < OperationCount; ++i) {
+                mEntries[i].remove(accountPath);
+            }
+            break;
+        default:
+            break;
+        }
+    }
+
+    debug() << "Replayed" << entryCount() << "pending roster operations from" << mRecordCount << "records";
+}
+
+/* Import the buffer kept in the settings file by earlier versions */
+void CDTpRosterBuffer::migrateSettings()
+{
+    static const QString groups[OperationCount] = {
+        QString::fromLatin1("OfflineInvitations"),
+        QString::fromLatin1("OfflineRemovals")
+    };
+
+    QSettings settings(QSettings::IniFormat, QSettings::UserScope,
+                       QLatin1String("Nokia"), QLatin1String("Contactsd"));
+
+    bool migrated = false;
+    for (int operation = 0; operation < OperationCount; ++operation) {
+        settings.beginGroup(groups[operation]);
+        const QStringList keys(settings.allKeys());
+        Q_FOREACH (const QString &key, keys) {
+            // Settings keys lose the leading slash of the account path
+            const QString accountPath(key.startsWith(QLatin1Char('/')) ? key : QLatin1Char('/') + key);
+            add(Operation(operation), accountPath, settings.value(key).toStringList());
+        }
+        settings.endGroup();
+
+        if (!keys.isEmpty()) {
+            settings.remove(groups[operation]);
+            migrated = true;
+        }
+    }
+
+    if (migrated) {
+        debug() << "Migrated offline roster operations from" << settings.fileName();
+        settings.sync();
+    }
+}
+
+int CDTpRosterBuffer::entryCount() const
+{
+    int count = 0;
+    for (int operation = 0; operation < OperationCount; ++operation) {
+        Q_FOREACH (const Entries &entries, mEntries[operation]) {
+            count += entries.count();
+        }
+    }
+    return count;
+}
+
+void CDTpRosterBuffer::maybeCompact()
+{
+    const int liveCount = entryCount();
+    const int deadCount = mRecordCount - liveCount;
+    if (deadCount < CompactionThreshold || deadCount < liveCount) {
+        return;
+    }
+
+    if (liveCount == 0) {
+        QFile::remove(mFileName);
+        mRecordCount = 0;
+        return;
+    }
+
+    QByteArray data;
+    QDataStream stream(&data, QIODevice::WriteOnly);
+    stream << JournalVersion;
+
+    for (int operation = 0; operation < OperationCount; ++operation) {
+        QHash<QString, Entries>::ConstIterator it = mEntries[operation].constBegin(), end = mEntries[operation].constEnd();
+        for ( ; it != end; ++it) {
+            for (Entries::ConstIterator eit = it->constBegin(); eit != it->constEnd(); ++eit) {
+                stream << quint8(AddEntry) << quint8(operation) << it.key() << eit.key() << quint32(eit.value());
+            }
+        }
+    }
+
+    QTemporaryFile tempFile(mFileName);
+    tempFile.setAutoRemove(false);
+
+    if (not tempFile.open()) {
+        warning() << "Could not open file" << tempFile.fileName() << "for writing:" << tempFile.errorString();
+        tempFile.setAutoRemove(true);
+        return;
+    }
+
+    const bool written = tempFile.write(data) == data.size()
+                      && tempFile.flush()
+                      && ::fsync(tempFile.handle()) == 0;
+    tempFile.close();
+
+    if (not written || tempFile.error() != QFile::NoError) {
+        warning() << "Could not compact roster buffer" << mFileName << ":" << tempFile.errorString();
+        tempFile.setAutoRemove(true);
+        return;
+    }
+
+    if (::rename(tempFile.fileName().toLocal8Bit(), mFileName.toLocal8Bit()) != 0) {
+        warning() << "Could not compact roster buffer" << mFileName << ":" << strerror(errno);
+        tempFile.setAutoRemove(true);
+        return;
+    }
+
+    debug() << "Compacted roster buffer from" << mRecordCount << "to" << liveCount << "records";
+    mRecordCount = liveCount;
+}
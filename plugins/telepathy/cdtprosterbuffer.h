@@ -0,0 +1,76 @@
+/** This file is part of Contacts daemon
+ **
+ ** Copyright (c) 2010-2011 Nokia Corporation and/or its subsidiary(-ies).
+ **
+ ** Contact:  Nokia Corporation (info@qt.nokia.com)
+ **
+ ** GNU Lesser General Public License Usage
+ ** This file may be used under the terms of the GNU Lesser General Public License
+ ** version 2.1 as published by the Free Software Foundation and appearing in the
+ ** file LICENSE.LGPL included in the packaging of this file.  Please review the
+ ** following information to ensure the GNU Lesser General Public License version
+ ** 2.1 requirements will be met:
+ ** http://www.gnu.org/licenses/old-licenses/lgpl-2.1.html.
+ **
+ ** In addition, as a special exception, Nokia gives you certain additional rights.
+ ** These rights are described in the Nokia Qt LGPL Exception version 1.1, included
+ ** in the file LGPL_EXCEPTION.txt in this package.
+ **
+ ** Other Usage
+ ** Alternatively, this file may be used in accordance with the terms and
+ ** conditions contained in a signed written agreement between you and Nokia.
+ **/
+
+#ifndef CDTPROSTERBUFFER_H
+#define CDTPROSTERBUFFER_H
+
+#include <QByteArray>
+#include <QHash>
+#include <QSet>
+#include <QString>
+#include <QStringList>
+
+/* Buddy invitations and removals waiting for their account to come online,
+ * kept in an append-only journal that is compacted once it holds enough obsolete
+ * records. Each append is synced, as the operations are rare and user initiated. */
+class CDTpRosterBuffer
+{
+public:
+    enum Operation {
+        Invitation = 0,
+        Removal,
+        OperationCount
+    };
+
+    // Pending contact ids of an account, with the local contact to link them to
+    typedef QHash<QString, uint> Entries;
+
+    CDTpRosterBuffer(const QString &fileName);
+    ~CDTpRosterBuffer();
+
+    void add(Operation operation, const QString &accountPath, const QStringList &contactIds, uint localId = 0);
+    void remove(Operation operation, const QString &accountPath, const QStringList &contactIds);
+    void removeAccount(const QString &accountPath);
+
+    Entries entries(Operation operation, const QString &accountPath) const;
+    QSet<QString> contactIds(Operation operation, const QString &accountPath) const;
+
+private:
+    enum Action {
+        AddEntry = 0,
+        RemoveEntry,
+        RemoveAccount
+    };
+
+    void replay();
+    void migrateSettings();
+    void append(const QByteArray &records, int recordCount);
+    void maybeCompact();
+    int entryCount() const;
+
+    const QString mFileName;
+    QHash<QString, Entries> mEntries[OperationCount];
+    int mRecordCount;
+};
+
+#endif // CDTPROSTERBUFFER_H
@@ -0,0 +1,431 @@
+/** This file is part of Contacts daemon
+ **
+ ** Copyright (c) 2010-2011 Nokia Corporation and/or its subsidiary(-ies).
+ **
+ ** Contact:  Nokia Corporation (info@qt.nokia.com)
+ **
+ ** GNU Lesser General Public License Usage
+ ** This file may be used under the terms of the GNU Lesser General Public License
+ ** version 2.1 as published by the Free Software Foundation and appearing in the
+ ** file LICENSE.LGPL included in the packaging of this file.  Please review the
+ ** following information to ensure the GNU Lesser General Public License version
+ ** 2.1 requirements will be met:
+ ** http://www.gnu.org/licenses/old-licenses/lgpl-2.1.html.
+ **
+ ** In addition, as a special exception, Nokia gives you certain additional rights.
+ ** These rights are described in the Nokia Qt LGPL Exception version 1.1, included
+ ** in the file LGPL_EXCEPTION.txt in this package.
+ **
+ ** Other Usage
+ ** Alternatively, this file may be used in accordance with the terms and
+ ** conditions contained in a signed written agreement between you and Nokia.
+ **/
+
+#include "cdtpsqlitewriter.h"
+
+#include <QContactOnlineAccount>
+#include <QContactPresence>
+
+#include <QDateTime>
+#include <QDBusConnection>
+#include <QDBusMessage>
+#include <QDBusMetaType>
+#include <QDir>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QSqlError>
+#include <QSqlRecord>
+#include <QStandardPaths>
+#include <QSet>
+#include <QStringList>
+
+#include "debug.h"
+
+using namespace Contactsd;
+
+namespace {
+
+const QString presenceDetail(QLatin1String("Presence"));
+const QString onlineAccountDetail(QLatin1String("OnlineAccount"));
+
+// Must match the notifier of the qtcontacts-sqlite engine
+const QString notifierPath(QLatin1String("/org/nemomobile/contacts/sqlite"));
+const QString notifierInterface(QLatin1String("org.nemomobile.contacts.sqlite"));
+
+const int busyTimeout = 2000; // ms
+
+// The rank the engine gives a presence state when choosing the global presence
+// of an aggregate: the most available state wins, and an unknown one never does
+int presenceOrder(int state)
+{
+    switch (state) {
+    case QContactPresence::PresenceAvailable:
+        return 0;
+    case QContactPresence::PresenceAway:
+        return 1;
+    case QContactPresence::PresenceExtendedAway:
+        return 2;
+    case QContactPresence::PresenceBusy:
+        return 3;
+    case QContactPresence::PresenceHidden:
+        return 4;
+    case QContactPresence::PresenceOffline:
+        return 5;
+    default:
+        return 6;
+    }
+}
+
+#ifdef USING_QTPIM
+quint32 numericContactId(const QContact &contact)
+{
+    // Note: only works with the qtcontacts-sqlite backend
+    const QContactId id(contact.id());
+    if (!id.isNull()) {
+        QStringList components = id.toString().split(QChar::fromLatin1(':'));
+        const QString &idComponent = components.isEmpty() ? QString() : components.last();
+        if (idComponent.startsWith(QString::fromLatin1("sql-"))) {
+            return idComponent.mid(4).toUInt();
+        }
+    }
+    return 0;
+}
+#else
+quint32 numericContactId(const QContact &contact)
+{
+    return contact.localId();
+}
+#endif
+
+QString dateTimeString(const QDateTime &dateTime)
+{
+    // The format the qtcontacts-sqlite engine stores timestamps in
+    return dateTime.isValid() ? dateTime.toUTC().toString(QLatin1String("yyyy-MM-ddThh:mm:ss.zzz")) : QString();
+}
+
+}
+
+CDTpSqliteWriter::CDTpSqliteWriter(const QString &databasePath)
+    : mConnectionName(QString::fromLatin1("contactsd-telepathy-writer-%1").arg(quintptr(this), 0, 16))
+    , mValid(false)
+    , mGlobalPresences(false)
+{
+    qDBusRegisterMetaType<QList<quint32> >();
+
+    if (databasePath.isEmpty() || !QFile::exists(databasePath)) {
+        // Never create the database ourselves; the engine owns its schema
+        debug() << "No contacts database found at" << databasePath;
+        return;
+    }
+
+    mDatabase = QSqlDatabase::addDatabase(QLatin1String("QSQLITE"), mConnectionName);
+    mDatabase.setDatabaseName(databasePath);
+    mDatabase.setConnectOptions(QString::fromLatin1("QSQLITE_BUSY_TIMEOUT=%1").arg(busyTimeout));
+
+    if (!mDatabase.open()) {
+        warning() << "Unable to open contacts database" << databasePath << ":" << mDatabase.lastError().text();
+        return;
+    }
+
+    // Only write to a schema we know how to update
+    if (!hasColumns(QLatin1String("Details"), QStringList() << QLatin1String("detailId") << QLatin1String("contactId")
+                                                             << QLatin1String("detail") << QLatin1String("provenance"))
+     || !hasColumns(QLatin1String("Presences"), QStringList() << QLatin1String("detailId") << QLatin1String("contactId")
+                                                               << QLatin1String("presenceState")
+                                                               << QLatin1String("timestamp") << QLatin1String("nickname")
+                                                               << QLatin1String("customMessage"))
+     || !hasColumns(QLatin1String("OnlineAccounts"), QStringList() << QLatin1String("detailId") << QLatin1String("capabilities"))
+     || !hasColumns(QLatin1String("Relationships"), QStringList() << QLatin1String("firstId") << QLatin1String("secondId")
+                                                                   << QLatin1String("type"))) {
+        warning() << "Unsupported schema in contacts database" << databasePath;
+        return;
+    }
+    mGlobalPresences = hasColumns(QLatin1String("GlobalPresences"), QStringList() << QLatin1String("contactId")
+                                                                                   << QLatin1String("presenceState"));
+
+    static const QString presenceValues(QLatin1String(
+        "presenceState = :presenceState, timestamp = :timestamp, nickname = :nickname, customMessage = :customMessage"));
+    static const QString copiesOf(QLatin1String(
+        " WHERE detailId IN (SELECT detailId FROM Details WHERE provenance = :provenance)"));
+
+    if (!prepare(mSelectDetailId, QLatin1String("SELECT detailId FROM Details WHERE contactId = :contactId AND detail = :detail"))
+     || !prepare(mSelectAggregates, QLatin1String("SELECT firstId FROM Relationships WHERE secondId = :contactId AND type = 'Aggregates'"))
+     || !prepare(mUpdatePresence, QString::fromLatin1("UPDATE Presences SET ") + presenceValues + QLatin1String(" WHERE detailId = :detailId"))
+     || !prepare(mUpdatePresenceCopies, QString::fromLatin1("UPDATE Presences SET ") + presenceValues + copiesOf)
+     || !prepare(mUpdateCapabilities, QLatin1String("UPDATE OnlineAccounts SET capabilities = :capabilities WHERE detailId = :detailId"))
+     || !prepare(mUpdateCapabilitiesCopies, QString::fromLatin1("UPDATE OnlineAccounts SET capabilities = :capabilities") + copiesOf)) {
+        return;
+    }
+    if (mGlobalPresences
+     && (!prepare(mUpdateGlobalPresence, QString::fromLatin1("UPDATE GlobalPresences SET ") + presenceValues + QLatin1String(" WHERE contactId = :contactId"))
+      || !prepare(mSelectPresences, QLatin1String("SELECT presenceState, timestamp, nickname, customMessage FROM Presences WHERE contactId = :contactId")))) {
+        return;
+    }
+
+    mValid = true;
+}
+
+CDTpSqliteWriter::~CDTpSqliteWriter()
+{
+    // Queries must be released before the connection can be removed
+    mSelectDetailId = QSqlQuery();
+    mSelectAggregates = QSqlQuery();
+    mSelectPresences = QSqlQuery();
+    mUpdatePresence = QSqlQuery();
+    mUpdatePresenceCopies = QSqlQuery();
+    mUpdateGlobalPresence = QSqlQuery();
+    mUpdateCapabilities = QSqlQuery();
+    mUpdateCapabilitiesCopies = QSqlQuery();
+
+    if (mDatabase.isValid()) {
+        mDatabase.close();
+        mDatabase = QSqlDatabase();
+        QSqlDatabase::removeDatabase(mConnectionName);
+    }
+}
+
+bool CDTpSqliteWriter::isEnabled()
+{
+    // Direct writes bypass the engine, so they are only used when explicitly requested
+    static const bool enabled(!qgetenv("CONTACTSD_TELEPATHY_DIRECT_WRITES").isEmpty());
+    return enabled;
+}
+
+QString CDTpSqliteWriter::defaultDatabasePath()
+{
+    const QString dataPath(QStandardPaths::writableLocation(QStandardPaths::GenericDataLocation));
+    const QString privilegedPath(dataPath + QLatin1String("/system/privileged/Contacts/qtcontacts-sqlite/contacts.db"));
+    if (QFile::exists(privilegedPath)) {
+        return privilegedPath;
+    }
+    return dataPath + QLatin1String("/system/Contacts/qtcontacts-sqlite/contacts.db");
+}
+
+bool CDTpSqliteWriter::updateContacts(const QList<QContact> &contacts, Details details)
+{
+    if (!mValid) {
+        return false;
+    }
+    if (contacts.isEmpty() || !details) {
+        return true;
+    }
+
+    QElapsedTimer t;
+    t.start();
+
+    // Take the database write lock up front, as the engine's own writers do,
+    // rather than upgrading to it halfway through the transaction
+    QSqlQuery begin(mDatabase);
+    if (!begin.exec(QLatin1String("BEGIN IMMEDIATE"))) {
+        warning() << "Unable to begin direct write transaction:" << begin.lastError().text();
+        return false;
+    }
+
+    QList<quint32> changedIds;
+    QList<quint32> aggregateIds;
+    foreach (const QContact &contact, contacts) {
+        const quint32 contactId = numericContactId(contact);
+        if (contactId == 0 || !updateContact(contact, contactId, details, &aggregateIds)) {
+            debug() << "Direct write not possible for contact" << contactId << "- rolling back";
+            mDatabase.rollback();
+            return false;
+        }
+        changedIds.append(contactId);
+    }
+
+    aggregateIds = aggregateIds.toSet().toList();
+    if ((details & Presence) && mGlobalPresences) {
+        foreach (quint32 aggregateId, aggregateIds) {
+            if (!updateGlobalPresence(aggregateId)) {
+                debug() << "Unable to update the global presence of aggregate" << aggregateId << "- rolling back";
+                mDatabase.rollback();
+                return false;
+            }
+        }
+    }
+    changedIds += aggregateIds;
+
+    if (!mDatabase.commit()) {
+        warning() << "Unable to commit direct write transaction:" << mDatabase.lastError().text();
+        mDatabase.rollback();
+        return false;
+    }
+
+    notify(changedIds, details);
+
+    debug() << "Directly updated" << contacts.count() << "contacts - elapsed:" << t.elapsed();
+    return true;
+}
+
+bool CDTpSqliteWriter::hasColumns(const QString &table, const QStringList &columns)
+{
+    const QSqlRecord record(mDatabase.record(table));
+    foreach (const QString &column, columns) {
+        if (!record.contains(column)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool CDTpSqliteWriter::prepare(QSqlQuery &query, const QString &statement)
+{
+    query = QSqlQuery(mDatabase);
+    if (!query.prepare(statement)) {
+        warning() << "Unable to prepare statement" << statement << ":" << query.lastError().text();
+        return false;
+    }
+    return true;
+}
+
+qint64 CDTpSqliteWriter::detailId(quint32 contactId, const QString &detailName)
+{
+    mSelectDetailId.bindValue(QLatin1String(":contactId"), contactId);
+    mSelectDetailId.bindValue(QLatin1String(":detail"), detailName);
+
+    qint64 rv = -1;
+    if (!mSelectDetailId.exec()) {
+        warning() << "Unable to select" << detailName << "for contact" << contactId << ":" << mSelectDetailId.lastError().text();
+    } else if (mSelectDetailId.next()) {
+        rv = mSelectDetailId.value(0).toLongLong();
+        if (mSelectDetailId.next()) {
+            // Telepathy contacts have a single presence and account; leave anything else to the engine
+            rv = -1;
+        }
+    }
+    mSelectDetailId.finish();
+    return rv;
+}
+
+bool CDTpSqliteWriter::exec(QSqlQuery &query, bool expectRow)
+{
+    if (!query.exec()) {
+        warning() << "Direct write failed:" << query.lastError().text();
+        return false;
+    }
+    const bool rv = !expectRow || query.numRowsAffected() == 1;
+    query.finish();
+    return rv;
+}
+
+bool CDTpSqliteWriter::updateContact(const QContact &contact, quint32 contactId, Details details, QList<quint32> *aggregateIds)
+{
+    if (details & Presence) {
+        const qint64 id = detailId(contactId, presenceDetail);
+        if (id < 0) {
+            return false;
+        }
+
+        const QContactPresence presence(contact.detail<QContactPresence>());
+        const QString provenance(QString::fromLatin1("%1:%2:%3").arg(contactId).arg(presenceDetail).arg(id));
+
+        QList<QSqlQuery *> queries;
+        queries << &mUpdatePresence << &mUpdatePresenceCopies;
+        if (mGlobalPresences) {
+            queries << &mUpdateGlobalPresence;
+        }
+        foreach (QSqlQuery *query, queries) {
+            query->bindValue(QLatin1String(":presenceState"), static_cast<int>(presence.presenceState()));
+            query->bindValue(QLatin1String(":timestamp"), dateTimeString(presence.timestamp()));
+            query->bindValue(QLatin1String(":nickname"), presence.nickname());
+            query->bindValue(QLatin1String(":customMessage"), presence.customMessage());
+        }
+        mUpdatePresence.bindValue(QLatin1String(":detailId"), id);
+        mUpdatePresenceCopies.bindValue(QLatin1String(":provenance"), provenance);
+
+        if (!exec(mUpdatePresence, true) || !exec(mUpdatePresenceCopies)) {
+            return false;
+        }
+        if (mGlobalPresences) {
+            mUpdateGlobalPresence.bindValue(QLatin1String(":contactId"), contactId);
+            if (!exec(mUpdateGlobalPresence)) {
+                return false;
+            }
+        }
+    }
+
+    if (details & Capabilities) {
+        const qint64 id = detailId(contactId, onlineAccountDetail);
+        if (id < 0) {
+            return false;
+        }
+
+        const QContactOnlineAccount qcoa(contact.detail<QContactOnlineAccount>());
+        const QString capabilities(qcoa.capabilities().join(QLatin1String(";")));
+        const QString provenance(QString::fromLatin1("%1:%2:%3").arg(contactId).arg(onlineAccountDetail).arg(id));
+
+        mUpdateCapabilities.bindValue(QLatin1String(":capabilities"), capabilities);
+        mUpdateCapabilities.bindValue(QLatin1String(":detailId"), id);
+        mUpdateCapabilitiesCopies.bindValue(QLatin1String(":capabilities"), capabilities);
+        mUpdateCapabilitiesCopies.bindValue(QLatin1String(":provenance"), provenance);
+
+        if (!exec(mUpdateCapabilities, true) || !exec(mUpdateCapabilitiesCopies)) {
+            return false;
+        }
+    }
+
+    mSelectAggregates.bindValue(QLatin1String(":contactId"), contactId);
+    if (!mSelectAggregates.exec()) {
+        warning() << "Unable to select aggregates of contact" << contactId << ":" << mSelectAggregates.lastError().text();
+        return false;
+    }
+    while (mSelectAggregates.next()) {
+        aggregateIds->append(mSelectAggregates.value(0).toUInt());
+    }
+    mSelectAggregates.finish();
+    return true;
+}
+
+bool CDTpSqliteWriter::updateGlobalPresence(quint32 aggregateId)
+{
+    // The aggregate holds a copy of each constituent presence; like the engine,
+    // publish the most available one
+    mSelectPresences.bindValue(QLatin1String(":contactId"), aggregateId);
+    if (!mSelectPresences.exec()) {
+        warning() << "Unable to select presences of aggregate" << aggregateId << ":" << mSelectPresences.lastError().text();
+        return false;
+    }
+
+    QVariantList best;
+    while (mSelectPresences.next()) {
+        const int state = mSelectPresences.value(0).toInt();
+        if (best.isEmpty() || (state != QContactPresence::PresenceUnknown
+                               && (presenceOrder(state) < presenceOrder(best.at(0).toInt())
+                                   || best.at(0).toInt() == QContactPresence::PresenceUnknown))) {
+            best = QVariantList() << state << mSelectPresences.value(1)
+                                  << mSelectPresences.value(2) << mSelectPresences.value(3);
+        }
+    }
+    mSelectPresences.finish();
+
+    if (best.isEmpty()) {
+        return true;
+    }
+
+    mUpdateGlobalPresence.bindValue(QLatin1String(":presenceState"), best.at(0));
+    mUpdateGlobalPresence.bindValue(QLatin1String(":timestamp"), best.at(1));
+    mUpdateGlobalPresence.bindValue(QLatin1String(":nickname"), best.at(2));
+    mUpdateGlobalPresence.bindValue(QLatin1String(":customMessage"), best.at(3));
+    mUpdateGlobalPresence.bindValue(QLatin1String(":contactId"), aggregateId);
+    return exec(mUpdateGlobalPresence);
+}
+
+void CDTpSqliteWriter::notify(const QList<quint32> &contactIds, Details details)
+{
+    // Let other engine instances know their cached data is stale
+    QStringList signalNames;
+    if (details & Presence) {
+        signalNames.append(QLatin1String("contactsPresenceChanged"));
+    }
+    if (details & Capabilities) {
+        signalNames.append(QLatin1String("contactsChanged"));
+    }
+
+    foreach (const QString &signalName, signalNames) {
+        QDBusMessage message = QDBusMessage::createSignal(notifierPath, notifierInterface, signalName);
+        message.setArguments(QVariantList() << QVariant::fromValue(contactIds));
+        if (!QDBusConnection::sessionBus().send(message)) {
+            warning() << "Unable to send" << signalName << "notification for" << contactIds.count() << "contacts";
+        }
+    }
+}
@@ -0,0 +1,95 @@
+/** This file is part of Contacts daemon
+ **
+ ** Copyright (c) 2010-2011 Nokia Corporation and/or its subsidiary(-ies).
+ **
+ ** Contact:  Nokia Corporation (info@qt.nokia.com)
+ **
+ ** GNU Lesser General Public License Usage
+ ** This file may be used under the terms of the GNU Lesser General Public License
+ ** version 2.1 as published by the Free Software Foundation and appearing in the
+ ** file LICENSE.LGPL included in the packaging of this file.  Please review the
+ ** following information to ensure the GNU Lesser General Public License version
+ ** 2.1 requirements will be met:
+ ** http://www.gnu.org/licenses/old-licenses/lgpl-2.1.html.
+ **
+ ** In addition, as a special exception, Nokia gives you certain additional rights.
+ ** These rights are described in the Nokia Qt LGPL Exception version 1.1, included
+ ** in the file LGPL_EXCEPTION.txt in this package.
+ **
+ ** Other Usage
+ ** Alternatively, this file may be used in accordance with the terms and
+ ** conditions contained in a signed written agreement between you and Nokia.
+ **/
+
+#ifndef CDTPSQLITEWRITER_H
+#define CDTPSQLITEWRITER_H
+
+#include <QContact>
+
+#include <QList>
+#include <QSqlDatabase>
+#include <QSqlQuery>
+#include <QString>
+
+#ifdef USING_QTPIM
+QTCONTACTS_USE_NAMESPACE
+#else
+QTM_USE_NAMESPACE
+#endif
+
+// Writes presence and capability updates straight into the qtcontacts-sqlite
+// database, bypassing the per-contact overhead of QContactManager::saveContacts.
+// Only rows that already exist are updated; anything else is left to the manager.
+//
+// The global presence of affected aggregates is recomputed the way the engine
+// does it. The engine's process write lock is not taken, though: the updates are
+// only made atomic by the database lock of a single transaction, and engine
+// instances learn about them through the change notifications sent afterwards.
+// For that reason direct writes are only used when explicitly enabled.
+class CDTpSqliteWriter
+{
+public:
+    enum Detail {
+        Presence     = (1 << 0),
+        Capabilities = (1 << 1)
+    };
+    Q_DECLARE_FLAGS(Details, Detail)
+
+    CDTpSqliteWriter(const QString &databasePath = defaultDatabasePath());
+    ~CDTpSqliteWriter();
+
+    bool isValid() const { return mValid; }
+
+    // Writes all contacts in a single transaction; on failure nothing is written
+    bool updateContacts(const QList<QContact> &contacts, Details details);
+
+    static bool isEnabled();
+    static QString defaultDatabasePath();
+
+private:
+    bool hasColumns(const QString &table, const QStringList &columns);
+    bool prepare(QSqlQuery &query, const QString &statement);
+    bool exec(QSqlQuery &query, bool expectRow = false);
+    qint64 detailId(quint32 contactId, const QString &detailName);
+    bool updateContact(const QContact &contact, quint32 contactId, Details details, QList<quint32> *aggregateIds);
+    bool updateGlobalPresence(quint32 aggregateId);
+    void notify(const QList<quint32> &contactIds, Details details);
+
+    QString mConnectionName;
+    QSqlDatabase mDatabase;
+    bool mValid;
+    bool mGlobalPresences;
+
+    QSqlQuery mUpdatePresence;
+    QSqlQuery mUpdatePresenceCopies;
+    QSqlQuery mUpdateGlobalPresence;
+    QSqlQuery mUpdateCapabilities;
+    QSqlQuery mUpdateCapabilitiesCopies;
+    QSqlQuery mSelectDetailId;
+    QSqlQuery mSelectAggregates;
+    QSqlQuery mSelectPresences;
+};
+
+Q_DECLARE_OPERATORS_FOR_FLAGS(CDTpSqliteWriter::Details)
+
+#endif // CDTPSQLITEWRITER_H
@@ -60,9 +60,13 @@
 
 #include "cdtpstorage.h"
 #include "cdtpavatarupdate.h"
+#include "cdtpsqlitewriter.h"
+#include "base-plugin.h"
 #include "debug.h"
 
 #include <QElapsedTimer>
+#include <QFileInfo>
+#include <QSet>
 
 using namespace Contactsd;
 
@@ -172,8 +176,20 @@ QString stringValue(const QContactDetail &detail, F field)
 
 namespace {
 
-const int UPDATE_TIMEOUT = 150; // ms
-const int UPDATE_THRESHOLD = 50; // contacts
+// Contacts written in one turn of an account at the storage writer
+const int UPDATE_BATCH_SIZE = 250;
+
+// Recovered updates whose account has not synchronized its roster within
+// this many daemon runs are dropped
+const int RECOVERED_UPDATE_GENERATIONS = 3;
+
+// Removed accounts are purged in small steps, so that other writers get the
+// backend lock in between and the daemon stays responsive
+const int PURGE_CHUNK_SIZE = 50; // contacts
+const int PURGE_INTERVAL = 50; // ms
+// The progress of a purge only feeds the count reported when it ends, so it is
+// persisted at most this often rather than after every chunk
+const int PURGE_STATE_SAVE_INTERVAL = 5000; // ms
 
 QContactManager *manager()
 {
@@ -415,16 +431,70 @@ DetailList contactChangesList(CDTpContact::Changes changes)
     if (changes & CDTpContact::Avatar) {
         rv.append(detailType<QContactAvatar>());
     }
+    if (changes & CDTpContact::InfoAddress) {
+        rv.append(detailType<QContactAddress>());
+    }
+    if (changes & CDTpContact::InfoBirthday) {
+        rv.append(detailType<QContactBirthday>());
+    }
+    if (changes & CDTpContact::InfoEmail) {
+        rv.append(detailType<QContactEmailAddress>());
+    }
+    if (changes & CDTpContact::InfoGender) {
+        rv.append(detailType<QContactGender>());
+    }
+    if (changes & CDTpContact::InfoName) {
+        rv.append(detailType<QContactName>());
+    }
+    if ((changes & CDTpContact::InfoNickname) && !(changes & CDTpContact::Alias)) {
+        rv.append(detailType<QContactNickname>());
+    }
+    if (changes & CDTpContact::InfoNote) {
+        rv.append(detailType<QContactNote>());
+    }
+    if (changes & CDTpContact::InfoOrganization) {
+        rv.append(detailType<QContactOrganization>());
+    }
+    if (changes & CDTpContact::InfoPhone) {
+        rv.append(detailType<QContactPhoneNumber>());
+    }
+    if (changes & CDTpContact::InfoUrl) {
+        rv.append(detailType<QContactUrl>());
+    }
 
     return rv;
 }
 
-bool storeContact(QContact &contact, const QString &location, CDTpContact::Changes changes = CDTpContact::All)
+void settleInfoFingerprints(CDTpStorage::InfoFingerprintUpdates *updates, bool stored)
+{
+    // Unless the write succeeded, keep the previous fingerprints so that the
+    // info is rebuilt again on its next announcement
+    if (stored) {
+        CDTpStorage::InfoFingerprintUpdates::ConstIterator it = updates->constBegin(), end = updates->constEnd();
+        for ( ; it != end; ++it) {
+            it->first->setAppliedInfoFingerprints(it->second);
+        }
+    } else if (!updates->isEmpty()) {
+        debug() << "Discarding info fingerprints of" << updates->count() << "contacts not stored";
+    }
+    updates->clear();
+}
+
+// Self contact details affected when an account is removed from it
+const CDTpContact::Changes removedAccountChanges(CDTpContact::Presence | CDTpContact::Capabilities | CDTpContact::Avatar);
+
+bool isMinimizedUpdate(CDTpContact::Changes changes)
+{
+    return (changes != CDTpContact::All) && ((changes & CDTpContact::Information) == 0);
+}
+
+bool saveSelfContact(QContact &contact, const QString &location, CDTpContact::Changes changes)
 {
     QList<QContact> contacts;
     DetailList updates;
 
-    const bool minimizedUpdate((changes != CDTpContact::All) && ((changes & CDTpContact::Information) == 0));
+    const bool minimizedUpdate(isMinimizedUpdate(changes));
+
     if (minimizedUpdate) {
         contacts << contact;
         updates = contactChangesList(changes);
@@ -456,8 +526,63 @@ bool storeContact(QContact &contact, const QString &location, CDTpContact::Chang
     return true;
 }
 
-void updateContacts(const QString &location, QList<QContact> *saveList, QList<ContactIdType> *removeList, CDTpContact::Changes changes = CDTpContact::All)
+// Owned by the storage, which creates it when direct writes are enabled
+CDTpSqliteWriter *directWriter = 0;
+
+CDTpSqliteWriter *createDirectWriter()
+{
+    if (!CDTpSqliteWriter::isEnabled()) {
+        return 0;
+    }
+    if (manager()->managerName() != QLatin1String("org.nemomobile.contacts.sqlite")) {
+        debug() << "Direct writes are not supported by backend" << manager()->managerName();
+        return 0;
+    }
+
+    CDTpSqliteWriter *writer = new CDTpSqliteWriter;
+    if (!writer->isValid()) {
+        warning() << "Direct writes unavailable - using the contact manager";
+        delete writer;
+        return 0;
+    }
+    return writer;
+}
+
+bool writeContactsDirectly(const QString &location, const QList<QContact> &saveList, CDTpContact::Changes changes)
+{
+    // Only presence and capability updates are simple enough to bypass the manager
+    static const CDTpContact::Changes directChanges(CDTpContact::Presence | CDTpContact::Capabilities);
+    if ((changes | directChanges) != directChanges) {
+        return false;
+    }
+
+    if (!directWriter) {
+        return false;
+    }
+
+    CDTpSqliteWriter::Details details = 0;
+    if (changes & CDTpContact::Presence) {
+        details |= CDTpSqliteWriter::Presence;
+    }
+    if (changes & CDTpContact::Capabilities) {
+        details |= CDTpSqliteWriter::Capabilities;
+    }
+
+    if (!directWriter->updateContacts(saveList, details)) {
+        debug() << "Falling back to the contact manager for" << saveList.count() << "contacts from:" << location;
+        return false;
+    }
+    return true;
+}
+
+bool updateContacts(const QString &location, QList<QContact> *saveList, QList<ContactIdType> *removeList, CDTpContact::Changes changes = CDTpContact::All, int batchSize = BATCH_STORE_SIZE)
 {
+    bool allStored = true;
+
+    if (saveList && !saveList->isEmpty() && writeContactsDirectly(location, *saveList, changes)) {
+        saveList = 0;
+    }
+
     if (saveList && !saveList->isEmpty()) {
         const DetailList detailList(contactChangesList(changes));
 
@@ -467,8 +592,8 @@ void updateContacts(const QString &location, QList<QContact> *saveList, QList<Co
         // Try to store contacts in batches
         int storedCount = 0;
         while (storedCount < saveList->count()) {
-            QList<QContact> batch(saveList->mid(storedCount, BATCH_STORE_SIZE));
-            storedCount += BATCH_STORE_SIZE;
+            QList<QContact> batch(saveList->mid(storedCount, batchSize));
+            storedCount += batchSize;
 
             do {
                 bool success;
@@ -497,6 +622,7 @@ void updateContacts(const QString &location, QList<QContact> *saveList, QList<Co
                     warning() << "Failed storing contact" << asString(apiId(badContact)) << "from:" << location;
                     output(debug(), badContact);
                     batch.removeAt(errorIndex);
+                    allStored = false;
                 } while (it != begin);
             } while (true);
         }
@@ -511,10 +637,47 @@ void updateContacts(const QString &location, QList<QContact> *saveList, QList<Co
         for ( ; it != end; ++it) {
             if (!manager()->removeContact(*it)) {
                 warning() << "Unable to remove contact";
+                allStored = false;
             }
         }
         debug() << "Removed" << removeList->count() << "individual contacts - elapsed:" << t.elapsed();
     }
+
+    return allStored;
+}
+
+bool updateContacts(const QString &location, CDTpStorage::SaveBatches *saveBatches, QList<ContactIdType> *removeList)
+{
+    bool allStored = true;
+
+    if (saveBatches) {
+        // Each batch is stored with only the details its changes affect
+        CDTpStorage::SaveBatches::Iterator it = saveBatches->begin(), end = saveBatches->end();
+        for ( ; it != end; ++it) {
+            allStored &= updateContacts(location, &it.value(), 0, CDTpContact::Changes(QFlag(it.key())));
+        }
+    }
+
+    allStored &= updateContacts(location, static_cast<QList<QContact> *>(0), removeList);
+    return allStored;
+}
+
+bool batchedCommitsSupported()
+{
+    // qtcontacts-sqlite writes each saveContacts/removeContacts call in a single transaction
+    static const bool supported(manager()->managerName() == QLatin1String("org.nemomobile.contacts.sqlite"));
+    // Immediate writes can be requested to compare against the batched path
+    static const bool disabled(!qgetenv("CONTACTSD_TELEPATHY_IMMEDIATE_WRITES").isEmpty());
+    static bool reported = false;
+    if (!reported) {
+        if (!supported) {
+            debug() << "Backend" << manager()->managerName() << "does not batch writes - account syncs will be written immediately";
+        } else if (disabled) {
+            debug() << "Batched writes disabled - account syncs will be written immediately";
+        }
+        reported = true;
+    }
+    return supported && !disabled;
 }
 
 QList<ContactIdType> findContactIdsForAccount(const QString &accountPath)
@@ -525,37 +688,58 @@ QList<ContactIdType> findContactIdsForAccount(const QString &accountPath)
     return manager()->contactIds(filter);
 }
 
-QHash<QString, QContact> findExistingContacts(const QStringList &contactAddresses)
+const int maxDirectMatches = 10;
+
+// Resolve contact addresses to IDs, using the address index when there is a
+// large number of them.  An empty accountPath searches all telepathy contacts.
+QList<ContactIdType> findExistingContactIds(const QStringList &contactAddresses, const QString &accountPath = QString())
 {
-    static QContactFetchHint hint(contactFetchHint());
+    QContactIntersectionFilter filter;
+    filter << matchTelepathyFilter();
+    if (!accountPath.isEmpty()) {
+        filter << QContactOriginMetadata::matchGroupId(accountPath);
+    }
 
-    QHash<QString, QContact> rv;
+    if (contactAddresses.count() <= maxDirectMatches) {
+        QContactUnionFilter addressFilter;
+        foreach (const QString &address, contactAddresses) {
+            addressFilter << QContactOriginMetadata::matchId(address);
+        }
+        filter << addressFilter;
 
-    // If there is a large number of contacts, do a two-step fetch
-    const int maxDirectMatches = 10;
-    if (contactAddresses.count() > maxDirectMatches) {
-        QList<ContactIdType> ids;
-        QSet<QString> addressSet(contactAddresses.toSet());
+        return manager()->contactIds(filter);
+    }
 
-        // First fetch all telepathy contacts, ID data only
+    QContactFetchHint hint(contactFetchHint());
 #ifdef USING_QTPIM
-        hint.setDetailTypesHint(DetailList() << QContactOriginMetadata::Type);
+    hint.setDetailTypesHint(DetailList() << QContactOriginMetadata::Type);
 #else
-        hint.setDetailDefinitionsHint(DetailList() << QContactOriginMetadata::DefinitionName);
+    hint.setDetailDefinitionsHint(DetailList() << QContactOriginMetadata::DefinitionName);
 #endif
 
-        foreach (const QContact &contact, manager()->contacts(matchTelepathyFilter(), QList<QContactSortOrder>(), hint)) {
-            const QString &address = stringValue(contact.detail<QContactOriginMetadata>(), QContactOriginMetadata::FieldId);
-            if (addressSet.contains(address)) {
-                ids.append(apiId(contact));
-            }
+    const QSet<QString> addressSet(contactAddresses.toSet());
+    QList<ContactIdType> ids;
+
+    // Fetch the ID data only, and match it against the address set
+    foreach (const QContact &contact, manager()->contacts(filter, QList<QContactSortOrder>(), hint)) {
+        const QString &address = stringValue(contact.detail<QContactOriginMetadata>(), QContactOriginMetadata::FieldId);
+        if (addressSet.contains(address)) {
+            ids.append(apiId(contact));
         }
+    }
 
-#ifdef USING_QTPIM
-        hint.setDetailTypesHint(DetailList());
-#else
-        hint.setDetailDefinitionsHint(DetailList());
-#endif
+    return ids;
+}
+
+QHash<QString, QContact> findExistingContacts(const QStringList &contactAddresses)
+{
+    static QContactFetchHint hint(contactFetchHint());
+
+    QHash<QString, QContact> rv;
+
+    // If there is a large number of contacts, do a two-step fetch
+    if (contactAddresses.count() > maxDirectMatches) {
+        const QList<ContactIdType> ids(findExistingContactIds(contactAddresses));
 
         // Now fetch the details of the required contacts by ID
         foreach (const QContact &contact, manager()->contacts(ids, hint)) {
@@ -628,18 +812,17 @@ QString imAccount(Tp::AccountPtr account)
 
 QString imAccount(CDTpAccountPtr accountWrapper)
 {
-    return imAccount(accountWrapper->account());
+    return accountWrapper->accountPath();
 }
 
 QString imAccount(CDTpContactPtr contactWrapper)
 {
-    return imAccount(contactWrapper->accountWrapper());
+    return contactWrapper->accountPath();
 }
 
 QString imAddress(const QString &accountPath, const QString &contactId = QString())
 {
-    static const QString tmpl = QString::fromLatin1("%1!%2");
-    return tmpl.arg(accountPath, contactId.isEmpty() ? QLatin1String("self") : contactId);
+    return CDTpContact::imAddress(accountPath, contactId);
 }
 
 QString imAddress(Tp::AccountPtr account, const QString &contactId = QString())
@@ -649,18 +832,17 @@ QString imAddress(Tp::AccountPtr account, const QString &contactId = QString())
 
 QString imAddress(CDTpAccountPtr accountWrapper, const QString &contactId = QString())
 {
-    return imAddress(accountWrapper->account(), contactId);
+    return imAddress(accountWrapper->accountPath(), contactId);
 }
 
 QString imAddress(CDTpContactPtr contactWrapper)
 {
-    return imAddress(contactWrapper->accountWrapper(), contactWrapper->contact()->id());
+    return contactWrapper->address();
 }
 
 QString imPresence(const QString &accountPath, const QString &contactId = QString())
 {
-    static const QString tmpl = QString::fromLatin1("%1!%2!presence");
-    return tmpl.arg(accountPath, contactId.isEmpty() ? QLatin1String("self") : contactId);
+    return CDTpContact::imPresence(accountPath, contactId);
 }
 
 QString imPresence(Tp::AccountPtr account, const QString &contactId = QString())
@@ -670,12 +852,12 @@ QString imPresence(Tp::AccountPtr account, const QString &contactId = QString())
 
 QString imPresence(CDTpAccountPtr accountWrapper, const QString &contactId = QString())
 {
-    return imPresence(accountWrapper->account(), contactId);
+    return imPresence(accountWrapper->accountPath(), contactId);
 }
 
 QString imPresence(CDTpContactPtr contactWrapper)
 {
-    return imPresence(contactWrapper->accountWrapper(), contactWrapper->contact()->id());
+    return contactWrapper->presenceUri();
 }
 
 QContactPresence::PresenceState qContactPresenceState(Tp::ConnectionPresenceType presenceType)
@@ -811,25 +993,45 @@ void updateContactAvatars(QContact &contact, const QString &defaultAvatarPath, c
 
 QString saveAccountAvatar(CDTpAccountPtr accountWrapper)
 {
+    // Last avatar data saved for each account, with the file holding it
+    static QHash<QString, QPair<QByteArray, QString> > savedAvatars;
+
     const Tp::Avatar &avatar = accountWrapper->account()->avatar();
+    const QString accountPath(accountWrapper->accountPath());
 
     if (avatar.avatarData.isEmpty()) {
+        savedAvatars.remove(accountPath);
         return QString();
     }
 
+    // The account hands out the same data until its avatar changes, so only
+    // check that the saved file is still there instead of hashing it again
+    QHash<QString, QPair<QByteArray, QString> >::const_iterator saved = savedAvatars.constFind(accountPath);
+    if (saved != savedAvatars.constEnd()
+            && (saved->first.constData() == avatar.avatarData.constData() || saved->first == avatar.avatarData)) {
+        const QFileInfo savedFile(saved->second);
+        if (savedFile.exists() && savedFile.size() == avatar.avatarData.size()) {
+            return saved->second;
+        }
+    }
+
     // TODO: Use standard data location, and create dir if nonexistent
     static const QString tmpl = QString::fromLatin1("%1/.contacts/avatars/%2");
     QString fileName = tmpl.arg(QDir::homePath())
         .arg(QLatin1String(QCryptographicHash::hash(avatar.avatarData, QCryptographicHash::Sha1).toHex()));
 
-    QFile avatarFile(fileName);
-    if (!avatarFile.open(QIODevice::WriteOnly)) {
-        warning() << "Unable to save account avatar: error opening avatar file" << fileName << "for writing";
-        return QString();
+    // Files are named by content, so an existing one already holds this avatar
+    if (!QFile::exists(fileName)) {
+        QFile avatarFile(fileName);
+        if (!avatarFile.open(QIODevice::WriteOnly)) {
+            warning() << "Unable to save account avatar: error opening avatar file" << fileName << "for writing";
+            return QString();
+        }
+        avatarFile.write(avatar.avatarData);
+        avatarFile.close();
     }
-    avatarFile.write(avatar.avatarData);
-    avatarFile.close();
 
+    savedAvatars.insert(accountPath, qMakePair(avatar.avatarData, fileName));
     return fileName;
 }
 
@@ -1062,7 +1264,8 @@ const QString &protocolType(const QString &protocol)
 }
 #endif
 
-void updateContactDetails(QNetworkAccessManager &network, QContact &existing, CDTpContactPtr contactWrapper, CDTpContact::Changes changes)
+CDTpContact::Changes updateContactDetails(QNetworkAccessManager &network, QContact &existing, CDTpContactPtr contactWrapper, CDTpContact::Changes changes, bool newContact,
+                                          CDTpStorage::InfoFingerprintUpdates *infoFingerprints)
 {
     const QString contactAddress(imAddress(contactWrapper));
     debug() << "Update contact" << contactAddress;
@@ -1108,21 +1311,65 @@ void updateContactDetails(QNetworkAccessManager &network, QContact &existing, CD
         }
     }
     if (changes & CDTpContact::Information) {
-        if (contactWrapper->isInformationKnown()) {
-            // Delete any existing info we have for this contact
-            deleteContactDetails<QContactAddress>(existing);
-            deleteContactDetails<QContactBirthday>(existing);
-            deleteContactDetails<QContactEmailAddress>(existing);
-            deleteContactDetails<QContactGender>(existing);
-            deleteContactDetails<QContactName>(existing);
-            deleteContactDetails<QContactNickname>(existing);
-            deleteContactDetails<QContactNote>(existing);
-            deleteContactDetails<QContactOrganization>(existing);
-            deleteContactDetails<QContactPhoneNumber>(existing);
-            deleteContactDetails<QContactUrl>(existing);
+        changes &= ~CDTpContact::Information;
 
+        if (contactWrapper->isInformationKnown()) {
             Tp::ContactInfoFieldList listContactInfo = contact->infoFields().allFields();
-            if (listContactInfo.count() != 0) {
+
+            // Servers may re-announce unchanged info; only rebuild the details
+            // whose fields differ from what was applied last time
+            const CDTpContact::InfoFingerprints fingerprints(CDTpContact::infoFingerprints(listContactInfo));
+            const CDTpContact::InfoFingerprints &applied(contactWrapper->appliedInfoFingerprints());
+
+            CDTpContact::Changes infoChanges = 0;
+            for (int change = CDTpContact::InfoAddress; change <= CDTpContact::InfoUrl; change <<= 1) {
+                CDTpContact::InfoFingerprints::ConstIterator it = applied.find(change);
+                if (newContact || it == applied.constEnd() || *it != fingerprints.value(change)) {
+                    infoChanges |= static_cast<CDTpContact::Change>(change);
+                }
+            }
+
+            // Applied once the details built from them are stored
+            infoFingerprints->append(qMakePair(contactWrapper, fingerprints));
+            changes |= infoChanges;
+
+            if (infoChanges == 0) {
+                debug() << "Unchanged contact info for:" << contactAddress;
+            }
+
+            // Delete any existing info we have for the changed fields
+            if (infoChanges & CDTpContact::InfoAddress) {
+                deleteContactDetails<QContactAddress>(existing);
+            }
+            if (infoChanges & CDTpContact::InfoBirthday) {
+                deleteContactDetails<QContactBirthday>(existing);
+            }
+            if (infoChanges & CDTpContact::InfoEmail) {
+                deleteContactDetails<QContactEmailAddress>(existing);
+            }
+            if (infoChanges & CDTpContact::InfoGender) {
+                deleteContactDetails<QContactGender>(existing);
+            }
+            if (infoChanges & CDTpContact::InfoName) {
+                deleteContactDetails<QContactName>(existing);
+            }
+            if (infoChanges & CDTpContact::InfoNickname) {
+                deleteContactDetails<QContactNickname>(existing);
+            }
+            if (infoChanges & CDTpContact::InfoNote) {
+                deleteContactDetails<QContactNote>(existing);
+            }
+            if (infoChanges & CDTpContact::InfoOrganization) {
+                deleteContactDetails<QContactOrganization>(existing);
+            }
+            if (infoChanges & CDTpContact::InfoPhone) {
+                deleteContactDetails<QContactPhoneNumber>(existing);
+            }
+            if (infoChanges & CDTpContact::InfoUrl) {
+                deleteContactDetails<QContactUrl>(existing);
+            }
+
+            if (infoChanges != 0 && listContactInfo.count() != 0) {
 #ifdef USING_QTPIM
                 const int defaultContext(QContactDetail::ContextOther);
                 const int homeContext(QContactDetail::ContextHome);
@@ -1142,6 +1389,15 @@ void updateContactDetails(QNetworkAccessManager &network, QContact &existing, CD
                         continue;
                     }
 
+                    const CDTpContact::Changes fieldChanges(CDTpContact::infoFieldChanges(field.fieldName));
+                    if (fieldChanges == 0) {
+                        debug() << "Unsupported contact info field" << field.fieldName;
+                        continue;
+                    }
+                    if ((fieldChanges & infoChanges) == 0) {
+                        continue;
+                    }
+
                     // Extract field types
                     QStringList subTypes;
 #ifdef USING_QTPIM
@@ -1291,14 +1547,16 @@ void updateContactDetails(QNetworkAccessManager &network, QContact &existing, CD
                     } else if (field.fieldName == QLatin1String("nickname")) {
                         const QString nickname(asString(field, 0));
                         if (!nickname.isEmpty()) {
-                            QContactNickname nicknameDetail;
-                            nicknameDetail.setNickname(nickname);
-                            if (detailContext != invalidContext) {
-                                nicknameDetail.setContexts(detailContext);
-                            }
-
-                            if (!storeContactDetail(existing, nicknameDetail, SRC_LOC)) {
-                                warning() << SRC_LOC << "Unable to save nickname to contact";
+                            if (infoChanges & CDTpContact::InfoNickname) {
+                                QContactNickname nicknameDetail;
+                                nicknameDetail.setNickname(nickname);
+                                if (detailContext != invalidContext) {
+                                    nicknameDetail.setContexts(detailContext);
+                                }
+
+                                if (!storeContactDetail(existing, nicknameDetail, SRC_LOC)) {
+                                    warning() << SRC_LOC << "Unable to save nickname to contact";
+                                }
                             }
 
                             // Use the nickname as the customLabel if we have no 'fn' data
@@ -1363,12 +1621,10 @@ void updateContactDetails(QNetworkAccessManager &network, QContact &existing, CD
                         } else {
                             debug() << "Unsupported gender type:" << type;
                         }
-                    } else {
-                        debug() << "Unsupported contact info field" << field.fieldName;
                     }
                 }
 
-                if (!nameDetail.isEmpty()) {
+                if ((infoChanges & CDTpContact::InfoName) && !nameDetail.isEmpty()) {
                     if (!storeContactDetail(existing, nameDetail, SRC_LOC)) {
                         warning() << SRC_LOC << "Unable to save name details to contact";
                     }
@@ -1376,6 +1632,11 @@ void updateContactDetails(QNetworkAccessManager &network, QContact &existing, CD
             }
         }
     }
+    if ((changes & CDTpContact::Avatar) && !newContact && !contactWrapper->isAvatarDataLoaded()) {
+        // Keep the stored avatars until the contact is upgraded to its data; the
+        // default avatar would otherwise be replaced by the social avatar paths
+        changes &= ~CDTpContact::Avatar;
+    }
     if (changes & CDTpContact::Avatar) {
         QString defaultAvatarPath = contact->avatarData().fileName;
         if (defaultAvatarPath.isEmpty()) {
@@ -1397,6 +1658,8 @@ void updateContactDetails(QNetworkAccessManager &network, QContact &existing, CD
                 presenceState(contact->publishState()));
     }
     */
+
+    return changes;
 }
 
 template<typename T, typename R>
@@ -1430,29 +1693,229 @@ void addIconPath(QContactOnlineAccount &qcoa, Tp::AccountPtr account)
 
 } // namespace
 
+// Writes deferred while an account sync transaction is open
+struct CDTpStorage::PendingWrites
+{
+    PendingWrites() : selfChanges(0), unbatchedCalls(0) {}
+
+    QContact self;
+    CDTpContact::Changes selfChanges;
+    ContactWrites writes;
+    int unbatchedCalls; // backend writes the immediate path would have made
+};
+
+// Defers the backend writes made while synchronizing an account, so that they are
+// committed together when the scope ends rather than as a series of small transactions
+// that other writers can interleave with.  Nested scopes join the outermost one.
+class CDTpStorage::AccountSyncTransaction
+{
+public:
+    AccountSyncTransaction(CDTpStorage *storage, const QString &location)
+        : mStorage(storage)
+        , mLocation(location)
+        , mOpen(false)
+    {
+        if (!mStorage->mPendingWrites && batchedCommitsSupported()) {
+            mStorage->mPendingWrites = &mWrites;
+            mOpen = true;
+        }
+    }
+
+    ~AccountSyncTransaction()
+    {
+        if (mOpen) {
+            mStorage->mPendingWrites = 0;
+            mStorage->commitPendingWrites(mLocation, &mWrites);
+        }
+    }
+
+private:
+    Q_DISABLE_COPY(AccountSyncTransaction)
+
+    CDTpStorage *mStorage;
+    const QString mLocation;
+    PendingWrites mWrites;
+    bool mOpen;
+};
 
 CDTpStorage::CDTpStorage(QObject *parent) : QObject(parent),
-    mUpdateRunning(false)
+    mUpdateJournal(BasePlugin::cacheFileName(QLatin1String("telepathy-updates.journal"))),
+    mPurgeState(BasePlugin::cacheFileName(QLatin1String("telepathy-purges.ini")), QSettings::IniFormat),
+    mDirectWriter(createDirectWriter()),
+    mPendingWrites(0)
 {
-    mUpdateTimer.setInterval(UPDATE_TIMEOUT);
+    directWriter = mDirectWriter.data();
+
+    // Accounts take turns at the writer, with the event loop running in between
+    mUpdateTimer.setInterval(0);
     mUpdateTimer.setSingleShot(true);
     connect(&mUpdateTimer, SIGNAL(timeout()), SLOT(onUpdateQueueTimeout()));
+
+    // Updates still queued when a previous instance died are applied once
+    // the roster of their account is available again
+    mRecoveredUpdates = mUpdateJournal.replay();
+
+    CDTpUpdateJournal::Records::Iterator it = mRecoveredUpdates.begin();
+    while (it != mRecoveredUpdates.end()) {
+        if (it->generation > RECOVERED_UPDATE_GENERATIONS) {
+            debug() << "Dropping stale recovered update for:" << it.key();
+            it = mRecoveredUpdates.erase(it);
+        } else {
+            ++it;
+        }
+    }
+
+    // Resume the purges interrupted by a previous instance
+    mPurgeTimer.setInterval(PURGE_INTERVAL);
+    mPurgeTimer.setSingleShot(true);
+    connect(&mPurgeTimer, SIGNAL(timeout()), SLOT(onPurgeTimeout()));
+
+    loadPurgeState();
 }
 
 CDTpStorage::~CDTpStorage()
 {
+    directWriter = 0;
+
+    if (!mPurges.isEmpty()) {
+        savePurgeState();
+    }
+}
+
+bool CDTpStorage::storeSelfContact(QContact &self, const QString &location, CDTpContact::Changes changes)
+{
+    if (!mPendingWrites) {
+        return saveSelfContact(self, location, changes);
+    }
+
+    // Only the self contact is stored individually; keep the latest copy of it
+    if (!mPendingWrites->self.isEmpty() && apiId(mPendingWrites->self) != apiId(self)) {
+        warning() << "Replacing pending self contact" << asString(apiId(mPendingWrites->self))
+                  << "with" << asString(apiId(self)) << "from:" << location;
+    }
+    mPendingWrites->self = self;
+    mPendingWrites->selfChanges |= (isMinimizedUpdate(changes) ? changes : CDTpContact::Changes(CDTpContact::All));
+    ++mPendingWrites->unbatchedCalls;
+    return true;
 }
 
-void CDTpStorage::addNewAccount(QContact &self, CDTpAccountPtr accountWrapper)
+bool CDTpStorage::storeContacts(const QString &location, QList<QContact> *saveList, CDTpContact::Changes changes)
+{
+    if (!mPendingWrites) {
+        return updateContacts(location, saveList, 0, changes);
+    }
+
+    if (!saveList->isEmpty()) {
+        mPendingWrites->writes.saveBatches[int(changes)] += *saveList;
+        mPendingWrites->unbatchedCalls += (saveList->count() + BATCH_STORE_SIZE - 1) / BATCH_STORE_SIZE;
+    }
+    return true;
+}
+
+bool CDTpStorage::storeContacts(const QString &location, ContactWrites *writes)
+{
+    if (!mPendingWrites) {
+        const bool allStored(updateContacts(location, &writes->saveBatches, &writes->removeList));
+        settleContactWrites(writes, allStored);
+        return allStored;
+    }
+
+    // Written when the account sync transaction is committed
+    SaveBatches::ConstIterator it = writes->saveBatches.constBegin(), end = writes->saveBatches.constEnd();
+    for ( ; it != end; ++it) {
+        if (!it->isEmpty()) {
+            mPendingWrites->writes.saveBatches[it.key()] += *it;
+            mPendingWrites->unbatchedCalls += (it->count() + BATCH_STORE_SIZE - 1) / BATCH_STORE_SIZE;
+        }
+    }
+    if (!writes->removeList.isEmpty()) {
+        mPendingWrites->writes.removeList += writes->removeList;
+        mPendingWrites->unbatchedCalls += writes->removeList.count();
+    }
+
+    mPendingWrites->writes.infoFingerprints += writes->infoFingerprints;
+    writes->infoFingerprints.clear();
+    mPendingWrites->writes.contactChanges += writes->contactChanges;
+    writes->contactChanges.clear();
+    mPendingWrites->writes.recoveredUpdates += writes->recoveredUpdates;
+    writes->recoveredUpdates.clear();
+    return true;
+}
+
+void CDTpStorage::settleContactWrites(ContactWrites *writes, bool stored)
+{
+    settleInfoFingerprints(&writes->infoFingerprints, stored);
+
+    // A recovered update is only done with once its write is committed
+    if (stored) {
+        foreach (const QString &address, writes->recoveredUpdates) {
+            mRecoveredUpdates.remove(address);
+        }
+    } else {
+        // Otherwise the contacts would suppress the same values when announced again
+        ContactChanges::ConstIterator it = writes->contactChanges.constBegin(), end = writes->contactChanges.constEnd();
+        for ( ; it != end; ++it) {
+            it->first->forgetEmittedChanges(it->second);
+        }
+    }
+    writes->recoveredUpdates.clear();
+    writes->contactChanges.clear();
+}
+
+bool CDTpStorage::commitPendingWrites(const QString &location, PendingWrites *pending)
+{
+    if (pending->unbatchedCalls == 0) {
+        settleContactWrites(&pending->writes, true);
+        return true;
+    }
+
+    QElapsedTimer t;
+    t.start();
+
+    if (!pending->self.isEmpty()) {
+        const int selfKey(isMinimizedUpdate(pending->selfChanges) ? int(pending->selfChanges) : int(CDTpContact::All));
+        pending->writes.saveBatches[selfKey].prepend(pending->self);
+    }
+
+    bool allStored = true;
+    int transactions = 0;
+
+    CDTpStorage::SaveBatches::Iterator it = pending->writes.saveBatches.begin(), end = pending->writes.saveBatches.end();
+    for ( ; it != end; ++it) {
+        allStored &= updateContacts(location, &it.value(), 0, CDTpContact::Changes(QFlag(it.key())), it.value().count());
+        ++transactions;
+    }
+
+    if (!pending->writes.removeList.isEmpty()) {
+        ++transactions;
+        QMap<int, QContactManager::Error> errorMap;
+        if (!manager()->removeContacts(pending->writes.removeList, &errorMap)) {
+            // Fall back to removing the contacts one at a time
+            warning() << "Unable to remove" << pending->writes.removeList.count() << "contacts in one batch from:" << location << "error:" << manager()->error();
+            allStored &= updateContacts(location, static_cast<QList<QContact> *>(0), &pending->writes.removeList);
+        }
+    }
+
+    settleContactWrites(&pending->writes, allStored);
+
+    debug() << "Committed account sync from:" << location << "in" << transactions << "backend transactions instead of"
+            << pending->unbatchedCalls << "- elapsed:" << t.elapsed();
+    return allStored;
+}
+
+void CDTpStorage::addNewAccount(QContact &self, CDTpAccountPtr accountWrapper, CDTpContact::Changes *selfChanges)
 {
     Tp::AccountPtr account = accountWrapper->account();
 
-    const QString accountPath(imAccount(account));
-    const QString accountAddress(imAddress(account));
-    const QString accountPresence(imPresence(account));
+    const QString accountPath(imAccount(accountWrapper));
+    const QString accountAddress(imAddress(accountWrapper));
+    const QString accountPresence(imPresence(accountWrapper));
 
     debug() << "Creating new self account - account:" << accountPath << "address:" << accountAddress;
 
+    // Contacts stored from now on belong to the new account
+    cancelPurge(accountPath);
+
     // Create a new QCOA for this account
     QContactOnlineAccount newAccount;
 
@@ -1486,19 +1949,21 @@ void CDTpStorage::addNewAccount(QContact &self, CDTpAccountPtr accountWrapper)
     }
 
     // Store any information from the account
-    CDTpContact::Changes selfChanges = updateAccountDetails(self, newAccount, presence, accountWrapper, CDTpAccount::All);
+    const CDTpContact::Changes changes = updateAccountDetails(self, newAccount, presence, accountWrapper, CDTpAccount::All);
 
-    storeContact(self, SRC_LOC, selfChanges);
+    if (selfChanges) {
+        *selfChanges |= changes;
+    } else {
+        storeSelfContact(self, SRC_LOC, changes);
+    }
 }
 
 void CDTpStorage::removeExistingAccount(QContact &self, QContactOnlineAccount &existing)
 {
     const QString accountPath(stringValue(existing, QContactOnlineAccount__FieldAccountPath));
 
-    // Remove any contacts derived from this account
-    if (!manager()->removeContacts(findContactIdsForAccount(accountPath))) {
-        warning() << SRC_LOC << "Unable to remove linked contacts for account:" << accountPath << "error:" << manager()->error();
-    }
+    // Remove any contacts derived from this account in the background
+    schedulePurge(accountPath, existing.serviceProvider());
 
     // Remove any details linked from the account
     QStringList linkedUris(existing.linkedDetailUris());
@@ -1519,13 +1984,12 @@ void CDTpStorage::removeExistingAccount(QContact &self, QContactOnlineAccount &e
     }
 }
 
-bool CDTpStorage::initializeNewContact(QContact &newContact, CDTpAccountPtr accountWrapper, const QString &contactId)
+bool CDTpStorage::initializeNewContact(QContact &newContact, CDTpAccountPtr accountWrapper, const QString &contactId,
+                                       const QString &contactAddress, const QString &contactPresence)
 {
     Tp::AccountPtr account = accountWrapper->account();
 
-    const QString accountPath(imAccount(account));
-    const QString contactAddress(imAddress(account, contactId));
-    const QString contactPresence(imPresence(account, contactId));
+    const QString &accountPath(accountWrapper->accountPath());
 
     debug() << "Creating new contact - address:" << contactAddress;
 
@@ -1540,7 +2004,7 @@ bool CDTpStorage::initializeNewContact(QContact &newContact, CDTpAccountPtr acco
     // Create a metadata field to link the contact with the telepathy data
     QContactOriginMetadata metadata;
     metadata.setId(contactAddress);
-    metadata.setGroupId(imAccount(account));
+    metadata.setGroupId(accountPath);
     metadata.setEnabled(true);
     if (!storeContactDetail(newContact, metadata, SRC_LOC)) {
         warning() << SRC_LOC << "Unable to add metadata to contact:" << contactAddress;
@@ -1583,45 +2047,54 @@ bool CDTpStorage::initializeNewContact(QContact &newContact, CDTpAccountPtr acco
 
 void CDTpStorage::updateContactChanges(CDTpContactPtr contactWrapper, CDTpContact::Changes changes)
 {
-    QList<QContact> saveList;
-    QList<ContactIdType> removeList;
+    ContactWrites writes;
 
     QContact existing = findExistingContact(imAddress(contactWrapper));
-    updateContactChanges(contactWrapper, changes, existing, &saveList, &removeList);
+    updateContactChanges(contactWrapper, changes, existing, &writes);
 
-    updateContacts(SRC_LOC, &saveList, &removeList);
+    storeContacts(SRC_LOC, &writes);
 }
 
-void CDTpStorage::updateContactChanges(CDTpContactPtr contactWrapper, CDTpContact::Changes changes, QContact &existing, QList<QContact> *saveList, QList<ContactIdType> *removeList)
+void CDTpStorage::updateContactChanges(CDTpContactPtr contactWrapper, CDTpContact::Changes changes, QContact &existing, ContactWrites *writes)
 {
-    const QString accountPath(imAccount(contactWrapper));
-    const QString contactAddress(imAddress(contactWrapper));
+    const QString &accountPath(contactWrapper->accountPath());
+    const QString &contactAddress(contactWrapper->address());
 
     if (changes & CDTpContact::Deleted) {
         // This contact has been deleted
         if (!existing.isEmpty()) {
-            removeList->append(apiId(existing));
+            writes->removeList.append(apiId(existing));
         }
     } else {
-        if (existing.isEmpty()) {
-            if (!initializeNewContact(existing, contactWrapper->accountWrapper(), contactWrapper->contact()->id())) {
+        const bool newContact(existing.isEmpty());
+        if (newContact) {
+            if (!initializeNewContact(existing, contactWrapper->accountWrapper(), contactWrapper->contact()->id(),
+                                      contactWrapper->address(), contactWrapper->presenceUri())) {
                 warning() << SRC_LOC << "Unable to create contact for account:" << accountPath << contactAddress;
                 return;
             }
         }
 
-        updateContactDetails(mNetwork, existing, contactWrapper, changes);
+        const CDTpContact::Changes applied(updateContactDetails(mNetwork, existing, contactWrapper, changes, newContact, &writes->infoFingerprints));
 
-        saveList->append(existing);
+        if (newContact || (changes & CDTpContact::All) == CDTpContact::All) {
+            writes->saveBatches[CDTpContact::All].append(existing);
+        } else if (!contactChangesList(applied).isEmpty()) {
+            writes->saveBatches[int(applied)].append(existing);
+        } else {
+            debug() << "No details to store for contact:" << contactAddress;
+            return;
+        }
+        writes->contactChanges.append(qMakePair(contactWrapper, changes));
     }
 }
 
-void CDTpStorage::updateAccountChanges(QContact &self, QContactOnlineAccount &qcoa, CDTpAccountPtr accountWrapper, CDTpAccount::Changes changes)
+void CDTpStorage::updateAccountChanges(QContact &self, QContactOnlineAccount &qcoa, CDTpAccountPtr accountWrapper, CDTpAccount::Changes changes, CDTpContact::Changes *selfChanges)
 {
     Tp::AccountPtr account = accountWrapper->account();
 
-    const QString accountPath(imAccount(account));
-    const QString accountAddress(imAddress(account));
+    const QString accountPath(imAccount(accountWrapper));
+    const QString accountAddress(imAddress(accountWrapper));
 
     debug() << "Synchronizing self account - account:" << accountPath << "address:" << accountAddress;
 
@@ -1629,14 +2102,18 @@ void CDTpStorage::updateAccountChanges(QContact &self, QContactOnlineAccount &qc
     if (presence.isEmpty()) {
         warning() << SRC_LOC << "Unable to find presence to match account:" << accountPath;
     }
-    CDTpContact::Changes selfChanges = updateAccountDetails(self, qcoa, presence, accountWrapper, changes);
+    const CDTpContact::Changes accountChanges = updateAccountDetails(self, qcoa, presence, accountWrapper, changes);
 
-    if (!storeContact(self, SRC_LOC, selfChanges)) {
+    if (selfChanges) {
+        // The caller stores the self contact once all its accounts are updated
+        *selfChanges |= accountChanges;
+    } else if (!storeSelfContact(self, SRC_LOC, accountChanges)) {
         warning() << SRC_LOC << "Unable to save self contact - error:" << manager()->error();
     }
 
     if (account->isEnabled() && accountWrapper->hasRoster()) {
         QHash<QString, CDTpContact::Changes> allChanges;
+        ContactWrites writes;
 
         // Update all contacts reported in the roster changes of this account
         const QHash<QString, CDTpContact::Changes> changes = accountWrapper->rosterChanges();
@@ -1645,23 +2122,40 @@ void CDTpStorage::updateAccountChanges(QContact &self, QContactOnlineAccount &qc
             const QString address = imAddress(accountPath, it.key());
 
             // We always update contact presence since this method is called after a presence change
-            allChanges.insert(address, it.value() | CDTpContact::Presence);
+            CDTpContact::Changes contactChanges = it.value() | CDTpContact::Presence;
+
+            CDTpUpdateJournal::Records::ConstIterator recovered = mRecoveredUpdates.constFind(address);
+            if (recovered != mRecoveredUpdates.constEnd()) {
+                contactChanges |= recovered->changes;
+                writes.recoveredUpdates.append(address);
+            }
+            allChanges.insert(address, contactChanges);
         }
 
         QStringList contactAddresses;
         foreach (CDTpContactPtr contactWrapper, accountWrapper->contacts()) {
-            const QString address = imAddress(accountPath, contactWrapper->contact()->id());
+            const QString address = contactWrapper->address();
             contactAddresses.append(address);
         }
 
+        // Recovered updates of contacts no longer in the roster cannot be applied
+        const QString addressPrefix(accountPath + QLatin1Char('!'));
+        const QSet<QString> rosterAddresses(contactAddresses.toSet());
+        CDTpUpdateJournal::Records::Iterator rit = mRecoveredUpdates.begin();
+        while (rit != mRecoveredUpdates.end()) {
+            if (rit.key().startsWith(addressPrefix) && !rosterAddresses.contains(rit.key())) {
+                debug() << "Dropping recovered update for unknown contact:" << rit.key();
+                rit = mRecoveredUpdates.erase(rit);
+            } else {
+                ++rit;
+            }
+        }
+
         // Retrieve the existing contacts in a single batch
         QHash<QString, QContact> existingContacts = findExistingContacts(contactAddresses);
 
-        QList<QContact> saveList;
-        QList<ContactIdType> removeList;
-
         foreach (CDTpContactPtr contactWrapper, accountWrapper->contacts()) {
-            const QString address = imAddress(accountPath, contactWrapper->contact()->id());
+            const QString address = contactWrapper->address();
 
             QHash<QString, QContact>::Iterator existing = existingContacts.find(address);
             if (existing == existingContacts.end()) {
@@ -1686,10 +2180,10 @@ void CDTpStorage::updateAccountChanges(QContact &self, QContactOnlineAccount &qc
                 }
             }
 
-            updateContactChanges(contactWrapper, *changes, *existing, &saveList, &removeList);
+            updateContactChanges(contactWrapper, *changes, *existing, &writes);
         }
 
-        updateContacts(SRC_LOC, &saveList, &removeList);
+        storeContacts(SRC_LOC, &writes);
     } else {
         QList<QContact> saveList;
 
@@ -1726,12 +2220,14 @@ void CDTpStorage::updateAccountChanges(QContact &self, QContactOnlineAccount &qc
             saveList.append(existing);
         }
 
-        updateContacts(SRC_LOC, &saveList, 0, CDTpContact::Presence | CDTpContact::Capabilities);
+        storeContacts(SRC_LOC, &saveList, CDTpContact::Presence | CDTpContact::Capabilities);
     }
 }
 
 void CDTpStorage::syncAccounts(const QList<CDTpAccountPtr> &accounts)
 {
+    AccountSyncTransaction transaction(this, SRC_LOC);
+
     QContact self(selfContact());
     if (self.isEmpty()) {
         warning() << SRC_LOC << "Unable to retrieve self contact - error:" << manager()->error();
@@ -1744,6 +2240,9 @@ void CDTpStorage::syncAccounts(const QList<CDTpAccountPtr> &accounts)
     QSet<int> existingIndices;
     QSet<QString> removalPaths;
 
+    // All account changes are accumulated and stored in a single save
+    CDTpContact::Changes selfChanges = 0;
+
     foreach (QContactOnlineAccount existingAccount, self.details<QContactOnlineAccount>()) {
         const QString existingPath(stringValue(existingAccount, QContactOnlineAccount__FieldAccountPath));
         if (existingPath.isEmpty()) {
@@ -1754,7 +2253,7 @@ void CDTpStorage::syncAccounts(const QList<CDTpAccountPtr> &accounts)
         int index = accountPaths.indexOf(existingPath);
         if (index != -1) {
             existingIndices.insert(index);
-            updateAccountChanges(self, existingAccount, accounts.at(index), CDTpAccount::All);
+            updateAccountChanges(self, existingAccount, accounts.at(index), CDTpAccount::All, &selfChanges);
         } else {
             debug() << SRC_LOC << "Remove obsolete account:" << existingPath;
 
@@ -1768,21 +2267,31 @@ void CDTpStorage::syncAccounts(const QList<CDTpAccountPtr> &accounts)
         const QString existingPath(stringValue(existingAccount, QContactOnlineAccount__FieldAccountPath));
         if (removalPaths.contains(existingPath)) {
             removeExistingAccount(self, existingAccount);
+            selfChanges |= removedAccountChanges;
         }
     }
 
     // Add any previously unknown accounts
     for (int i = 0; i < accounts.length(); ++i) {
         if (!existingIndices.contains(i)) {
-            addNewAccount(self, accounts.at(i));
+            addNewAccount(self, accounts.at(i), &selfChanges);
         }
     }
 
-    storeContact(self, SRC_LOC);
+    if (selfChanges == 0) {
+        debug() << SRC_LOC << "No self contact changes for" << accounts.count() << "accounts";
+        return;
+    }
+
+    if (!storeSelfContact(self, SRC_LOC, selfChanges)) {
+        warning() << SRC_LOC << "Unable to save self contact - error:" << manager()->error();
+    }
 }
 
 void CDTpStorage::createAccount(CDTpAccountPtr accountWrapper)
 {
+    AccountSyncTransaction transaction(this, SRC_LOC);
+
     QContact self(selfContact());
     if (self.isEmpty()) {
         warning() << SRC_LOC << "Unable to retrieve self contact:" << manager()->error();
@@ -1807,19 +2316,18 @@ void CDTpStorage::createAccount(CDTpAccountPtr accountWrapper)
 
     QStringList contactAddresses;
     foreach (CDTpContactPtr contactWrapper, accountWrapper->contacts()) {
-        const QString address = imAddress(accountPath, contactWrapper->contact()->id());
+        const QString address = contactWrapper->address();
         contactAddresses.append(address);
     }
 
     // Retrieve the existing contacts in a single batch
     QHash<QString, QContact> existingContacts = findExistingContacts(contactAddresses);
 
-    QList<QContact> saveList;
-    QList<ContactIdType> removeList;
+    ContactWrites writes;
 
     // Add any contacts already present for this account
     foreach (CDTpContactPtr contactWrapper, accountWrapper->contacts()) {
-        const QString address = imAddress(accountPath, contactWrapper->contact()->id());
+        const QString address = contactWrapper->address();
 
         QHash<QString, QContact>::Iterator existing = existingContacts.find(address);
         if (existing == existingContacts.end()) {
@@ -1827,10 +2335,10 @@ void CDTpStorage::createAccount(CDTpAccountPtr accountWrapper)
             existing = existingContacts.insert(address, QContact());
         }
 
-        updateContactChanges(contactWrapper, CDTpContact::All, *existing, &saveList, &removeList);
+        updateContactChanges(contactWrapper, CDTpContact::All, *existing, &writes);
     }
 
-    updateContacts(SRC_LOC, &saveList, &removeList);
+    storeContacts(SRC_LOC, &writes);
 }
 
 void CDTpStorage::updateAccount(CDTpAccountPtr accountWrapper, CDTpAccount::Changes changes)
@@ -1860,6 +2368,8 @@ void CDTpStorage::removeAccount(CDTpAccountPtr accountWrapper)
 {
     cancelQueuedUpdates(accountWrapper->contacts());
 
+    AccountSyncTransaction transaction(this, SRC_LOC);
+
     QContact self(selfContact());
     if (self.isEmpty()) {
         warning() << SRC_LOC << "Unable to retrieve self contact:" << manager()->error();
@@ -1870,12 +2380,28 @@ void CDTpStorage::removeAccount(CDTpAccountPtr accountWrapper)
 
     debug() << SRC_LOC << "Remove account:" << accountPath;
 
+    if (CDTpUpdateQueue *queue = mUpdateQueues.take(accountPath)) {
+        debug() << "Update queue for" << accountPath << "-" << queue->metrics();
+        delete queue;
+    }
+    mReadyUpdateQueues.removeAll(accountPath);
+
+    const QString addressPrefix(accountPath + QLatin1Char('!'));
+    CDTpUpdateJournal::Records::Iterator it = mRecoveredUpdates.begin();
+    while (it != mRecoveredUpdates.end()) {
+        if (it.key().startsWith(addressPrefix)) {
+            it = mRecoveredUpdates.erase(it);
+        } else {
+            ++it;
+        }
+    }
+
     foreach (QContactOnlineAccount existingAccount, self.details<QContactOnlineAccount>()) {
         const QString existingPath(stringValue(existingAccount, QContactOnlineAccount__FieldAccountPath));
         if (existingPath == accountPath) {
             removeExistingAccount(self, existingAccount);
 
-            storeContact(self, SRC_LOC);
+            storeSelfContact(self, SRC_LOC);
             return;
         }
     }
@@ -1886,6 +2412,8 @@ void CDTpStorage::removeAccount(CDTpAccountPtr accountWrapper)
 // This is called when account goes online/offline
 void CDTpStorage::syncAccountContacts(CDTpAccountPtr accountWrapper)
 {
+    AccountSyncTransaction transaction(this, SRC_LOC);
+
     QContact self(selfContact());
     if (self.isEmpty()) {
         warning() << SRC_LOC << "Unable to retrieve self contact:" << manager()->error();
@@ -1909,6 +2437,8 @@ void CDTpStorage::syncAccountContacts(CDTpAccountPtr accountWrapper)
 
 void CDTpStorage::syncAccountContacts(CDTpAccountPtr accountWrapper, const QList<CDTpContactPtr> &contactsAdded, const QList<CDTpContactPtr> &contactsRemoved)
 {
+    AccountSyncTransaction transaction(this, SRC_LOC);
+
     const QString accountPath(imAccount(accountWrapper));
 
     QStringList contactAddresses;
@@ -1919,7 +2449,7 @@ void CDTpStorage::syncAccountContacts(CDTpAccountPtr accountWrapper, const QList
             continue;
         }
 
-        const QString address = imAddress(accountPath, contactWrapper->contact()->id());
+        const QString address = contactWrapper->address();
         contactAddresses.append(address);
     }
     foreach (const CDTpContactPtr &contactWrapper, contactsRemoved) {
@@ -1928,18 +2458,17 @@ void CDTpStorage::syncAccountContacts(CDTpAccountPtr accountWrapper, const QList
             continue;
         }
 
-        const QString address = imAddress(accountPath, contactWrapper->contact()->id());
+        const QString address = contactWrapper->address();
         contactAddresses.append(address);
     }
 
     // Retrieve the existing contacts in a single batch
     QHash<QString, QContact> existingContacts = findExistingContacts(contactAddresses);
 
-    QList<QContact> saveList;
-    QList<ContactIdType> removeList;
+    ContactWrites writes;
 
     foreach (const CDTpContactPtr &contactWrapper, contactsAdded) {
-        const QString address = imAddress(accountPath, contactWrapper->contact()->id());
+        const QString address = contactWrapper->address();
 
         QHash<QString, QContact>::Iterator existing = existingContacts.find(address);
         if (existing == existingContacts.end()) {
@@ -1947,10 +2476,10 @@ void CDTpStorage::syncAccountContacts(CDTpAccountPtr accountWrapper, const QList
             existing = existingContacts.insert(address, QContact());
         }
 
-        updateContactChanges(contactWrapper, CDTpContact::Added | CDTpContact::Information, *existing, &saveList, &removeList);
+        updateContactChanges(contactWrapper, CDTpContact::Added | CDTpContact::Information, *existing, &writes);
     }
     foreach (const CDTpContactPtr &contactWrapper, contactsRemoved) {
-        const QString address = imAddress(accountPath, contactWrapper->contact()->id());
+        const QString address = contactWrapper->address();
 
         QHash<QString, QContact>::Iterator existing = existingContacts.find(address);
         if (existing == existingContacts.end()) {
@@ -1958,10 +2487,10 @@ void CDTpStorage::syncAccountContacts(CDTpAccountPtr accountWrapper, const QList
             continue;
         }
 
-        updateContactChanges(contactWrapper, CDTpContact::Deleted, *existing, &saveList, &removeList);
+        updateContactChanges(contactWrapper, CDTpContact::Deleted, *existing, &writes);
     }
 
-    updateContacts(SRC_LOC, &saveList, &removeList);
+    storeContacts(SRC_LOC, &writes);
 }
 
 void CDTpStorage::createAccountContacts(CDTpAccountPtr accountWrapper, const QStringList &imIds, uint localId)
@@ -1976,14 +2505,14 @@ void CDTpStorage::createAccountContacts(CDTpAccountPtr accountWrapper, const QSt
 
     foreach (const QString &id, imIds) {
         QContact newContact;
-        if (!initializeNewContact(newContact, accountWrapper, id)) {
+        if (!initializeNewContact(newContact, accountWrapper, id, imAddress(accountPath, id), imPresence(accountPath, id))) {
             warning() << SRC_LOC << "Unable to create contact for account:" << accountPath << id;
         } else {
             saveList.append(newContact);
         }
     }
 
-    updateContacts(SRC_LOC, &saveList, 0);
+    storeContacts(SRC_LOC, &saveList);
 }
 
 /* Use this only in offline mode - use syncAccountContacts in online mode */
@@ -1994,19 +2523,13 @@ void CDTpStorage::removeAccountContacts(CDTpAccountPtr accountWrapper, const QSt
     debug() << SRC_LOC << "Remove contacts account:" << accountPath;
 
     QStringList imAddressList;
+    imAddressList.reserve(contactIds.count());
     foreach (const QString &id, contactIds) {
         imAddressList.append(imAddress(accountPath, id));
     }
 
-    QList<ContactIdType> removeIds;
-
     // Find any contacts matching the supplied ID list
-    foreach (const QContact &existing, manager()->contacts(findContactIdsForAccount(accountPath))) {
-        QContactOriginMetadata metadata = existing.detail<QContactOriginMetadata>();
-        if (imAddressList.contains(metadata.id())) {
-            removeIds.append(apiId(existing));
-        }
-    }
+    const QList<ContactIdType> removeIds(findExistingContactIds(imAddressList, accountPath));
 
     if (!manager()->removeContacts(removeIds)) {
         warning() << SRC_LOC << "Unable to remove contacts for account:" << accountPath << "error:" << manager()->error();
@@ -2015,37 +2538,74 @@ void CDTpStorage::removeAccountContacts(CDTpAccountPtr accountWrapper, const QSt
 
 void CDTpStorage::updateContact(CDTpContactPtr contactWrapper, CDTpContact::Changes changes)
 {
-    mUpdateQueue[contactWrapper] |= changes;
+    const QString &accountPath(contactWrapper->accountPath());
 
-    if (!mUpdateRunning) {
-        // Only update IM contacts in tracker after queuing 50 contacts or after
-        // not receiving an update notifiction for 150 ms. This dramatically reduces
-        // system but also keeps update latency within acceptable bounds.
-        if (!mUpdateTimer.isActive() || mUpdateQueue.count() < UPDATE_THRESHOLD) {
-            mUpdateTimer.start();
-        }
+    // Each account coalesces its updates independently, so that a busy roster
+    // does not delay the updates of other accounts
+    CDTpUpdateQueue *queue = mUpdateQueues.value(accountPath);
+    if (!queue) {
+        queue = new CDTpUpdateQueue(accountPath, this);
+        connect(queue, SIGNAL(ready(QString)), SLOT(onUpdateQueueReady(QString)));
+        mUpdateQueues.insert(accountPath, queue);
+    }
+
+    queue->enqueue(contactWrapper, changes);
+    mUpdateJournal.append(contactWrapper->address(), changes);
+}
+
+void CDTpStorage::onUpdateQueueReady(const QString &accountPath)
+{
+    if (!mReadyUpdateQueues.contains(accountPath)) {
+        mReadyUpdateQueues.append(accountPath);
+    }
+    if (!mUpdateTimer.isActive()) {
+        mUpdateTimer.start();
     }
 }
 
 void CDTpStorage::onUpdateQueueTimeout()
 {
-    debug() << "Update" << mUpdateQueue.count() << "contacts";
+    if (mReadyUpdateQueues.isEmpty()) {
+        return;
+    }
+
+    // Serve the ready accounts round-robin, one batch per turn
+    const QString accountPath(mReadyUpdateQueues.takeFirst());
+    CDTpUpdateQueue *queue = mUpdateQueues.value(accountPath);
+
+    CDTpUpdateQueue::Updates updates;
+    if (queue) {
+        updates = queue->takeBatch(UPDATE_BATCH_SIZE);
+        if (!queue->isEmpty()) {
+            mReadyUpdateQueues.append(accountPath);
+        }
+    }
+    if (!mReadyUpdateQueues.isEmpty()) {
+        mUpdateTimer.start();
+    }
+    if (updates.isEmpty()) {
+        return;
+    }
+
+    debug() << "Update" << updates.count() << "contacts for account:" << accountPath << "-" << queue->count() << "still queued";
 
     QStringList contactAddresses;
+    contactAddresses.reserve(updates.count());
 
-    QHash<CDTpContactPtr, CDTpContact::Changes>::const_iterator it = mUpdateQueue.constBegin(), end = mUpdateQueue.constEnd();
+    CDTpUpdateQueue::Updates::const_iterator it = updates.constBegin(), end = updates.constEnd();
     for ( ; it != end; ++it) {
-        CDTpContactPtr contactWrapper = it.key();
-        contactAddresses.append(imAddress(contactWrapper));
+        contactAddresses.append(it.key()->address());
     }
 
+    QElapsedTimer t;
+    t.start();
+
     // Retrieve the existing contacts in a single batch
     QHash<QString, QContact> existingContacts = findExistingContacts(contactAddresses);
 
-    QList<QContact> saveList;
-    QList<ContactIdType> removeList;
+    ContactWrites writes;
 
-    for (it = mUpdateQueue.constBegin(); it != end; ++it) {
+    for (it = updates.constBegin(); it != end; ++it) {
         CDTpContactPtr contactWrapper = it.key();
 
         // Skip the contact in case its account was deleted before this function
@@ -2057,25 +2617,177 @@ void CDTpStorage::onUpdateQueueTimeout()
             continue;
         }
 
-        const QString address(imAddress(contactWrapper));
+        const QString &address(contactWrapper->address());
         QHash<QString, QContact>::Iterator existing = existingContacts.find(address);
         if (existing == existingContacts.end()) {
             warning() << SRC_LOC << "No contact found for address:" << address;
             existing = existingContacts.insert(address, QContact());
         }
 
-        updateContactChanges(contactWrapper, it.value(), *existing, &saveList, &removeList);
+        updateContactChanges(contactWrapper, it.value(), *existing, &writes);
     }
 
-    mUpdateQueue.clear();
+    debug() << "Prepared" << updates.count() << "contact updates - elapsed:" << t.elapsed();
+
+    const bool stored(storeContacts(SRC_LOC, &writes));
+
+    debug() << "Update queue for" << accountPath << "-" << queue->metrics();
 
-    updateContacts(SRC_LOC, &saveList, &removeList);
+    // The stored batch no longer needs to be replayed after a restart
+    if (stored) {
+        compactUpdateJournal();
+    }
 }
 
 void CDTpStorage::cancelQueuedUpdates(const QList<CDTpContactPtr> &contacts)
 {
     foreach (const CDTpContactPtr &contactWrapper, contacts) {
-        mUpdateQueue.remove(contactWrapper);
+        if (CDTpUpdateQueue *queue = mUpdateQueues.value(contactWrapper->accountPath())) {
+            queue->remove(contactWrapper);
+        }
+    }
+}
+
+void CDTpStorage::compactUpdateJournal()
+{
+    // Keep only the updates still queued, and the recovered ones not applied yet,
+    // so that the journal stays bounded however long the updates keep coming
+    CDTpUpdateJournal::Records records(mRecoveredUpdates);
+
+    foreach (const CDTpUpdateQueue *queue, mUpdateQueues) {
+        CDTpUpdateQueue::Updates::ConstIterator it = queue->updates().constBegin(), end = queue->updates().constEnd();
+        for ( ; it != end; ++it) {
+            CDTpUpdateJournal::Record &record(records[it.key()->address()]);
+            record.changes |= it.value();
+            record.generation = 0;
+        }
+    }
+
+    mUpdateJournal.rewrite(records);
+}
+
+void CDTpStorage::schedulePurge(const QString &accountPath, const QString &service)
+{
+    if (mPurges.contains(accountPath)) {
+        return;
+    }
+
+    AccountPurge purge;
+    purge.service = service;
+    mPurges.insert(accountPath, purge);
+    savePurgeState();
+
+    if (!mPurgeTimer.isActive()) {
+        mPurgeTimer.start();
+    }
+}
+
+void CDTpStorage::cancelPurge(const QString &accountPath)
+{
+    QMap<QString, AccountPurge>::Iterator it = mPurges.find(accountPath);
+    if (it == mPurges.end()) {
+        return;
+    }
+
+    debug() << "Cancel purge of account:" << accountPath << "after removing" << it->removed << "contacts";
+
+    if (it->started) {
+        Q_EMIT importEnded(it->service, accountPath, 0, it->removed, 0);
+    }
+    mPurges.erase(it);
+    savePurgeState();
+}
+
+void CDTpStorage::loadPurgeState()
+{
+    const int count = mPurgeState.beginReadArray(QLatin1String("Purges"));
+    for (int i = 0; i < count; ++i) {
+        mPurgeState.setArrayIndex(i);
+
+        AccountPurge purge;
+        purge.service = mPurgeState.value(QLatin1String("service")).toString();
+        purge.removed = mPurgeState.value(QLatin1String("removed")).toInt();
+
+        const QString accountPath(mPurgeState.value(QLatin1String("account")).toString());
+        if (!accountPath.isEmpty()) {
+            debug() << "Resume purge of account:" << accountPath << "after removing" << purge.removed << "contacts";
+            mPurges.insert(accountPath, purge);
+        }
+    }
+    mPurgeState.endArray();
+
+    if (!mPurges.isEmpty()) {
+        mPurgeTimer.start();
+    }
+}
+
+void CDTpStorage::savePurgeState()
+{
+    mPurgeState.remove(QLatin1String("Purges"));
+    mPurgeState.beginWriteArray(QLatin1String("Purges"), mPurges.count());
+
+    int i = 0;
+    QMap<QString, AccountPurge>::ConstIterator it = mPurges.constBegin(), end = mPurges.constEnd();
+    for ( ; it != end; ++it, ++i) {
+        mPurgeState.setArrayIndex(i);
+        mPurgeState.setValue(QLatin1String("account"), it.key());
+        mPurgeState.setValue(QLatin1String("service"), it->service);
+        mPurgeState.setValue(QLatin1String("removed"), it->removed);
+    }
+
+    mPurgeState.endArray();
+    mPurgeState.sync();
+
+    mPurgeStateSaved.start();
+}
+
+void CDTpStorage::onPurgeTimeout()
+{
+    if (mPurges.isEmpty()) {
+        return;
+    }
+
+    QMap<QString, AccountPurge>::Iterator it = mPurges.begin();
+    const QString accountPath(it.key());
+
+    if (!it->started) {
+        it->started = true;
+        Q_EMIT importStarted(it->service, accountPath);
+    }
+
+    // The contacts are looked up once per daemon run and removed from the list
+    // chunk by chunk; the backend itself is the record of how far the purge has got
+    if (!it->fetched) {
+        it->contactIds = findContactIdsForAccount(accountPath);
+        it->fetched = true;
+    }
+    const QList<ContactIdType> chunk(it->contactIds.mid(it->next, PURGE_CHUNK_SIZE));
+    it->next += chunk.count();
+
+    int removed = chunk.count();
+    if (!chunk.isEmpty()) {
+        QMap<int, QContactManager::Error> errorMap;
+        if (!manager()->removeContacts(chunk, &errorMap)) {
+            warning() << SRC_LOC << "Unable to remove linked contacts for account:" << accountPath << "error:" << manager()->error();
+            removed = errorMap.isEmpty() ? 0 : chunk.count() - errorMap.count();
+        }
+        it->removed += removed;
+    }
+
+    const int remaining = it->contactIds.count() - it->next;
+    debug() << "Purged" << removed << "contacts of account:" << accountPath << "-" << remaining << "remaining";
+
+    // Give up rather than retry contacts the backend refuses to remove
+    if (remaining == 0 || removed == 0) {
+        Q_EMIT importEnded(it->service, accountPath, 0, it->removed, 0);
+        mPurges.erase(it);
+        savePurgeState();
+    } else if (!mPurgeStateSaved.isValid() || mPurgeStateSaved.hasExpired(PURGE_STATE_SAVE_INTERVAL)) {
+        savePurgeState();
+    }
+
+    if (!mPurges.isEmpty()) {
+        mPurgeTimer.start();
     }
 }
 
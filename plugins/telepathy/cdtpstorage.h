@@ -28,13 +28,24 @@
 #include <QContactOnlineAccount>
 
 #include <QByteArray>
+#include <QElapsedTimer>
+#include <QHash>
+#include <QMap>
 #include <QObject>
+#include <QPair>
+#include <QScopedPointer>
+#include <QSettings>
 #include <QString>
+#include <QStringList>
 #include <QUrl>
 #include <QNetworkAccessManager>
 
 #include "cdtpaccount.h"
 #include "cdtpcontact.h"
+#include "cdtpupdatejournal.h"
+#include "cdtpupdatequeue.h"
+
+class CDTpSqliteWriter;
 
 #ifdef USING_QTPIM
 QTCONTACTS_USE_NAMESPACE
@@ -47,11 +58,33 @@ class CDTpStorage : public QObject
     Q_OBJECT
 
 public:
+    // Contacts to be stored, keyed by the changes to write for them
+    typedef QMap<int, QList<QContact> > SaveBatches;
+    // Info fingerprints of contacts to be stored, applied once they are
+    typedef QList<QPair<CDTpContactPtr, CDTpContact::InfoFingerprints> > InfoFingerprintUpdates;
+    typedef QList<QPair<CDTpContactPtr, CDTpContact::Changes> > ContactChanges;
+
+    // Contact writes prepared together, and the state to settle when they are stored
+    struct ContactWrites
+    {
+        SaveBatches saveBatches;
+#ifdef USING_QTPIM
+        QList<QContactId> removeList;
+#else
+        QList<QContactLocalId> removeList;
+#endif
+        InfoFingerprintUpdates infoFingerprints;
+        ContactChanges contactChanges; // announced changes of the contacts written
+        QStringList recoveredUpdates; // addresses of the recovered journal updates folded in
+    };
+
     CDTpStorage(QObject *parent = 0);
     ~CDTpStorage();
 
 Q_SIGNALS:
     void error(int code, const QString &message);
+    void importStarted(const QString &service, const QString &account);
+    void importEnded(const QString &service, const QString &account, int contactsAdded, int contactsRemoved, int contactsMerged);
 
 public Q_SLOTS:
     void syncAccounts(const QList<CDTpAccountPtr> &accounts);
@@ -69,29 +102,69 @@ public:
     void removeAccountContacts(CDTpAccountPtr accountWrapper, const QStringList &contactIds);
 
 private Q_SLOTS:
+    void onUpdateQueueReady(const QString &accountPath);
     void onUpdateQueueTimeout();
+    void onPurgeTimeout();
 
 private:
+    struct PendingWrites;
+    class AccountSyncTransaction;
+
+    bool storeSelfContact(QContact &self, const QString &location, CDTpContact::Changes changes = CDTpContact::All);
+    bool storeContacts(const QString &location, QList<QContact> *saveList, CDTpContact::Changes changes = CDTpContact::All);
+    bool storeContacts(const QString &location, ContactWrites *writes);
+    void settleContactWrites(ContactWrites *writes, bool stored);
+    bool commitPendingWrites(const QString &location, PendingWrites *pending);
+
     void cancelQueuedUpdates(const QList<CDTpContactPtr> &contacts);
 
-    void addNewAccount(QContact &self, CDTpAccountPtr accountWrapper);
+    void addNewAccount(QContact &self, CDTpAccountPtr accountWrapper, CDTpContact::Changes *selfChanges = 0);
     void removeExistingAccount(QContact &self, QContactOnlineAccount &existing);
 
-    void updateAccountChanges(QContact &self, QContactOnlineAccount &qcoa, CDTpAccountPtr accountWrapper, CDTpAccount::Changes changes);
+    void updateAccountChanges(QContact &self, QContactOnlineAccount &qcoa, CDTpAccountPtr accountWrapper, CDTpAccount::Changes changes,
+                              CDTpContact::Changes *selfChanges = 0);
 
-    bool initializeNewContact(QContact &newContact, CDTpAccountPtr accountWrapper, const QString &contactId);
-#ifdef USING_QTPIM
-    void updateContactChanges(CDTpContactPtr contactWrapper, CDTpContact::Changes changes, QContact &existing, QList<QContact> *saveList, QList<QContactId> *removeList);
-#else
-    void updateContactChanges(CDTpContactPtr contactWrapper, CDTpContact::Changes changes, QContact &existing, QList<QContact> *saveList, QList<QContactLocalId> *removeList);
-#endif
+    bool initializeNewContact(QContact &newContact, CDTpAccountPtr accountWrapper, const QString &contactId,
+                              const QString &contactAddress, const QString &contactPresence);
+    void updateContactChanges(CDTpContactPtr contactWrapper, CDTpContact::Changes changes, QContact &existing, ContactWrites *writes);
     void updateContactChanges(CDTpContactPtr contactWrapper, CDTpContact::Changes changes);
 
+    void compactUpdateJournal();
+
+    void schedulePurge(const QString &accountPath, const QString &service);
+    void cancelPurge(const QString &accountPath);
+    void loadPurgeState();
+    void savePurgeState();
+
 private:
-    QHash<CDTpContactPtr, CDTpContact::Changes> mUpdateQueue;
+    struct AccountPurge {
+        AccountPurge() : removed(0), next(0), started(false), fetched(false) {}
+
+        QString service;
+        int removed;
+#ifdef USING_QTPIM
+        QList<QContactId> contactIds;
+#else
+        QList<QContactLocalId> contactIds;
+#endif
+        int next; // index of the first contact not yet removed in contactIds
+        bool started;
+        bool fetched;
+    };
+
+    QHash<QString, CDTpUpdateQueue *> mUpdateQueues;
+    QStringList mReadyUpdateQueues;
+    CDTpUpdateJournal mUpdateJournal;
+    CDTpUpdateJournal::Records mRecoveredUpdates;
     QNetworkAccessManager mNetwork;
     QTimer mUpdateTimer;
-    bool mUpdateRunning;
+    QMap<QString, AccountPurge> mPurges;
+    QSettings mPurgeState;
+    QTimer mPurgeTimer;
+    QElapsedTimer mPurgeStateSaved;
+    QScopedPointer<CDTpSqliteWriter> mDirectWriter;
+    // Writes of the open account sync transaction, if any
+    PendingWrites *mPendingWrites;
 };
 
 #endif // CDTPSTORAGE_H
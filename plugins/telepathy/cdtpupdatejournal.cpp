@@ -0,0 +1,228 @@
+/** This file is part of Contacts daemon
+ **
+ ** Copyright (c) 2010-2011 Nokia Corporation and/or its subsidiary(-ies).
+ **
+ ** Contact:  Nokia Corporation (info@qt.nokia.com)
+ **
+ ** GNU Lesser General Public License Usage
+ ** This file may be used under the terms of the GNU Lesser General Public License
+ ** version 2.1 as published by the Free Software Foundation and appearing in the
+ ** file LICENSE.LGPL included in the packaging of this file.  Please review the
+ ** following information to ensure the GNU Lesser General Public License version
+ ** 2.1 requirements will be met:
+ ** http://www.gnu.org/licenses/old-licenses/lgpl-2.1.html.
+ **
+ ** In addition, as a special exception, Nokia gives you certain additional rights.
+ ** These rights are described in the Nokia Qt LGPL Exception version 1.1, included
+ ** in the file LGPL_EXCEPTION.txt in this package.
+ **
+ ** Other Usage
+ ** Alternatively, this file may be used in accordance with the terms and
+ ** conditions contained in a signed written agreement between you and Nokia.
+ **/
+
+#include "cdtpupdatejournal.h"
+
+#include <debug.h>
+
+#include <QDataStream>
+#include <QFile>
+#include <QTemporaryFile>
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+using namespace Contactsd;
+
+static const int JournalVersion = 2;
+
+// Appends arriving within this window are written with a single sync
+static const int CommitTimeout = 50; // ms
+
+///////////////////////////////////////////////////////////////////////////////
+
+CDTpUpdateJournal::CDTpUpdateJournal(const QString &fileName, QObject *parent)
+    : QObject(parent)
+    , mFileName(fileName)
+{
+    mCommitTimer.setInterval(CommitTimeout);
+    mCommitTimer.setSingleShot(true);
+    connect(&mCommitTimer, SIGNAL(timeout()), SLOT(commit()));
+}
+
+CDTpUpdateJournal::~CDTpUpdateJournal()
+{
+    commit();
+}
+
+/* Queue a record of the changes pending for a contact. The record reaches
+ * the disk with the next group commit. */
+void CDTpUpdateJournal::append(const QString &contactAddress, CDTpContact::Changes changes, int generation)
+{
+    QDataStream stream(&mPending, QIODevice::WriteOnly | QIODevice::Append);
+    stream << contactAddress;
+    stream << quint32(changes);
+    stream << quint32(generation);
+
+    if (not mCommitTimer.isActive()) {
+        mCommitTimer.start();
+    }
+}
+
+void CDTpUpdateJournal::commit()
+{
+    mCommitTimer.stop();
+
+    if (mPending.isEmpty()) {
+        return;
+    }
+
+    QFile journalFile(mFileName);
+    if (not journalFile.open(QIODevice::WriteOnly | QIODevice::Append)) {
+        warning() << "Could not open update journal" << mFileName << "for writing:"
+                  << journalFile.errorString();
+        return;
+    }
+
+    if (journalFile.size() == 0) {
+        QDataStream stream(&journalFile);
+        stream << JournalVersion;
+    }
+
+    if (journalFile.write(mPending) != mPending.size()
+     || not journalFile.flush()
+     || ::fdatasync(journalFile.handle()) != 0) {
+        warning() << "Could not commit update journal" << mFileName << ":" << journalFile.errorString();
+    }
+
+    mPending.clear();
+}
+
+/* Drop all journaled records, both committed and pending. Called once the
+ * queued updates have been written to the contacts database. */
+void CDTpUpdateJournal::truncate()
+{
+    mCommitTimer.stop();
+    mPending.clear();
+
+    QFile journalFile(mFileName);
+    if (journalFile.exists() && not journalFile.resize(0)) {
+        warning() << "Could not truncate update journal" << mFileName << ":" << journalFile.errorString();
+    }
+}
+
+/* Replace all journaled records, both committed and pending, with \a records.
+ * The new journal replaces the old one atomically, so that a crash leaves
+ * either of them behind. */
+void CDTpUpdateJournal::rewrite(const Records &records)
+{
+    if (records.isEmpty()) {
+        truncate();
+        return;
+    }
+
+    mCommitTimer.stop();
+    mPending.clear();
+
+    QByteArray data;
+    QDataStream stream(&data, QIODevice::WriteOnly);
+    stream << JournalVersion;
+
+    Records::ConstIterator it = records.constBegin(), end = records.constEnd();
+    for ( ; it != end; ++it) {
+        stream << it.key();
+        stream << quint32(it->changes);
+        stream << quint32(it->generation);
+    }
+
+    QTemporaryFile tempFile(mFileName);
+    tempFile.setAutoRemove(false);
+
+    if (not tempFile.open()) {
+        warning() << "Could not open file" << tempFile.fileName() << "for writing:" << tempFile.errorString();
+        tempFile.setAutoRemove(true);
+        return;
+    }
+
+    const bool written = tempFile.write(data) == data.size()
+                      && tempFile.flush()
+                      && ::fdatasync(tempFile.handle()) == 0;
+    tempFile.close();
+
+    if (not written || tempFile.error() != QFile::NoError) {
+        warning() << "Could not rewrite update journal" << mFileName << ":" << tempFile.errorString();
+        tempFile.setAutoRemove(true);
+        return;
+    }
+
+    if (::rename(tempFile.fileName().toLocal8Bit(), mFileName.toLocal8Bit()) != 0) {
+        warning() << "Could not rewrite update journal" << mFileName << ":" << strerror(errno);
+        tempFile.setAutoRemove(true);
+        return;
+    }
+}
+
+/* Read back the records left by a previous run, one generation older than
+ * they were written. A record torn by an interrupted write ends the replay. */
+CDTpUpdateJournal::Records CDTpUpdateJournal::replay()
+{
+    Records updates;
+
+    QFile journalFile(mFileName);
+    if (not journalFile.exists()) {
+        return updates;
+    }
+
+    if (not journalFile.open(QIODevice::ReadOnly)) {
+        warning() << "Could not open update journal" << mFileName << "for reading:"
+                  << journalFile.errorString();
+        return updates;
+    }
+
+    QDataStream stream(&journalFile);
+
+    if (stream.atEnd()) {
+        return updates;
+    }
+
+    int version;
+    stream >> version;
+
+    if (version != JournalVersion) {
+        warning() << "Wrong update journal version for file" << mFileName;
+        journalFile.close();
+        journalFile.remove();
+        return updates;
+    }
+
+    while (not stream.atEnd()) {
+        QString contactAddress;
+        quint32 changes;
+        quint32 generation;
+
+        stream >> contactAddress;
+        stream >> changes;
+        stream >> generation;
+
+        if (stream.status() != QDataStream::Ok) {
+            warning() << "Discarding incomplete record in update journal" << mFileName;
+            break;
+        }
+
+        // Merged records keep the age of their most recent update
+        Records::Iterator it = updates.find(contactAddress);
+        if (it == updates.end()) {
+            it = updates.insert(contactAddress, Record());
+            it->generation = generation + 1;
+        } else {
+            it->generation = qMin<int>(it->generation, generation + 1);
+        }
+        it->changes |= CDTpContact::Changes(QFlag(changes));
+    }
+
+    debug() << "Replayed" << updates.count() << "pending contact updates from journal";
+
+    return updates;
+}
@@ -0,0 +1,65 @@
+/** This file is part of Contacts daemon
+ **
+ ** Copyright (c) 2010-2011 Nokia Corporation and/or its subsidiary(-ies).
+ **
+ ** Contact:  Nokia Corporation (info@qt.nokia.com)
+ **
+ ** GNU Lesser General Public License Usage
+ ** This file may be used under the terms of the GNU Lesser General Public License
+ ** version 2.1 as published by the Free Software Foundation and appearing in the
+ ** file LICENSE.LGPL included in the packaging of this file.  Please review the
+ ** following information to ensure the GNU Lesser General Public License version
+ ** 2.1 requirements will be met:
+ ** http://www.gnu.org/licenses/old-licenses/lgpl-2.1.html.
+ **
+ ** In addition, as a special exception, Nokia gives you certain additional rights.
+ ** These rights are described in the Nokia Qt LGPL Exception version 1.1, included
+ ** in the file LGPL_EXCEPTION.txt in this package.
+ **
+ ** Other Usage
+ ** Alternatively, this file may be used in accordance with the terms and
+ ** conditions contained in a signed written agreement between you and Nokia.
+ **/
+
+#ifndef CDTPUPDATEJOURNAL_H
+#define CDTPUPDATEJOURNAL_H
+
+#include <QByteArray>
+#include <QHash>
+#include <QObject>
+#include <QString>
+#include <QTimer>
+
+#include "cdtpcontact.h"
+
+class CDTpUpdateJournal : public QObject
+{
+    Q_OBJECT
+
+public:
+    struct Record {
+        Record() : changes(0), generation(0) {}
+
+        CDTpContact::Changes changes;
+        int generation; // daemon runs the record has been replayed in
+    };
+    typedef QHash<QString, Record> Records;
+
+    CDTpUpdateJournal(const QString &fileName, QObject *parent = 0);
+    ~CDTpUpdateJournal();
+
+    void append(const QString &contactAddress, CDTpContact::Changes changes, int generation = 0);
+    void truncate();
+    void rewrite(const Records &records);
+    Records replay();
+
+public Q_SLOTS:
+    void commit();
+
+private:
+    const QString mFileName;
+    QByteArray mPending;
+    QTimer mCommitTimer;
+};
+
+#endif // CDTPUPDATEJOURNAL_H
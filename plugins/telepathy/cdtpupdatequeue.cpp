@@ -0,0 +1,121 @@
+/** This file is part of Contacts daemon
+ **
+ ** Copyright (c) 2010-2011 Nokia Corporation and/or its subsidiary(-ies).
+ **
+ ** Contact:  Nokia Corporation (info@qt.nokia.com)
+ **
+ ** GNU Lesser General Public License Usage
+ ** This file may be used under the terms of the GNU Lesser General Public License
+ ** version 2.1 as published by the Free Software Foundation and appearing in the
+ ** file LICENSE.LGPL included in the packaging of this file.  Please review the
+ ** following information to ensure the GNU Lesser General Public License version
+ ** 2.1 requirements will be met:
+ ** http://www.gnu.org/licenses/old-licenses/lgpl-2.1.html.
+ **
+ ** In addition, as a special exception, Nokia gives you certain additional rights.
+ ** These rights are described in the Nokia Qt LGPL Exception version 1.1, included
+ ** in the file LGPL_EXCEPTION.txt in this package.
+ **
+ ** Other Usage
+ ** Alternatively, this file may be used in accordance with the terms and
+ ** conditions contained in a signed written agreement between you and Nokia.
+ **/
+
+#include "cdtpupdatequeue.h"
+
+#include <QDebug>
+
+// Only hand the queue to the storage writer after collecting 50 contacts or
+// after not receiving an update notification for 150 ms. This dramatically
+// reduces system load but also keeps update latency within acceptable bounds.
+static const int UpdateTimeout = 150; // ms
+static const int UpdateThreshold = 50; // contacts
+
+///////////////////////////////////////////////////////////////////////////////
+
+CDTpUpdateQueue::CDTpUpdateQueue(const QString &accountPath, QObject *parent)
+    : QObject(parent)
+    , mAccountPath(accountPath)
+{
+    mTimer.setInterval(UpdateTimeout);
+    mTimer.setSingleShot(true);
+    connect(&mTimer, SIGNAL(timeout()), SLOT(onTimeout()));
+}
+
+CDTpUpdateQueue::~CDTpUpdateQueue()
+{
+}
+
+void CDTpUpdateQueue::enqueue(const CDTpContactPtr &contactWrapper, CDTpContact::Changes changes)
+{
+    if (mUpdates.isEmpty()) {
+        mOldestUpdate.start();
+    }
+
+    Updates::Iterator it = mUpdates.find(contactWrapper);
+    if (it != mUpdates.end()) {
+        *it |= changes;
+        ++mMetrics.coalesced;
+    } else {
+        mUpdates.insert(contactWrapper, changes);
+        mMetrics.maxDepth = qMax(mMetrics.maxDepth, mUpdates.count());
+    }
+    ++mMetrics.queued;
+
+    if (!mTimer.isActive() || mUpdates.count() < UpdateThreshold) {
+        mTimer.start();
+    }
+}
+
+void CDTpUpdateQueue::remove(const CDTpContactPtr &contactWrapper)
+{
+    mUpdates.remove(contactWrapper);
+    if (mUpdates.isEmpty()) {
+        mTimer.stop();
+    }
+}
+
+/* Take up to maxCount queued updates; whatever remains waits for the next
+ * turn of this account at the storage writer. */
+CDTpUpdateQueue::Updates CDTpUpdateQueue::takeBatch(int maxCount)
+{
+    Updates batch;
+
+    if (mUpdates.count() <= maxCount) {
+        batch.swap(mUpdates);
+        mTimer.stop();
+    } else {
+        Updates::Iterator it = mUpdates.begin();
+        while (batch.count() < maxCount) {
+            batch.insert(it.key(), it.value());
+            it = mUpdates.erase(it);
+        }
+    }
+
+    if (!batch.isEmpty()) {
+        ++mMetrics.batches;
+        mMetrics.written += batch.count();
+        mMetrics.maxLatency = qMax(mMetrics.maxLatency, mOldestUpdate.elapsed());
+        mOldestUpdate.start();
+    }
+
+    return batch;
+}
+
+void CDTpUpdateQueue::onTimeout()
+{
+    if (!mUpdates.isEmpty()) {
+        Q_EMIT ready(mAccountPath);
+    }
+}
+
+QDebug operator<<(QDebug debug, const CDTpUpdateQueue::Metrics &metrics)
+{
+    debug.nospace() << "queued: " << metrics.queued
+                    << " coalesced: " << metrics.coalesced
+                    << " written: " << metrics.written
+                    << " batches: " << metrics.batches
+                    << " max depth: " << metrics.maxDepth
+                    << " max latency: " << metrics.maxLatency << "ms";
+    return debug.space();
+}
@@ -0,0 +1,83 @@
+/** This file is part of Contacts daemon
+ **
+ ** Copyright (c) 2010-2011 Nokia Corporation and/or its subsidiary(-ies).
+ **
+ ** Contact:  Nokia Corporation (info@qt.nokia.com)
+ **
+ ** GNU Lesser General Public License Usage
+ ** This file may be used under the terms of the GNU Lesser General Public License
+ ** version 2.1 as published by the Free Software Foundation and appearing in the
+ ** file LICENSE.LGPL included in the packaging of this file.  Please review the
+ ** following information to ensure the GNU Lesser General Public License version
+ ** 2.1 requirements will be met:
+ ** http://www.gnu.org/licenses/old-licenses/lgpl-2.1.html.
+ **
+ ** In addition, as a special exception, Nokia gives you certain additional rights.
+ ** These rights are described in the Nokia Qt LGPL Exception version 1.1, included
+ ** in the file LGPL_EXCEPTION.txt in this package.
+ **
+ ** Other Usage
+ ** Alternatively, this file may be used in accordance with the terms and
+ ** conditions contained in a signed written agreement between you and Nokia.
+ **/
+
+#ifndef CDTPUPDATEQUEUE_H
+#define CDTPUPDATEQUEUE_H
+
+#include <QDebug>
+#include <QElapsedTimer>
+#include <QHash>
+#include <QObject>
+#include <QString>
+#include <QTimer>
+
+#include "cdtpcontact.h"
+
+class CDTpUpdateQueue : public QObject
+{
+    Q_OBJECT
+
+public:
+    typedef QHash<CDTpContactPtr, CDTpContact::Changes> Updates;
+
+    struct Metrics {
+        Metrics() : queued(0), coalesced(0), written(0), batches(0), maxDepth(0), maxLatency(0) {}
+
+        quint64 queued;     // updates received
+        quint64 coalesced;  // updates merged into an already queued contact
+        quint64 written;    // contacts handed to the storage writer
+        quint64 batches;
+        int maxDepth;
+        qint64 maxLatency;  // ms from the oldest queued update to its batch
+    };
+
+    CDTpUpdateQueue(const QString &accountPath, QObject *parent = 0);
+    ~CDTpUpdateQueue();
+
+    const QString & accountPath() const { return mAccountPath; }
+    const Metrics & metrics() const { return mMetrics; }
+    int count() const { return mUpdates.count(); }
+    bool isEmpty() const { return mUpdates.isEmpty(); }
+    const Updates & updates() const { return mUpdates; }
+
+    void enqueue(const CDTpContactPtr &contactWrapper, CDTpContact::Changes changes);
+    void remove(const CDTpContactPtr &contactWrapper);
+    Updates takeBatch(int maxCount);
+
+Q_SIGNALS:
+    void ready(const QString &accountPath);
+
+private Q_SLOTS:
+    void onTimeout();
+
+private:
+    const QString mAccountPath;
+    Updates mUpdates;
+    QTimer mTimer;
+    QElapsedTimer mOldestUpdate;
+    Metrics mMetrics;
+};
+
+QDebug operator<<(QDebug debug, const CDTpUpdateQueue::Metrics &metrics);
+
+#endif // CDTPUPDATEQUEUE_H
@@ -22,7 +22,7 @@
 
 TEMPLATE = lib
 QT -= gui
-QT += dbus network
+QT += dbus network sql
 
 CONFIG += plugin link_pkgconfig
 
@@ -49,20 +49,28 @@ HEADERS  = cdtpaccount.h \
     types.h \
     cdtpcontact.h \
     cdtpcontroller.h \
+    cdtprosterbuffer.h \
     cdtpplugin.h \
     cdtpstorage.h \
+    cdtpsqlitewriter.h \
     buddymanagementadaptor.h \
-    cdtpavatarupdate.h
+    cdtpavatarupdate.h \
+    cdtpupdatejournal.h \
+    cdtpupdatequeue.h
 
 SOURCES  = cdtpaccount.cpp \
     cdtpaccountcacheloader.cpp \
     cdtpaccountcachewriter.cpp \
     cdtpcontact.cpp \
     cdtpcontroller.cpp \
+    cdtprosterbuffer.cpp \
     cdtpplugin.cpp \
     cdtpstorage.cpp \
+    cdtpsqlitewriter.cpp \
     buddymanagementadaptor.cpp \
-    cdtpavatarupdate.cpp
+    cdtpavatarupdate.cpp \
+    cdtpupdatejournal.cpp \
+    cdtpupdatequeue.cpp
 
 VERSIONED_PACKAGENAME=contactsd-1.0
 
@@ -0,0 +1,357 @@
+/** This file is part of Contacts daemon
+ **
+ ** Copyright (c) 2010-2011 Nokia Corporation and/or its subsidiary(-ies).
+ **
+ ** Contact:  Nokia Corporation (info@qt.nokia.com)
+ **
+ ** GNU Lesser General Public License Usage
+ ** This file may be used under the terms of the GNU Lesser General Public License
+ ** version 2.1 as published by the Free Software Foundation and appearing in the
+ ** file LICENSE.LGPL included in the packaging of this file.  Please review the
+ ** following information to ensure the GNU Lesser General Public License version
+ ** 2.1 requirements will be met:
+ ** http://www.gnu.org/licenses/old-licenses/lgpl-2.1.html.
+ **
+ ** In addition, as a special exception, Nokia gives you certain additional rights.
+ ** These rights are described in the Nokia Qt LGPL Exception version 1.1, included
+ ** in the file LGPL_EXCEPTION.txt in this package.
+ **
+ ** Other Usage
+ ** Alternatively, this file may be used in accordance with the terms and
+ ** conditions contained in a signed written agreement between you and Nokia.
+ **/
+
+#include "bench-birthday-plugin.h"
+
+#include <test-common.h>
+
+#include <extendedstorage.h>
+#include <extendedcalendar.h>
+
+#include <QContactBirthday>
+#include <QContactName>
+
+#include <QDirIterator>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QStandardPaths>
+
+#include <stdio.h>
+
+// A random ID, from plugins/birthday/cdbirthdaycalendar.cpp.
+const QLatin1String calNotebookId("b1376da7-5555-1111-2222-227549c4e570");
+
+static const int seedChunkSize = 500;
+static const int coldSyncContacts = 5000;
+static const int incrementalSamples = 9;
+static const int fullSyncTimeout = 900000; // ms
+static const int incrementalTimeout = 15000; // ms
+
+#ifdef USING_QTPIM
+QContactId apiId(const QContact &contact) { return contact.id(); }
+#else
+QContactLocalId apiId(const QContact &contact) { return contact.localId(); }
+#endif
+
+
+BenchBirthdayPlugin::BenchBirthdayPlugin(QObject *parent) :
+    QObject(parent),
+    mManager(0),
+    mLogOffset(0)
+{
+}
+
+void BenchBirthdayPlugin::initTestCase()
+{
+#ifdef USING_QTPIM
+    mManager = new QContactManager(QStringLiteral("org.nemomobile.contacts.sqlite"));
+#else
+    mManager = new QContactManager;
+#endif
+
+    // Results are written as one JSON object per line, to stdout unless
+    // BIRTHDAY_BENCHMARK_RESULTS names a file.
+    const QString resultsPath = QString::fromLocal8Bit(qgetenv("BIRTHDAY_BENCHMARK_RESULTS"));
+    if (resultsPath.isEmpty()) {
+        QVERIFY(mResults.open(stdout, QIODevice::WriteOnly));
+    } else {
+        mResults.setFileName(resultsPath);
+        QVERIFY2(mResults.open(QIODevice::WriteOnly | QIODevice::Append), qPrintable(mResults.errorString()));
+    }
+
+    mDaemon.setProcessChannelMode(QProcess::MergedChannels);
+}
+
+void BenchBirthdayPlugin::benchColdFullSync()
+{
+    QVERIFY2(seedContacts(coldSyncContacts), "Error seeding contacts");
+
+    // Without stamp file the daemon drops the old notebook (DropOldDB) and
+    // writes every birthday again
+    removeDaemonCache();
+
+    QElapsedTimer timer;
+    timer.start();
+
+    QVERIFY2(startDaemon(), qPrintable(mDaemon.errorString()));
+
+    const QRegularExpressionMatch fullSync = waitForLog(
+            QRegularExpression(QLatin1String("Full birthday sync of (\\d+) contacts finished.*elapsed: (\\d+)")),
+            fullSyncTimeout);
+    QVERIFY2(fullSync.hasMatch(), "Full sync did not finish");
+
+    // From daemon start until every birthday is committed to the calendar
+    const qint64 coldSyncTime = timer.elapsed();
+
+    stopDaemon();
+
+    mKCal::ExtendedCalendar::Ptr calendar =
+        mKCal::ExtendedCalendar::Ptr(new mKCal::ExtendedCalendar(KDateTime::Spec::LocalZone()));
+    mKCal::ExtendedStorage::Ptr storage =
+        mKCal::ExtendedCalendar::defaultStorage(calendar);
+    QVERIFY(storage->open());
+    QVERIFY2(storage->loadNotebookIncidences(calNotebookId), "Unable to load events from notebook");
+    QVERIFY(calendar->events().count() >= coldSyncContacts);
+    QVERIFY(storage->close());
+
+    report(coldSyncContacts, QLatin1String("coldFullSync"), coldSyncTime, QLatin1String("ms"));
+    report(coldSyncContacts, QLatin1String("coldFullSyncDaemon"), fullSync.captured(2).toLongLong(), QLatin1String("ms"));
+
+    // The data rows of benchBirthdays seed their own contacts
+    removeContacts();
+
+    QTest::setBenchmarkResult(coldSyncTime, QTest::WalltimeMilliseconds);
+}
+
+void BenchBirthdayPlugin::benchBirthdays_data()
+{
+    QTest::addColumn<int>("contacts");
+    QTest::newRow("1k") << 1000;
+    QTest::newRow("10k") << 10000;
+    QTest::newRow("50k") << 50000;
+}
+
+void BenchBirthdayPlugin::benchBirthdays()
+{
+    QFETCH(int, contacts);
+
+    QVERIFY2(seedContacts(contacts), "Error seeding contacts");
+
+    // Without stamp file and fingerprints the daemon starts with a cold full sync
+    removeDaemonCache();
+    QVERIFY2(startDaemon(), qPrintable(mDaemon.errorString()));
+
+    // Full sync time, as measured by the daemon itself
+    const QRegularExpressionMatch fullSync = waitForLog(
+            QRegularExpression(QLatin1String("Full birthday sync of (\\d+) contacts finished.*elapsed: (\\d+)")),
+            fullSyncTimeout);
+    QVERIFY2(fullSync.hasMatch(), "Full sync did not finish");
+    QVERIFY(fullSync.captured(1).toInt() >= contacts);
+
+    const qint64 fullSyncTime = fullSync.captured(2).toLongLong();
+    report(contacts, QLatin1String("fullSync"), fullSyncTime, QLatin1String("ms"));
+
+    // Incremental latency, from saving a contact until its birthday is committed
+    QList<qint64> latencies;
+    for (int i = 0; i < incrementalSamples; ++i) {
+        QContact &contact = mContacts[i];
+        QContactBirthday birthday = contact.detail<QContactBirthday>();
+        birthday.setDate(birthday.date().addDays(1));
+        QVERIFY(contact.saveDetail(&birthday));
+
+        QElapsedTimer timer;
+        timer.start();
+
+        QVERIFY(mManager->saveContact(&contact));
+        QVERIFY2(waitForLog(QRegularExpression(QLatin1String("Committed \\d+ birthday events")),
+                            incrementalTimeout).hasMatch(), "Birthday change was not committed");
+
+        latencies.append(timer.elapsed());
+    }
+
+    qSort(latencies);
+    report(contacts, QLatin1String("incrementalLatency"), latencies.at(latencies.count() / 2), QLatin1String("ms"));
+    report(contacts, QLatin1String("incrementalLatencyMax"), latencies.last(), QLatin1String("ms"));
+
+    report(contacts, QLatin1String("peakRss"), daemonPeakRss(), QLatin1String("kB"));
+
+    stopDaemon();
+
+    // Notebook load time, as seen by any other calendar client
+    mKCal::ExtendedCalendar::Ptr calendar =
+        mKCal::ExtendedCalendar::Ptr(new mKCal::ExtendedCalendar(KDateTime::Spec::LocalZone()));
+    mKCal::ExtendedStorage::Ptr storage =
+        mKCal::ExtendedCalendar::defaultStorage(calendar);
+    QVERIFY(storage->open());
+
+    QElapsedTimer timer;
+    timer.start();
+    QVERIFY2(storage->loadNotebookIncidences(calNotebookId), "Unable to load events from notebook");
+    report(contacts, QLatin1String("notebookLoad"), timer.elapsed(), QLatin1String("ms"));
+
+    QVERIFY(calendar->events().count() >= contacts);
+    QVERIFY(storage->close());
+
+    QTest::setBenchmarkResult(fullSyncTime, QTest::WalltimeMilliseconds);
+}
+
+void BenchBirthdayPlugin::cleanup()
+{
+    stopDaemon();
+}
+
+void BenchBirthdayPlugin::cleanupTestCase()
+{
+    removeContacts();
+
+    delete mManager;
+    mManager = 0;
+}
+
+bool BenchBirthdayPlugin::seedContacts(int count)
+{
+    // Data rows grow the same set of contacts, so only the difference is saved
+    const QDate firstBirthday(1950, 1, 1);
+
+    while (mContacts.count() < count) {
+        QList<QContact> chunk;
+
+        for (int i = mContacts.count(); i < count && chunk.count() < seedChunkSize; ++i) {
+            QContactName name;
+            name.setFirstName(QLatin1String("Benchmark"));
+            name.setLastName(QString::number(i));
+            QContactBirthday birthday;
+            birthday.setDate(firstBirthday.addDays(i % 20000));
+
+            QContact contact;
+            contact.saveDetail(&name);
+            contact.saveDetail(&birthday);
+            chunk.append(contact);
+        }
+
+        if (not mManager->saveContacts(&chunk)) {
+            qWarning() << "Error saving contacts:" << mManager->error();
+            return false;
+        }
+
+        mContacts += chunk;
+    }
+
+    return true;
+}
+
+void BenchBirthdayPlugin::removeContacts()
+{
+#ifdef USING_QTPIM
+    QList<QContactId> ids;
+#else
+    QList<QContactLocalId> ids;
+#endif
+    Q_FOREACH (const QContact &contact, mContacts) {
+        ids.append(apiId(contact));
+    }
+
+    // Remove all contacts seeded during the run.
+    mManager->removeContacts(ids);
+    mContacts.clear();
+}
+
+void BenchBirthdayPlugin::removeDaemonCache()
+{
+    QDirIterator it(QStandardPaths::writableLocation(QStandardPaths::GenericCacheLocation),
+                    QStringList() << QLatin1String("calendar.stamp") << QLatin1String("calendar.fingerprints"),
+                    QDir::Files, QDirIterator::Subdirectories);
+
+    while (it.hasNext()) {
+        QFile::remove(it.next());
+    }
+}
+
+bool BenchBirthdayPlugin::startDaemon()
+{
+    QString program = QString::fromLocal8Bit(qgetenv("CONTACTSD_BINARY"));
+    if (program.isEmpty()) {
+        program = QLatin1String("/usr/bin/contactsd");
+    }
+
+    mDaemonLog.clear();
+    mLogOffset = 0;
+
+    mDaemon.start(program, QStringList() << QLatin1String("--plugins") << QLatin1String("birthday")
+                                         << QLatin1String("--log-console"));
+    return mDaemon.waitForStarted();
+}
+
+void BenchBirthdayPlugin::stopDaemon()
+{
+    if (mDaemon.state() == QProcess::NotRunning) {
+        return;
+    }
+
+    mDaemon.terminate();
+    if (not mDaemon.waitForFinished(10000)) {
+        mDaemon.kill();
+        mDaemon.waitForFinished();
+    }
+}
+
+QRegularExpressionMatch BenchBirthdayPlugin::waitForLog(const QRegularExpression &pattern, int timeout)
+{
+    QElapsedTimer timer;
+    timer.start();
+
+    forever {
+        // Only complete lines not matched before are considered
+        int end;
+        while ((end = mDaemonLog.indexOf('\n', mLogOffset)) != -1) {
+            const QString line = QString::fromLocal8Bit(mDaemonLog.constData() + mLogOffset, end - mLogOffset);
+            mLogOffset = end + 1;
+
+            const QRegularExpressionMatch match = pattern.match(line);
+            if (match.hasMatch()) {
+                return match;
+            }
+        }
+
+        const qint64 remaining = timeout - timer.elapsed();
+        if (remaining <= 0 || mDaemon.state() == QProcess::NotRunning) {
+            return QRegularExpressionMatch();
+        }
+
+        if (mDaemon.waitForReadyRead(remaining)) {
+            mDaemonLog += mDaemon.readAll();
+        }
+    }
+}
+
+qint64 BenchBirthdayPlugin::daemonPeakRss() const
+{
+    QFile status(QString::fromLatin1("/proc/%1/status").arg(mDaemon.pid()));
+    if (not status.open(QIODevice::ReadOnly)) {
+        return -1;
+    }
+
+    // VmHWM is the peak resident set size, in kB
+    Q_FOREACH (const QByteArray &line, status.readAll().split('\n')) {
+        if (line.startsWith("VmHWM:")) {
+            return line.mid(6).trimmed().split(' ').first().toLongLong();
+        }
+    }
+
+    return -1;
+}
+
+void BenchBirthdayPlugin::report(int contacts, const QString &metric, qint64 value, const QString &unit)
+{
+    QJsonObject result;
+    result.insert(QLatin1String("benchmark"), QLatin1String("birthday"));
+    result.insert(QLatin1String("contacts"), contacts);
+    result.insert(QLatin1String("metric"), metric);
+    result.insert(QLatin1String("value"), double(value));
+    result.insert(QLatin1String("unit"), unit);
+
+    mResults.write(QJsonDocument(result).toJson(QJsonDocument::Compact) + '\n');
+    mResults.flush();
+}
+
+CONTACTSD_TEST_MAIN(BenchBirthdayPlugin)
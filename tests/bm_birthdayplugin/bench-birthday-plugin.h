@@ -0,0 +1,79 @@
+/** This file is part of Contacts daemon
+ **
+ ** Copyright (c) 2010-2011 Nokia Corporation and/or its subsidiary(-ies).
+ **
+ ** Contact:  Nokia Corporation (info@qt.nokia.com)
+ **
+ ** GNU Lesser General Public License Usage
+ ** This file may be used under the terms of the GNU Lesser General Public License
+ ** version 2.1 as published by the Free Software Foundation and appearing in the
+ ** file LICENSE.LGPL included in the packaging of this file.  Please review the
+ ** following information to ensure the GNU Lesser General Public License version
+ ** 2.1 requirements will be met:
+ ** http://www.gnu.org/licenses/old-licenses/lgpl-2.1.html.
+ **
+ ** In addition, as a special exception, Nokia gives you certain additional rights.
+ ** These rights are described in the Nokia Qt LGPL Exception version 1.1, included
+ ** in the file LGPL_EXCEPTION.txt in this package.
+ **
+ ** Other Usage
+ ** Alternatively, this file may be used in accordance with the terms and
+ ** conditions contained in a signed written agreement between you and Nokia.
+ **/
+
+#ifndef BENCH_BIRTHDAYPLUGIN_H
+#define BENCH_BIRTHDAYPLUGIN_H
+
+#include <QFile>
+#include <QObject>
+#include <QProcess>
+#include <QRegularExpression>
+#include <QtTest/QtTest>
+
+#include <QContact>
+#include <QContactManager>
+
+#ifdef USING_QTPIM
+QTCONTACTS_USE_NAMESPACE
+#else
+QTM_USE_NAMESPACE
+#endif
+
+class BenchBirthdayPlugin : public QObject
+{
+    Q_OBJECT
+
+public:
+    explicit BenchBirthdayPlugin(QObject *parent = 0);
+
+private Q_SLOTS:
+    void initTestCase();
+
+    void benchColdFullSync();
+
+    void benchBirthdays_data();
+    void benchBirthdays();
+
+    void cleanup();
+    void cleanupTestCase();
+
+private:
+    bool seedContacts(int count);
+    void removeContacts();
+    void removeDaemonCache();
+    bool startDaemon();
+    void stopDaemon();
+    QRegularExpressionMatch waitForLog(const QRegularExpression &pattern, int timeout);
+    qint64 daemonPeakRss() const;
+    void report(int contacts, const QString &metric, qint64 value, const QString &unit);
+
+private:
+    QContactManager *mManager;
+    QList<QContact> mContacts;
+    QProcess mDaemon;
+    QByteArray mDaemonLog;
+    int mLogOffset;
+    QFile mResults;
+};
+
+#endif // BENCH_BIRTHDAYPLUGIN_H
@@ -0,0 +1,575 @@
+/** This file is part of Contacts daemon
+ **
+ ** Copyright (c) 2010-2011 Nokia Corporation and/or its subsidiary(-ies).
+ **
+ ** Contact:  Nokia Corporation (info@qt.nokia.com)
+ **
+ ** GNU Lesser General Public License Usage
+ ** This file may be used under the terms of the GNU Lesser General Public License
+ ** version 2.1 as published by the Free Software Foundation and appearing in the
+ ** file LICENSE.LGPL included in the packaging of this file.  Please review the
+ ** following information to ensure the GNU Lesser General Public License version
+ ** 2.1 requirements will be met:
+ ** http://www.gnu.org/licenses/old-licenses/lgpl-2.1.html.
+ **
+ ** In addition, as a special exception, Nokia gives you certain additional rights.
+ ** These rights are described in the Nokia Qt LGPL Exception version 1.1, included
+ ** in the file LGPL_EXCEPTION.txt in this package.
+ **
+ ** Other Usage
+ ** Alternatively, this file may be used in accordance with the terms and
+ ** conditions contained in a signed written agreement between you and Nokia.
+ **/
+
+#include <QContact>
+#include <QElapsedTimer>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QVector>
+
+#include <TelepathyQt/Debug>
+
+#include "libtelepathy/util.h"
+#include "libtelepathy/debug.h"
+
+#include <test-common.h>
+
+#include <stdio.h>
+
+#include "bench-telepathy-plugin.h"
+#include "buddymanagementinterface.h"
+#include "debug.h"
+
+#define LETTERS "abcdefghijklmnopqrstuvwxyz"
+
+static gchar *randomString(int len, const gchar *chars = LETTERS)
+{
+    gchar *result = g_new0(gchar, len + 1);
+    for (int i = 0; i < len; i++) {
+        result[i] = chars[qrand() % strlen(chars)];
+    }
+
+    return result;
+}
+
+#define N_SYNC_CONTACTS 1000
+#define N_BATCH_CONTACTS 10000
+#define N_ROSTER_CONTACTS 5000
+#define N_REMOVED_BUDDIES 1000
+#define N_TRAFFIC_CONTACTS 2000
+
+BenchTelepathyPlugin::BenchTelepathyPlugin(QObject *parent) : Test(parent),
+        mChangeNotifications(0), mLogOffset(0)
+{
+}
+
+void BenchTelepathyPlugin::initTestCase()
+{
+    initTestCaseImpl();
+
+    g_type_init();
+    g_set_prgname("bench-telepathy-plugin");
+
+    if (!qgetenv("CONTACTSD_DEBUG").isEmpty()) {
+        tp_debug_set_flags("all");
+        test_debug_enable(TRUE);
+        enableDebug(true);
+    }
+
+    dbus_g_bus_get(DBUS_BUS_STARTER, 0);
+
+    // Results are written as one JSON object per line, to stdout unless
+    // TELEPATHY_BENCHMARK_RESULTS names a file.
+    const QString resultsPath = QString::fromLocal8Bit(qgetenv("TELEPATHY_BENCHMARK_RESULTS"));
+    if (resultsPath.isEmpty()) {
+        QVERIFY(mResults.open(stdout, QIODevice::WriteOnly));
+    } else {
+        mResults.setFileName(resultsPath);
+        QVERIFY2(mResults.open(QIODevice::WriteOnly | QIODevice::Append), qPrintable(mResults.errorString()));
+    }
+
+    /* Create a QContactManager and track added/changed contacts */
+#ifdef USING_QTPIM
+    mContactManager = new QContactManager(QLatin1String("org.nemomobile.contacts.sqlite"));
+    connect(mContactManager,
+            SIGNAL(contactsAdded(const QList<QContactId>&)),
+            SLOT(contactsAdded(const QList<QContactId>&)));
+    connect(mContactManager,
+            SIGNAL(contactsChanged(const QList<QContactId>&)),
+            SLOT(contactsChanged(const QList<QContactId>&)));
+    connect(mContactManager,
+            SIGNAL(contactsRemoved(const QList<QContactId>&)),
+            SLOT(contactsRemoved(const QList<QContactId>&)));
+#else
+    mContactManager = new QContactManager;
+    connect(mContactManager,
+            SIGNAL(contactsAdded(const QList<QContactLocalId>&)),
+            SLOT(contactsAdded(const QList<QContactLocalId>&)));
+    connect(mContactManager,
+            SIGNAL(contactsChanged(const QList<QContactLocalId>&)),
+            SLOT(contactsChanged(const QList<QContactLocalId>&)));
+    connect(mContactManager,
+            SIGNAL(contactsRemoved(const QList<QContactLocalId>&)),
+            SLOT(contactsRemoved(const QList<QContactLocalId>&)));
+#endif
+    mContactIds += mContactManager->selfContactId();
+
+    /* Create a fake AccountManager */
+    TpDBusDaemon *dbus = tp_dbus_daemon_dup(NULL);
+    mAccountManager = (TpTestsSimpleAccountManager *) tp_tests_object_new_static_class(
+            TP_TESTS_TYPE_SIMPLE_ACCOUNT_MANAGER, NULL);
+    tp_dbus_daemon_register_object(dbus, TP_ACCOUNT_MANAGER_OBJECT_PATH, mAccountManager);
+    tp_dbus_daemon_request_name (dbus, TP_ACCOUNT_MANAGER_BUS_NAME, FALSE, NULL);
+    g_object_unref(dbus);
+
+    /* The daemon is started once the AM is on the bus */
+    mDaemon.setProcessChannelMode(QProcess::MergedChannels);
+    connect(&mDaemon, SIGNAL(readyRead()), SLOT(onDaemonOutput()));
+}
+
+void BenchTelepathyPlugin::cleanupTestCase()
+{
+    cleanupTestCaseImpl();
+
+    stopDaemon();
+
+    delete mContactManager;
+    g_object_unref(mAccountManager);
+}
+
+void BenchTelepathyPlugin::init()
+{
+    initImpl();
+
+    /* Data rows select the write path of the daemon: benchAccountSync compares
+     * the batched writes with the immediate ones, benchUpdateBatch the contact
+     * manager with the direct database writes */
+    const QString tag(QLatin1String(QTest::currentDataTag()));
+    QStringList switches;
+    if (tag == QLatin1String("immediate")) {
+        switches << QLatin1String("CONTACTSD_TELEPATHY_IMMEDIATE_WRITES");
+    } else if (tag == QLatin1String("direct")) {
+        switches << QLatin1String("CONTACTSD_TELEPATHY_DIRECT_WRITES");
+    }
+    QVERIFY2(startDaemon(switches), qPrintable(mDaemon.errorString()));
+
+    /* Create a fake Connection */
+    tp_tests_create_and_connect_conn(TP_TESTS_TYPE_CONTACTS_CONNECTION,
+            "fakeaccount", &mConnService, &mConnection);
+    QVERIFY(mConnService);
+    QVERIFY(mConnection);
+
+    mListManager = tp_tests_contacts_connection_get_contact_list_manager(
+        TP_TESTS_CONTACTS_CONNECTION(mConnService));
+
+    /* Define the self contact */
+    TpTestsContactsConnectionPresenceStatusIndex presence =
+            TP_TESTS_CONTACTS_CONNECTION_STATUS_AVAILABLE;
+    const gchar *message = "Running benchmarks";
+    tp_tests_contacts_connection_change_presences(
+        TP_TESTS_CONTACTS_CONNECTION (mConnService),
+        1, &mConnService->self_handle, &presence, &message);
+
+    /* Create a fake Account */
+    TpDBusDaemon *dbus = tp_dbus_daemon_dup(NULL);
+    mAccount = (TpTestsSimpleAccount *) tp_tests_object_new_static_class(
+            TP_TESTS_TYPE_SIMPLE_ACCOUNT, NULL);
+    tp_dbus_daemon_register_object(dbus, ACCOUNT_PATH, mAccount);
+    tp_tests_simple_account_manager_add_account (mAccountManager, ACCOUNT_PATH, TRUE);
+    tp_tests_simple_account_set_connection (mAccount, mConnService->object_path);
+    g_object_unref(dbus);
+
+    /* Wait for self contact to appear */
+    runExpectation(TestExpectationInitPtr(new TestExpectationInit()));
+}
+
+void BenchTelepathyPlugin::cleanup()
+{
+    cleanupImpl();
+
+    tp_cli_connection_call_disconnect(mConnection, -1, NULL, NULL, NULL, NULL);
+    tp_tests_simple_account_manager_remove_account(mAccountManager, ACCOUNT_PATH);
+    tp_tests_simple_account_removed(mAccount);
+
+    /* Wait for all contacts to disappear */
+    runExpectation(TestExpectationCleanupPtr(new TestExpectationCleanup(mContactIds.count())));
+
+    QVERIFY(mContactIds.count() == 1);
+
+    g_object_unref(mConnService);
+    g_object_unref(mConnection);
+    g_object_unref(mAccount);
+}
+
+void BenchTelepathyPlugin::benchAccountSync_data()
+{
+    QTest::addColumn<bool>("batched");
+    QTest::newRow("immediate") << false;
+    QTest::newRow("batched") << true;
+}
+
+void BenchTelepathyPlugin::benchAccountSync()
+{
+    QFETCH(bool, batched);
+
+    GArray *handles = createRoster(N_SYNC_CONTACTS);
+
+    /* Set account offline; every contact of the account is written in the
+     * account sync */
+    markDaemonLog();
+    mChangeNotifications = 0;
+
+    QElapsedTimer timer;
+    timer.start();
+
+    tp_cli_connection_call_disconnect(mConnection, -1, NULL, NULL, NULL, NULL);
+
+    int count = mContactIds.count();
+#ifdef USING_QTPIM
+    count *= 2; // Two contacts for each logical entity
+#endif
+    runExpectation(TestExpectationDisconnectPtr(new TestExpectationDisconnect(count)));
+
+    const qint64 syncTime = timer.elapsed();
+
+    /* Each change notification matches one backend transaction */
+    const QString prefix(batched ? QLatin1String("batched") : QLatin1String("immediate"));
+    report(N_SYNC_CONTACTS, prefix + QLatin1String("SyncTime"), syncTime, QLatin1String("ms"));
+    report(N_SYNC_CONTACTS, prefix + QLatin1String("ChangeNotifications"), mChangeNotifications, QLatin1String("notifications"));
+
+    if (batched) {
+        /* The daemon reports the transactions the immediate path would have used */
+        const QList<QRegularExpressionMatch> commits = daemonLogMatches(QRegularExpression(
+                QLatin1String("Committed account sync from:.* in (\\d+) backend transactions instead of (\\d+)")));
+        QVERIFY2(!commits.isEmpty(), "Daemon did not report the account sync commit");
+
+        int transactions = 0;
+        int unbatchedCalls = 0;
+        Q_FOREACH (const QRegularExpressionMatch &match, commits) {
+            transactions += match.captured(1).toInt();
+            unbatchedCalls += match.captured(2).toInt();
+        }
+        QVERIFY(transactions < unbatchedCalls);
+
+        report(N_SYNC_CONTACTS, QLatin1String("batchedTransactions"), transactions, QLatin1String("transactions"));
+        report(N_SYNC_CONTACTS, QLatin1String("immediateTransactions"), unbatchedCalls, QLatin1String("transactions"));
+    }
+
+    QTest::setBenchmarkResult(syncTime, QTest::WalltimeMilliseconds);
+
+    g_array_free(handles, TRUE);
+}
+
+void BenchTelepathyPlugin::benchUpdateBatch_data()
+{
+    QTest::addColumn<bool>("direct");
+    QTest::newRow("manager") << false;
+    QTest::newRow("direct") << true;
+}
+
+void BenchTelepathyPlugin::benchUpdateBatch()
+{
+    QFETCH(bool, direct);
+
+    GArray *handles = createRoster(N_BATCH_CONTACTS);
+
+    int count = N_BATCH_CONTACTS;
+#ifdef USING_QTPIM
+    count *= 2; // Two contacts for each logical entity
+#endif
+
+    /* change every presence at once, so the storage builds its update
+     * batches for the whole roster */
+    QVector<TpTestsContactsConnectionPresenceStatusIndex> presences(N_BATCH_CONTACTS,
+            TP_TESTS_CONTACTS_CONNECTION_STATUS_BUSY);
+    QVector<const gchar *> messages(N_BATCH_CONTACTS, "Benchmarking");
+
+    markDaemonLog();
+
+    QElapsedTimer timer;
+    timer.start();
+
+    tp_tests_contacts_connection_change_presences(
+        TP_TESTS_CONTACTS_CONNECTION (mConnService),
+        handles->len, (TpHandle *) handles->data, presences.data(), messages.data());
+
+    runExpectation(TestExpectationMassPtr(new TestExpectationMass(0, count, 0)));
+
+    const qint64 updateTime = timer.elapsed();
+
+    /* Time spent building the batches, as measured by the daemon itself;
+     * this excludes the backend writes */
+    int prepared = 0;
+    qint64 buildTime = 0;
+    Q_FOREACH (const QRegularExpressionMatch &match, daemonLogMatches(
+            QRegularExpression(QLatin1String("Prepared (\\d+) contact updates - elapsed: (\\d+)")))) {
+        prepared += match.captured(1).toInt();
+        buildTime += match.captured(2).toLongLong();
+    }
+    QVERIFY2(prepared >= N_BATCH_CONTACTS, "Daemon did not report the batches it prepared");
+
+    /* Time spent writing the batches, through the contact manager or directly
+     * into the database */
+    const QRegularExpression writePattern(direct
+            ? QLatin1String("Directly updated (\\d+) contacts - elapsed: (\\d+)")
+            : QLatin1String("Updated (\\d+) batched contacts - elapsed: (\\d+)"));
+    int written = 0;
+    qint64 writeTime = 0;
+    Q_FOREACH (const QRegularExpressionMatch &match, daemonLogMatches(writePattern)) {
+        written += match.captured(1).toInt();
+        writeTime += match.captured(2).toLongLong();
+    }
+    QVERIFY2(written >= N_BATCH_CONTACTS, "Daemon did not write the updates through the requested path");
+
+    const QString prefix(direct ? QLatin1String("direct") : QLatin1String("manager"));
+    report(N_BATCH_CONTACTS, QLatin1String("batchBuild"), buildTime, QLatin1String("ms"));
+    report(N_BATCH_CONTACTS, prefix + QLatin1String("Write"), writeTime, QLatin1String("ms"));
+    report(N_BATCH_CONTACTS, prefix + QLatin1String("PresenceUpdate"), updateTime, QLatin1String("ms"));
+
+    QTest::setBenchmarkResult(writeTime, QTest::WalltimeMilliseconds);
+
+    g_array_free(handles, TRUE);
+}
+
+void BenchTelepathyPlugin::benchRemoveBuddies()
+{
+    /* create a large roster, remembering the ids of the buddies to remove */
+    QStringList buddies;
+    GArray *handles = createRoster(N_ROSTER_CONTACTS, &buddies);
+    buddies = buddies.mid(0, N_REMOVED_BUDDIES);
+
+    int removed = N_REMOVED_BUDDIES;
+#ifdef USING_QTPIM
+    removed *= 2; // Two contacts for each logical entity
+#endif
+
+    QElapsedTimer timer;
+    timer.start();
+
+    BuddyManagementInterface *buddyIf = new BuddyManagementInterface("com.nokia.contactsd", "/telepathy", QDBusConnection::sessionBus(), 0);
+    {
+        QDBusPendingReply<> async = buddyIf->removeBuddies(ACCOUNT_PATH, buddies);
+        QDBusPendingCallWatcher watcher(async, this);
+        watcher.waitForFinished();
+        QVERIFY2(not async.isError(), async.error().message().toLatin1());
+        QVERIFY(watcher.isValid());
+    }
+    runExpectation(TestExpectationMassPtr(new TestExpectationMass(0, 0, removed)));
+
+    const qint64 removalTime = timer.elapsed();
+    report(N_ROSTER_CONTACTS, QLatin1String("removeBuddies"), removalTime, QLatin1String("ms"));
+
+    QTest::setBenchmarkResult(removalTime, QTest::WalltimeMilliseconds);
+
+    delete buddyIf;
+    g_array_free(handles, TRUE);
+}
+
+void BenchTelepathyPlugin::benchRosterTraffic()
+{
+    static const char *const interfaces[] = {
+        TP_IFACE_CONNECTION_INTERFACE_ALIASING,
+        TP_IFACE_CONNECTION_INTERFACE_AVATARS,
+        TP_IFACE_CONNECTION_INTERFACE_CONTACT_CAPABILITIES,
+        TP_IFACE_CONNECTION_INTERFACE_CONTACT_INFO,
+        TP_IFACE_CONNECTION_INTERFACE_LOCATION,
+        TP_IFACE_CONNECTION_INTERFACE_AVATARS ".RequestAvatars",
+        TP_IFACE_CONNECTION_INTERFACE_CONTACT_INFO ".RefreshContactInfo",
+        0
+    };
+
+    TpTestsContactsConnection *conn = TP_TESTS_CONTACTS_CONNECTION(mConnService);
+
+    QVector<guint> before;
+    for (int i = 0; interfaces[i]; i++) {
+        before << tp_tests_contacts_connection_get_traffic(conn, interfaces[i]);
+    }
+
+    /* create a large roster, and count the contacts the connection manager
+     * had to serve each interface for */
+    GArray *handles = createRoster(N_TRAFFIC_CONTACTS);
+
+    guint total = 0;
+    for (int i = 0; interfaces[i]; i++) {
+        const guint served = tp_tests_contacts_connection_get_traffic(conn, interfaces[i]) - before[i];
+        report(N_TRAFFIC_CONTACTS, QString::fromLatin1(interfaces[i]), served, QLatin1String("contacts"));
+        total += served;
+    }
+
+    /* Location is not stored, so it must never be requested */
+    QCOMPARE(tp_tests_contacts_connection_get_traffic(conn, TP_IFACE_CONNECTION_INTERFACE_LOCATION), guint(0));
+
+    QTest::setBenchmarkResult(total, QTest::Events);
+
+    g_array_free(handles, TRUE);
+}
+
+TpHandle BenchTelepathyPlugin::ensureHandle(const gchar *id)
+{
+    TpHandleRepoIface *serviceRepo =
+        tp_base_connection_get_handles(mConnService, TP_HANDLE_TYPE_CONTACT);
+
+    TpHandle handle = tp_handle_ensure(serviceRepo, id, NULL, NULL);
+
+    return handle;
+}
+
+GArray *BenchTelepathyPlugin::createRoster(int count, QStringList *ids)
+{
+    GArray *handles = g_array_new(FALSE, FALSE, sizeof(TpHandle));
+    for (int i = 0; i < count; i++) {
+        gchar *id = randomString(20);
+        TpHandle handle = ensureHandle(id);
+        g_array_append_val(handles, handle);
+        if (ids) {
+            ids->append(QString::fromUtf8(id));
+        }
+        g_free(id);
+    }
+    test_contact_list_manager_request_subscription(mListManager,
+            handles->len, (TpHandle *) handles->data, "wait");
+
+#ifdef USING_QTPIM
+    count *= 2; // Two contacts for each logical entity
+#endif
+    runExpectation(TestExpectationMassPtr(new TestExpectationMass(count, 0, 0)));
+
+    return handles;
+}
+
+void BenchTelepathyPlugin::runExpectation(TestExpectationPtr exp)
+{
+    QVERIFY(mExpectation.isNull());
+
+    mExpectation = exp;
+    mExpectation->setContactManager(mContactManager);
+    connect(mExpectation.data(), SIGNAL(finished()),
+            mLoop, SLOT(quit()));
+
+    QCOMPARE(mLoop->exec(), 0);
+
+#ifdef USING_QTPIM
+    // Wait for any further signals to be emitted from the contact manager
+    QTest::qWait(500);
+#endif
+
+    mExpectation = TestExpectationPtr();
+}
+
+void BenchTelepathyPlugin::contactsAdded(const QList<ContactIdType>& contactIds)
+{
+    Q_FOREACH (const ContactIdType &id, contactIds) {
+        QVERIFY(!mContactIds.contains(id));
+        mContactIds << id;
+    }
+    verify(EventAdded, contactIds);
+}
+
+void BenchTelepathyPlugin::contactsChanged(const QList<ContactIdType>& contactIds)
+{
+    mChangeNotifications++;
+    verify(EventChanged, contactIds);
+}
+
+void BenchTelepathyPlugin::contactsRemoved(const QList<ContactIdType>& contactIds)
+{
+    Q_FOREACH (const ContactIdType &id, contactIds) {
+        mContactIds.removeOne(id);
+    }
+    verify(EventRemoved, contactIds);
+}
+
+void BenchTelepathyPlugin::verify(Event event, const QList<ContactIdType> &contactIds)
+{
+    QVERIFY(mExpectation != 0);
+    mExpectation->verify(event, contactIds);
+}
+
+bool BenchTelepathyPlugin::startDaemon(const QStringList &switches)
+{
+    QProcessEnvironment environment(QProcessEnvironment::systemEnvironment());
+    Q_FOREACH (const QString &name, switches) {
+        environment.insert(name, QLatin1String("1"));
+    }
+
+    // Keep a daemon already running with the requested writes
+    if (mDaemon.state() != QProcess::NotRunning) {
+        if (mDaemon.processEnvironment() == environment) {
+            return true;
+        }
+        stopDaemon();
+    }
+
+    QString program = QString::fromLocal8Bit(qgetenv("CONTACTSD_BINARY"));
+    if (program.isEmpty()) {
+        program = QLatin1String("/usr/bin/contactsd");
+    }
+
+    mDaemonLog.clear();
+    mLogOffset = 0;
+
+    mDaemon.setProcessEnvironment(environment);
+
+    // We load only the needed plugins (to avoid eg. voicemail creating contacts)
+    mDaemon.start(program, QStringList() << QLatin1String("--plugins") << QLatin1String("telepathy")
+                                         << QLatin1String("--log-console"));
+    return mDaemon.waitForStarted();
+}
+
+void BenchTelepathyPlugin::stopDaemon()
+{
+    if (mDaemon.state() == QProcess::NotRunning) {
+        return;
+    }
+
+    mDaemon.terminate();
+    if (not mDaemon.waitForFinished(10000)) {
+        mDaemon.kill();
+        mDaemon.waitForFinished();
+    }
+}
+
+void BenchTelepathyPlugin::onDaemonOutput()
+{
+    mDaemonLog += mDaemon.readAll();
+}
+
+void BenchTelepathyPlugin::markDaemonLog()
+{
+    onDaemonOutput();
+    mLogOffset = mDaemonLog.size();
+}
+
+QList<QRegularExpressionMatch> BenchTelepathyPlugin::daemonLogMatches(const QRegularExpression &pattern)
+{
+    onDaemonOutput();
+
+    // Only complete lines logged since the last mark are considered
+    QList<QRegularExpressionMatch> matches;
+    int start = mLogOffset, end;
+    while ((end = mDaemonLog.indexOf('\n', start)) != -1) {
+        const QRegularExpressionMatch match = pattern.match(
+                QString::fromLocal8Bit(mDaemonLog.constData() + start, end - start));
+        if (match.hasMatch()) {
+            matches.append(match);
+        }
+        start = end + 1;
+    }
+
+    return matches;
+}
+
+void BenchTelepathyPlugin::report(int contacts, const QString &metric, qint64 value, const QString &unit)
+{
+    QJsonObject result;
+    result.insert(QLatin1String("benchmark"), QLatin1String("telepathy"));
+    result.insert(QLatin1String("contacts"), contacts);
+    result.insert(QLatin1String("metric"), metric);
+    result.insert(QLatin1String("value"), double(value));
+    result.insert(QLatin1String("unit"), unit);
+
+    mResults.write(QJsonDocument(result).toJson(QJsonDocument::Compact) + '\n');
+    mResults.flush();
+}
+
+CONTACTSD_TEST_MAIN(BenchTelepathyPlugin)
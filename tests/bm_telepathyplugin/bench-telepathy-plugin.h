@@ -0,0 +1,122 @@
+/** This file is part of Contacts daemon
+ **
+ ** Copyright (c) 2010-2011 Nokia Corporation and/or its subsidiary(-ies).
+ **
+ ** Contact:  Nokia Corporation (info@qt.nokia.com)
+ **
+ ** GNU Lesser General Public License Usage
+ ** This file may be used under the terms of the GNU Lesser General Public License
+ ** version 2.1 as published by the Free Software Foundation and appearing in the
+ ** file LICENSE.LGPL included in the packaging of this file.  Please review the
+ ** following information to ensure the GNU Lesser General Public License version
+ ** 2.1 requirements will be met:
+ ** http://www.gnu.org/licenses/old-licenses/lgpl-2.1.html.
+ **
+ ** In addition, as a special exception, Nokia gives you certain additional rights.
+ ** These rights are described in the Nokia Qt LGPL Exception version 1.1, included
+ ** in the file LGPL_EXCEPTION.txt in this package.
+ **
+ ** Other Usage
+ ** Alternatively, this file may be used in accordance with the terms and
+ ** conditions contained in a signed written agreement between you and Nokia.
+ **/
+
+#ifndef BENCH_TELEPATHY_PLUGIN_H
+#define BENCH_TELEPATHY_PLUGIN_H
+
+#include <QFile>
+#include <QObject>
+#include <QProcess>
+#include <QProcessEnvironment>
+#include <QRegularExpression>
+#include <QTest>
+#include <QString>
+#include <QStringList>
+
+#include <QContactManager>
+
+#include <telepathy-glib/telepathy-glib.h>
+
+#include "libtelepathy/contacts-conn.h"
+#include "libtelepathy/contact-list-manager.h"
+#include "libtelepathy/simple-account-manager.h"
+#include "libtelepathy/simple-account.h"
+
+#include "test.h"
+#include "test-expectation.h"
+
+#ifdef USING_QTPIM
+QTCONTACTS_USE_NAMESPACE
+#else
+QTM_USE_NAMESPACE
+#endif
+
+/**
+ * Telepathy plugin's benchmarks
+ */
+class BenchTelepathyPlugin : public Test
+{
+    Q_OBJECT
+
+public:
+    BenchTelepathyPlugin(QObject *parent = 0);
+
+protected Q_SLOTS:
+#ifdef USING_QTPIM
+    void contactsAdded(const QList<QContactId>& contactIds);
+    void contactsChanged(const QList<QContactId>& contactIds);
+    void contactsRemoved(const QList<QContactId>& contactIds);
+#else
+    void contactsAdded(const QList<QContactLocalId>& contactIds);
+    void contactsChanged(const QList<QContactLocalId>& contactIds);
+    void contactsRemoved(const QList<QContactLocalId>& contactIds);
+#endif
+    void onDaemonOutput();
+
+private Q_SLOTS:
+    void initTestCase();
+    void init();
+
+    void benchAccountSync_data();
+    void benchAccountSync();
+    void benchUpdateBatch_data();
+    void benchUpdateBatch();
+    void benchRemoveBuddies();
+    void benchRosterTraffic();
+
+    void cleanup();
+    void cleanupTestCase();
+
+private:
+    TpHandle ensureHandle(const gchar *id);
+    GArray *createRoster(int count, QStringList *ids = 0);
+    void verify(Event event, const QList<ContactIdType> &contactIds);
+    void runExpectation(TestExpectationPtr expectation);
+
+    bool startDaemon(const QStringList &switches = QStringList());
+    void stopDaemon();
+    void markDaemonLog();
+    QList<QRegularExpressionMatch> daemonLogMatches(const QRegularExpression &pattern);
+    void report(int contacts, const QString &metric, qint64 value, const QString &unit);
+
+private:
+    QContactManager *mContactManager;
+    TpTestsSimpleAccountManager *mAccountManager;
+    TpTestsSimpleAccount *mAccount;
+
+    TpBaseConnection *mConnService;
+    TpConnection *mConnection;
+    TestContactListManager *mListManager;
+
+    QList<ContactIdType> mContactIds;
+    int mChangeNotifications;
+
+    TestExpectationPtr mExpectation;
+
+    QProcess mDaemon;
+    QByteArray mDaemonLog;
+    int mLogOffset;
+    QFile mResults;
+};
+
+#endif // BENCH_TELEPATHY_PLUGIN_H
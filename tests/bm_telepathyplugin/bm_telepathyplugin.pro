@@ -0,0 +1,67 @@
+# This file is part of Contacts daemon
+#
+# Copyright (c) 2010-2011 Nokia Corporation and/or its subsidiary(-ies).
+#
+# Contact:  Nokia Corporation (info@qt.nokia.com)
+#
+# GNU Lesser General Public License Usage
+# This file may be used under the terms of the GNU Lesser General Public License
+# version 2.1 as published by the Free Software Foundation and appearing in the
+# file LICENSE.LGPL included in the packaging of this file.  Please review the
+# following information to ensure the GNU Lesser General Public License version
+# 2.1 requirements will be met:
+# http://www.gnu.org/licenses/old-licenses/lgpl-2.1.html.
+#
+# In addition, as a special exception, Nokia gives you certain additional rights.
+# These rights are described in the Nokia Qt LGPL Exception version 1.1, included
+# in the file LGPL_EXCEPTION.txt in this package.
+#
+# Other Usage
+# Alternatively, this file may be used in accordance with the terms and
+# conditions contained in a signed written agreement between you and Nokia.
+
+include(../common/test-common.pri)
+
+PRE_TARGETDEPS += ../libtelepathy/libtelepathy.a
+
+TARGET = bm_telepathyplugin
+target.path = /opt/tests/$${PACKAGENAME}/$$TARGET
+
+include(check.pri)
+include(tests.pri)
+
+TEMPLATE = app
+
+CONFIG += test qt
+QT += testlib dbus
+QT -= gui
+CONFIG += link_pkgconfig
+PKGCONFIG += telepathy-glib
+DEFINES += QT_NO_KEYWORDS
+DEFINES += ENABLE_DEBUG
+
+PKGCONFIG += Qt5Contacts
+PKGCONFIG += TelepathyQt5
+DEFINES *= USING_QTPIM
+
+# The fixture helpers are shared with the telepathy plugin unit tests
+INCLUDEPATH += .. ../ut_telepathyplugin
+QMAKE_LIBDIR += ../libtelepathy
+LIBS += -ltelepathy
+
+system(cp $$PWD/../../plugins/telepathy/com.nokia.contacts.buddymanagement.xml .)
+system(qdbusxml2cpp -c BuddyManagementInterface -p buddymanagementinterface.h:buddymanagementinterface.cpp com.nokia.contacts.buddymanagement.xml)
+
+HEADERS += bench-telepathy-plugin.h \
+    buddymanagementinterface.h \
+    ../ut_telepathyplugin/debug.h \
+    ../ut_telepathyplugin/test-expectation.h \
+    ../ut_telepathyplugin/test.h
+
+SOURCES += bench-telepathy-plugin.cpp \
+    buddymanagementinterface.cpp \
+    ../ut_telepathyplugin/debug.cpp \
+    ../ut_telepathyplugin/test-expectation.cpp \
+    ../ut_telepathyplugin/test.cpp
+
+INSTALLS += target
@@ -93,6 +93,8 @@ struct _TpTestsContactsConnectionPrivate
   /* TpHandle => GPtrArray * */
   GHashTable *contact_info;
   GPtrArray *default_contact_info;
+  /* interface attribute or method name => number of contacts served */
+  GHashTable *traffic;
 
   TestContactListManager *list_manager;
 };
@@ -159,6 +161,20 @@ tp_tests_contacts_connection_init (TpTestsContactsConnection *self)
       g_direct_equal, NULL, (GDestroyNotify) free_rcc_list);
   self->priv->contact_info = g_hash_table_new_full (g_direct_hash,
       g_direct_equal, NULL, (GDestroyNotify) g_ptr_array_unref);
+  self->priv->traffic = g_hash_table_new_full (g_str_hash, g_str_equal,
+      g_free, NULL);
+}
+
+static void
+count_traffic (TpTestsContactsConnection *self,
+    const gchar *name,
+    guint n)
+{
+  guint count = GPOINTER_TO_UINT (g_hash_table_lookup (self->priv->traffic,
+      name));
+
+  g_hash_table_insert (self->priv->traffic, g_strdup (name),
+      GUINT_TO_POINTER (count + n));
 }
 
 static void
@@ -174,6 +190,7 @@ finalize (GObject *object)
   g_hash_table_destroy (self->priv->locations);
   g_hash_table_destroy (self->priv->capabilities);
   g_hash_table_destroy (self->priv->contact_info);
+  g_hash_table_destroy (self->priv->traffic);
 
   if (self->priv->default_contact_info != NULL)
     g_ptr_array_unref (self->priv->default_contact_info);
@@ -192,6 +209,8 @@ aliasing_fill_contact_attributes (GObject *object,
   TpHandleRepoIface *contact_repo = tp_base_connection_get_handles (base,
       TP_HANDLE_TYPE_CONTACT);
 
+  count_traffic (self, TP_IFACE_CONNECTION_INTERFACE_ALIASING, contacts->len);
+
   for (i = 0; i < contacts->len; i++)
     {
       TpHandle handle = g_array_index (contacts, guint, i);
@@ -217,6 +236,8 @@ avatars_fill_contact_attributes (GObject *object,
   guint i;
   TpTestsContactsConnection *self = TP_TESTS_CONTACTS_CONNECTION (object);
 
+  count_traffic (self, TP_IFACE_CONNECTION_INTERFACE_AVATARS, contacts->len);
+
   for (i = 0; i < contacts->len; i++)
     {
       TpHandle handle = g_array_index (contacts, guint, i);
@@ -240,6 +261,9 @@ location_fill_contact_attributes (GObject *object,
   guint i;
   TpTestsContactsConnection *self = TP_TESTS_CONTACTS_CONNECTION (object);
 
+  count_traffic (self, TP_IFACE_CONNECTION_INTERFACE_LOCATION,
+      contacts->len);
+
   for (i = 0; i < contacts->len; i++)
     {
       TpHandle handle = g_array_index (contacts, guint, i);
@@ -263,6 +287,9 @@ contact_caps_fill_contact_attributes (GObject *object,
   guint i;
   TpTestsContactsConnection *self = TP_TESTS_CONTACTS_CONNECTION (object);
 
+  count_traffic (self, TP_IFACE_CONNECTION_INTERFACE_CONTACT_CAPABILITIES,
+      contacts->len);
+
   for (i = 0; i < contacts->len; i++)
     {
       TpHandle handle = g_array_index (contacts, guint, i);
@@ -287,6 +314,9 @@ contact_info_fill_contact_attributes (GObject *object,
   guint i;
   TpTestsContactsConnection *self = TP_TESTS_CONTACTS_CONNECTION (object);
 
+  count_traffic (self, TP_IFACE_CONNECTION_INTERFACE_CONTACT_INFO,
+      contacts->len);
+
   for (i = 0; i < contacts->len; i++)
     {
       TpHandle handle = g_array_index (contacts, guint, i);
@@ -544,6 +574,15 @@ tp_tests_contacts_connection_get_contact_list_manager (
   return self->priv->list_manager;
 }
 
+/* Number of contacts for which the attributes of an interface, or a method
+ * like "<interface>.RequestAvatars", were served so far */
+guint
+tp_tests_contacts_connection_get_traffic (TpTestsContactsConnection *self,
+    const gchar *name)
+{
+  return GPOINTER_TO_UINT (g_hash_table_lookup (self->priv->traffic, name));
+}
+
 void
 tp_tests_contacts_connection_change_aliases (TpTestsContactsConnection *self,
                                     guint n,
@@ -956,6 +995,9 @@ my_request_avatars (TpSvcConnectionInterfaceAvatars *avatars,
             a->token, a->data, a->mime_type);
     }
 
+  count_traffic (self, TP_IFACE_CONNECTION_INTERFACE_AVATARS ".RequestAvatars",
+      contacts->len);
+
   tp_svc_connection_interface_avatars_return_from_request_avatars (context);
 }
 
@@ -1155,6 +1197,10 @@ my_refresh_contact_info (TpSvcConnectionInterfaceContactInfo *obj,
       g_ptr_array_unref (arr);
     }
 
+  count_traffic (self,
+      TP_IFACE_CONNECTION_INTERFACE_CONTACT_INFO ".RefreshContactInfo",
+      contacts->len);
+
   tp_svc_connection_interface_contact_info_return_from_refresh_contact_info (
       context);
 }
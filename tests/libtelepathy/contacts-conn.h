@@ -76,6 +76,9 @@ typedef enum {
 TestContactListManager *tp_tests_contacts_connection_get_contact_list_manager (
     TpTestsContactsConnection *self);
 
+guint tp_tests_contacts_connection_get_traffic (
+    TpTestsContactsConnection *self, const gchar *name);
+
 void tp_tests_contacts_connection_change_aliases (
     TpTestsContactsConnection *self, guint n,
     const TpHandle *handles, const gchar * const *aliases);
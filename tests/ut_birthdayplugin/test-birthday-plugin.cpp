@@ -34,6 +34,8 @@
 #include <QContactBirthday>
 #include <QContactName>
 
+#include <QtDBus>
+
 using namespace ML10N;
 
 // A random ID, from plugins/birthday/cdbirthdaycalendar.cpp.
@@ -226,6 +228,104 @@ void TestBirthdayPlugin::testChangeName()
     QVERIFY2(storage->close(), "Error closing the calendar");
 }
 
+void TestBirthdayPlugin::testExternalEventRemoval()
+{
+    const QString contactID = QUuid::createUuid().toString();
+    const QDateTime contactBirthDate = QDateTime::currentDateTime();
+
+    // Add contact with birthday to tracker.
+    QContactName contactName;
+    contactName.setFirstName(contactID);
+    QContactBirthday contactBirthday;
+    contactBirthday.setDateTime(contactBirthDate);
+    QContact contact;
+    QVERIFY(contact.saveDetail(&contactName));
+    QVERIFY(contact.saveDetail(&contactBirthday));
+    QVERIFY2(saveContact(contact), "Error saving contact to tracker");
+
+    // Wait until calendar event gets to calendar.
+    loopWait(calendarTimeout);
+
+    // Open calendar database.
+    mKCal::ExtendedCalendar::Ptr calendar =
+        mKCal::ExtendedCalendar::Ptr(new mKCal::ExtendedCalendar(KDateTime::Spec::LocalZone()));
+    mKCal::ExtendedStorage::Ptr storage =
+        mKCal::ExtendedCalendar::defaultStorage(calendar);
+    storage->open();
+    QVERIFY2(not storage->notebook(calNotebookId).isNull(), "No calendar database found");
+
+    // Remove the event behind the plugin's back.
+    QVERIFY2(storage->loadNotebookIncidences(calNotebookId), "Unable to load events from notebook");
+    KCalCore::Event::List eventList = findCalendarEvents(calendar->events(), contact);
+    QCOMPARE(eventList.count(), 1);
+    QVERIFY(calendar->deleteEvent(eventList.first()));
+    QVERIFY2(storage->save(), "Unable to remove event from calendar");
+
+    // Leave the time to notice the external modification
+    loopWait(1000);
+
+    // Change the contact; the plugin must not update its stale copy of the removed event.
+    contactBirthday.setDateTime(contactBirthDate.addDays(-3));
+    QVERIFY(contact.saveDetail(&contactBirthday));
+    QVERIFY2(saveContact(contact), "Unable to update test contact in tracker");
+
+    // Wait until calendar event gets to calendar.
+    loopWait(calendarTimeout);
+
+    // Search for the recreated event in the calendar.
+    calendar->close();
+    QVERIFY2(storage->loadNotebookIncidences(calNotebookId), "Unable to load events from notebook");
+    eventList = calendar->events();
+    QCOMPARE(countCalendarEvents(eventList, contact), 1);
+
+    // Close the calendar.
+    QVERIFY2(storage->close(), "Error closing the calendar");
+}
+
+void TestBirthdayPlugin::testAddBirthdayToContact()
+{
+    const QString contactID = QUuid::createUuid().toString();
+    const QDateTime contactBirthDate = QDateTime::currentDateTime();
+
+    // Add contact without birthday to tracker, and change it repeatedly.
+    QContactName contactName;
+    contactName.setFirstName(contactID);
+    QContact contact;
+    QVERIFY(contact.saveDetail(&contactName));
+    QVERIFY2(saveContact(contact), "Error saving contact to tracker");
+
+    for (int i = 0; i < 10; ++i) {
+        contactName.setLastName(QString::number(i));
+        QVERIFY(contact.saveDetail(&contactName));
+        QVERIFY2(saveContact(contact), "Unable to update test contact in tracker");
+    }
+
+    // Now give it a birthday; the plugin does not know the contact yet.
+    QContactBirthday contactBirthday;
+    contactBirthday.setDateTime(contactBirthDate);
+    QVERIFY(contact.saveDetail(&contactBirthday));
+    QVERIFY2(saveContact(contact), "Unable to update test contact in tracker");
+    contact = mManager->contact(apiId(contact));
+
+    // Wait until calendar event gets to calendar.
+    loopWait(calendarTimeout);
+
+    // Open calendar database.
+    mKCal::ExtendedCalendar::Ptr calendar =
+        mKCal::ExtendedCalendar::Ptr(new mKCal::ExtendedCalendar(KDateTime::Spec::LocalZone()));
+    mKCal::ExtendedStorage::Ptr storage =
+        mKCal::ExtendedCalendar::defaultStorage(calendar);
+    storage->open();
+    QVERIFY2(not storage->notebook(calNotebookId).isNull(), "No calendar database found");
+
+    // Check calendar database for contact.
+    QVERIFY2(storage->loadNotebookIncidences(calNotebookId), "Unable to load events from notebook");
+    QCOMPARE(countCalendarEvents(calendar->events(), contact), 1);
+
+    // Close the calendar.
+    QVERIFY2(storage->close(), "Error closing the calendar");
+}
+
 void TestBirthdayPlugin::testLocaleChange()
 {
     // Is this the infrastructure for this tets still available?
@@ -331,6 +431,62 @@ void TestBirthdayPlugin::testLeapYears()
     }
 }
 
+void TestBirthdayPlugin::testUpcomingBirthdays_data()
+{
+    QTest::addColumn<QDate>("contactBirthDate");
+    QTest::addColumn<QDate>("fromDate");
+    QTest::addColumn<QDate>("nextOccurrence");
+    QTest::newRow("same-day") << QDate(2008, 6, 1) << QDate(2015, 6, 1) << QDate(2015, 6, 1);
+    QTest::newRow("next-year") << QDate(2008, 1, 10) << QDate(2015, 6, 1) << QDate(2016, 1, 10);
+    QTest::newRow("leap-day") << QDate(2008, 2, 29) << QDate(2015, 2, 1) << QDate(2015, 2, 28);
+    QTest::newRow("leap-day-in-leap-year") << QDate(2008, 2, 29) << QDate(2016, 2, 1) << QDate(2016, 2, 29);
+    QTest::newRow("leap-day-passed") << QDate(2008, 2, 29) << QDate(2015, 3, 1) << QDate(2016, 2, 29);
+}
+
+void TestBirthdayPlugin::testUpcomingBirthdays()
+{
+    const QString contactID = QUuid::createUuid().toString();
+    QFETCH(QDate, contactBirthDate);
+    QFETCH(QDate, fromDate);
+    QFETCH(QDate, nextOccurrence);
+
+    // Add contact with birthday to tracker.
+    QContactName contactName;
+    contactName.setFirstName(contactID);
+    QContactBirthday contactBirthday;
+    contactBirthday.setDate(contactBirthDate);
+    QContact contact;
+    QVERIFY(contact.saveDetail(&contactName));
+    QVERIFY(contact.saveDetail(&contactBirthday));
+    QVERIFY(saveContact(contact));
+
+    // Wait until calendar event gets to calendar.
+    loopWait(calendarTimeout);
+
+    QDBusInterface birthdays(QLatin1String("com.nokia.contactsd"), QLatin1String("/birthdays"),
+                             QLatin1String("com.nokia.contacts.birthdays"));
+    QDBusReply<QVariantList> reply = birthdays.call(QLatin1String("upcomingBirthdays"),
+                                                    fromDate.toString(Qt::ISODate), uint(10000));
+    QVERIFY2(reply.isValid(), qPrintable(reply.error().message()));
+
+    // Results are ordered by next occurrence, starting at the requested date
+    QDate previous = fromDate;
+    int matches = 0;
+    Q_FOREACH (const QVariant &value, reply.value()) {
+        const QVariantMap entry = qdbus_cast<QVariantMap>(value);
+        const QDate occurrence = QDate::fromString(entry.value(QLatin1String("nextOccurrence")).toString(), Qt::ISODate);
+        QVERIFY(occurrence >= previous);
+        previous = occurrence;
+
+        if (entry.value(QLatin1String("displayLabel")).toString() == contactID) {
+            QCOMPARE(QDate::fromString(entry.value(QLatin1String("birthday")).toString(), Qt::ISODate), contactBirthDate);
+            QCOMPARE(occurrence, nextOccurrence);
+            ++matches;
+        }
+    }
+    QCOMPARE(matches, 1);
+}
+
 void TestBirthdayPlugin::cleanupTestCase()
 {
 }
@@ -53,11 +53,16 @@ private Q_SLOTS:
     void testAddAndRemoveBirthday();
     void testChangeBirthday();
     void testChangeName();
+    void testExternalEventRemoval();
+    void testAddBirthdayToContact();
     void testLocaleChange();
 
     void testLeapYears_data();
     void testLeapYears();
 
+    void testUpcomingBirthdays_data();
+    void testUpcomingBirthdays();
+
     void cleanupTestCase();
     void cleanup();
 
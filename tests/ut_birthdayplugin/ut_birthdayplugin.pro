@@ -31,7 +31,7 @@ include(tests.pri)
 CONFIG += test link_pkgconfig
 
 QT -= gui
-QT += testlib
+QT += testlib dbus
 DEFINES += ENABLE_DEBUG
 
 PKGCONFIG += Qt5Contacts
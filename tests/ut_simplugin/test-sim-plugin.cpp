@@ -17,6 +17,8 @@
 
 #include <test-common.h>
 
+#include <base-plugin.h>
+
 #include <QContactDetailFilter>
 #include <QContactNickname>
 #include <QContactPhoneNumber>
@@ -440,6 +442,146 @@ void TestSimPlugin::testClear()
     QCOMPARE(simContacts.count(), 0);
 }
 
+void TestSimPlugin::testSnapshot()
+{
+    QContactManager &m(m_controller->contactManager());
+
+    QCOMPARE(getAllSimContacts(m).count(), 0);
+    QCOMPARE(m_controller->busy(), false);
+
+    const QString gumpData(QStringLiteral(
+"BEGIN:VCARD\n"
+"VERSION:3.0\n"
+"FN:Forrest Gump\n"
+"TEL;TYPE=HOME,VOICE:(404) 555-1212\n"
+"END:VCARD\n"));
+
+    // Sync a SIM with a known card identifier, which stores a snapshot
+    m_controller->cardIdentifierChanged(QStringLiteral("8935800000000000001"));
+    m_controller->simPresenceChanged(true);
+    m_controller->vcardDataAvailable(gumpData);
+    QTRY_VERIFY(m_controller->busy() == false);
+
+    QList<QContact> simContacts(getAllSimContacts(m));
+    QCOMPARE(simContacts.count(), 1);
+
+    // Modify the stored contact without the controller knowing
+    QContact gump(simContacts.at(0));
+    QContactPhoneNumber number(gump.detail<QContactPhoneNumber>());
+    QVERIFY(gump.removeDetail(&number));
+    QVERIFY(m.saveContact(&gump));
+
+    // Re-reading the same phonebook matches the snapshot, so the store is not touched
+    m_controller->vcardDataAvailable(gumpData);
+    QCOMPARE(m_controller->busy(), false);
+
+    simContacts = getAllSimContacts(m);
+    QCOMPARE(simContacts.count(), 1);
+    QCOMPARE(simContacts.at(0).details<QContactPhoneNumber>().count(), 0);
+
+    // A changed phonebook only updates the entries that differ from the snapshot
+    m_controller->vcardDataAvailable(gumpData + QStringLiteral(
+"BEGIN:VCARD\n"
+"VERSION:3.0\n"
+"FN:Forrest Whittaker\n"
+"TEL;TYPE=HOME,VOICE:(404) 555-1234\n"
+"END:VCARD\n"));
+    QCOMPARE(m_controller->busy(), true);
+    QTRY_VERIFY(m_controller->busy() == false);
+
+    simContacts = getAllSimContacts(m);
+    QCOMPARE(simContacts.count(), 2);
+    foreach (const QContact &contact, simContacts) {
+        if (contact.detail<QContactNickname>().nickname() == QStringLiteral("Forrest Gump")) {
+            QCOMPARE(contact.id(), gump.id());
+            QCOMPARE(contact.details<QContactPhoneNumber>().count(), 0);
+        } else {
+            QCOMPARE(contact.detail<QContactNickname>().nickname(), QStringLiteral("Forrest Whittaker"));
+            QCOMPARE(contact.detail<QContactPhoneNumber>().number(), QStringLiteral("(404) 555-1234"));
+        }
+    }
+}
+
+void TestSimPlugin::testLargePhonebook()
+{
+    QContactManager &m(m_controller->contactManager());
+
+    QCOMPARE(getAllSimContacts(m).count(), 0);
+    QCOMPARE(m_controller->busy(), false);
+
+    // Enough entries to be imported in several chunks
+    const int count = 180;
+    QString vcardData;
+    for (int i = 0; i < count; ++i) {
+        vcardData += QStringLiteral("BEGIN:VCARD\n"
+                                    "VERSION:3.0\n"
+                                    "FN:Contact %1\n"
+                                    "TEL;TYPE=HOME,VOICE:(404) 555-%2\n"
+                                    "END:VCARD\n").arg(i).arg(1000 + i);
+    }
+
+    m_controller->simPresenceChanged(true);
+    m_controller->vcardDataAvailable(vcardData);
+    QCOMPARE(m_controller->busy(), true);
+    QTRY_VERIFY(m_controller->busy() == false);
+
+    QList<QContact> simContacts(getAllSimContacts(m));
+    QCOMPARE(simContacts.count(), count);
+
+    QSet<QContactId> existingIds;
+    foreach (const QContact &contact, simContacts) {
+        existingIds.insert(contact.id());
+    }
+
+    // Drop the first entry; the others must be kept rather than recreated
+    vcardData = vcardData.mid(vcardData.indexOf(QStringLiteral("BEGIN:VCARD"), 1));
+
+    m_controller->vcardDataAvailable(vcardData);
+    QCOMPARE(m_controller->busy(), true);
+    QTRY_VERIFY(m_controller->busy() == false);
+
+    simContacts = getAllSimContacts(m);
+    QCOMPARE(simContacts.count(), count - 1);
+    foreach (const QContact &contact, simContacts) {
+        QVERIFY(existingIds.contains(contact.id()));
+        QVERIFY(contact.detail<QContactNickname>().nickname() != QStringLiteral("Contact 0"));
+    }
+}
+
+void TestSimPlugin::testRemoveDuringImport()
+{
+    QContactManager &m(m_controller->contactManager());
+
+    QCOMPARE(getAllSimContacts(m).count(), 0);
+    QCOMPARE(m_controller->busy(), false);
+
+    const int count = 500;
+    QString vcardData;
+    for (int i = 0; i < count; ++i) {
+        vcardData += QStringLiteral("BEGIN:VCARD\n"
+                                    "VERSION:3.0\n"
+                                    "FN:Contact %1\n"
+                                    "TEL;TYPE=HOME,VOICE:(404) 555-%2\n"
+                                    "END:VCARD\n").arg(i).arg(1000 + i);
+    }
+
+    m_controller->simPresenceChanged(true);
+    m_controller->vcardDataAvailable(vcardData);
+    QCOMPARE(m_controller->busy(), true);
+
+    // Remove the SIM once the first chunks are being stored
+    QTRY_VERIFY(getAllSimContacts(m).count() > 0);
+    m_controller->simPresenceChanged(false);
+    QCOMPARE(m_controller->busy(), true);
+    QTRY_VERIFY(m_controller->busy() == false);
+
+    // Nothing stored by the abandoned import may be left behind
+    QCOMPARE(getAllSimContacts(m).count(), 0);
+    QTest::qWait(100);
+    QCOMPARE(m_controller->busy(), false);
+    QCOMPARE(getAllSimContacts(m).count(), 0);
+}
+
 void TestSimPlugin::cleanupTestCase()
 {
 }
@@ -451,6 +593,13 @@ void TestSimPlugin::cleanup()
     foreach (const QContact &contact, getAllSimContacts(m)) {
         QVERIFY(m.removeContact(contact.id()));
     }
+
+    // Snapshots no longer match the store
+    m_controller->cardIdentifierChanged(QString());
+    QDir cacheDir(Contactsd::BasePlugin::cacheDir());
+    foreach (const QString &fileName, cacheDir.entryList(QStringList() << QStringLiteral("sim-*.snapshot"), QDir::Files)) {
+        cacheDir.remove(fileName);
+    }
 }
 
 CONTACTSD_TEST_MAIN(TestSimPlugin)
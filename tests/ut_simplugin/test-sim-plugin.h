@@ -41,6 +41,9 @@ private Q_SLOTS:
     void testMultipleNumbers();
     void testEmpty();
     void testClear();
+    void testSnapshot();
+    void testLargePhonebook();
+    void testRemoveDuringImport();
 
     void cleanupTestCase();
     void cleanup();
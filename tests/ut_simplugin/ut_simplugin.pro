@@ -18,10 +18,14 @@ INCLUDEPATH += \
 
 HEADERS += \
     test-sim-plugin.h \
-    ../../plugins/sim/cdsimcontroller.h
+    ../../plugins/sim/cdsimcontroller.h \
+    ../../src/base-plugin.h \
+    ../../src/debug.h
 
 SOURCES += \
     test-sim-plugin.cpp \
-    ../../plugins/sim/cdsimcontroller.cpp
+    ../../plugins/sim/cdsimcontroller.cpp \
+    ../../src/base-plugin.cpp \
+    ../../src/debug.cpp
 
 INSTALLS += target
@@ -28,6 +28,7 @@
 #include <QContactSaveRequest>
 #include <QContactSyncTarget>
 #include <QContactOnlineAccount>
+#include <QElapsedTimer>
 #ifdef USING_QTPIM
 #include <QContactIdFilter>
 #include <QContactIdFetchRequest>
@@ -52,7 +53,7 @@ const int QContactOnlineAccount__FieldAccountPath = (QContactOnlineAccount::Fiel
 #endif
 
 TestTelepathyPlugin::TestTelepathyPlugin(QObject *parent) : Test(parent),
-        mNOnlyLocalContacts(0), mCheckLeakedResources(true)
+        mNOnlyLocalContacts(0), mChangeNotifications(0), mCheckLeakedResources(true)
 {
 }
 
@@ -472,6 +473,49 @@ void TestTelepathyPlugin::testRemoveBuddyDBusAPI()
     // buddy2 gets removed from roster
 }
 
+void TestTelepathyPlugin::testRemoveBuddiesBatchDBusAPI()
+{
+    const char *buddy1 = "batchremovebuddy1";
+    TpHandle handle1;
+    TestExpectationContactPtr exp1 = createContact(buddy1, handle1);
+
+    const char *buddy2 = "batchremovebuddy2";
+    TpHandle handle2;
+    TestExpectationContactPtr exp2 = createContact(buddy2, handle2);
+
+    const QString unknownAccount = QLatin1String("/org/freedesktop/Telepathy/Account/fakecm/fakeproto/unknown");
+
+    QVariantMap requests;
+    requests.insert(ACCOUNT_PATH, QStringList() << buddy1 << buddy2);
+    requests.insert(unknownAccount, QStringList() << buddy1);
+
+    // The reply is only sent once the removal has finished on the server
+    BuddyManagementInterface *buddyIf = new BuddyManagementInterface("com.nokia.contactsd", "/telepathy", QDBusConnection::sessionBus(), 0);
+    QDBusPendingReply<QVariantMap> async = buddyIf->removeBuddiesBatch(requests);
+    QDBusPendingCallWatcher watcher(async, this);
+    watcher.waitForFinished();
+    QVERIFY2(not async.isError(), async.error().message().toLatin1());
+
+    const QVariantMap results = async.value();
+    QCOMPARE(results.count(), 2);
+
+    const QVariantMap accountResults = qdbus_cast<QVariantMap>(results.value(ACCOUNT_PATH));
+    QCOMPARE(accountResults.count(), 2);
+    QCOMPARE(accountResults.value(buddy1).toString(), QString());
+    QCOMPARE(accountResults.value(buddy2).toString(), QString());
+
+    const QVariantMap unknownResults = qdbus_cast<QVariantMap>(results.value(unknownAccount));
+    QCOMPARE(unknownResults.value(buddy1).toString(), QString::fromLatin1("unknownAccount"));
+
+    int removed = 2;
+#ifdef USING_QTPIM
+    removed *= 2; // Two contacts for each logical entity
+#endif
+    runExpectation(TestExpectationMassPtr(new TestExpectationMass(0, 0, removed)));
+
+    delete buddyIf;
+}
+
 void TestTelepathyPlugin::testInviteBuddyDBusAPI()
 {
     const QString buddy("invitebuddy");
@@ -817,7 +861,12 @@ void TestTelepathyPlugin::testBenchmark()
 #endif
     runExpectation(TestExpectationMassPtr(new TestExpectationMass(added, 0, 0)));
 
-    /* Set account offline */
+    /* Set account offline; the account sync is committed in one backend
+     * transaction per change set, not one per batch of contacts */
+    QElapsedTimer timer;
+    timer.start();
+    mChangeNotifications = 0;
+
     tp_cli_connection_call_disconnect(mConnection, -1, NULL, NULL, NULL, NULL);
 
     int count = mContactIds.count();
@@ -825,6 +874,9 @@ void TestTelepathyPlugin::testBenchmark()
     count *= 2; // Two contacts for each logical entity
 #endif
     runExpectation(TestExpectationDisconnectPtr(new TestExpectationDisconnect(count)));
+
+    qDebug() << "Account sync of" << N_CONTACTS << "contacts:" << timer.elapsed() << "ms,"
+             << mChangeNotifications << "change notifications";
 }
 
 TpHandle TestTelepathyPlugin::ensureHandle(const gchar *id)
@@ -896,6 +948,7 @@ void TestTelepathyPlugin::contactsAdded(const QList<ContactIdType>& contactIds)
 void TestTelepathyPlugin::contactsChanged(const QList<ContactIdType>& contactIds)
 {
     debug() << "Got contactsChanged";
+    mChangeNotifications++;
     Q_FOREACH (const ContactIdType &id, contactIds) {
         if (!mContactIds.contains(id)) {
             warning() << "Unknown contact ID changed:" << id;
@@ -90,6 +90,7 @@ private Q_SLOTS:
     void testContactPhoneNumber();
     void testRemoveContacts();
     void testRemoveBuddyDBusAPI();
+    void testRemoveBuddiesBatchDBusAPI();
     void testInviteBuddyDBusAPI();
     void testSetOffline();
     void testAvatar();
@@ -127,6 +128,7 @@ private:
 
     QList<ContactIdType> mContactIds;
     int mNOnlyLocalContacts;
+    int mChangeNotifications;
 
     TestExpectationPtr mExpectation;
 
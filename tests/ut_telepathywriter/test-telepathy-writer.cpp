@@ -0,0 +1,302 @@
+/** This file is part of Contacts daemon
+ **
+ ** Copyright (c) 2010-2011 Nokia Corporation and/or its subsidiary(-ies).
+ **
+ ** Contact:  Nokia Corporation (info@qt.nokia.com)
+ **
+ ** GNU Lesser General Public License Usage
+ ** This file may be used under the terms of the GNU Lesser General Public License
+ ** version 2.1 as published by the Free Software Foundation and appearing in the
+ ** file LICENSE.LGPL included in the packaging of this file.  Please review the
+ ** following information to ensure the GNU Lesser General Public License version
+ ** 2.1 requirements will be met:
+ ** http://www.gnu.org/licenses/old-licenses/lgpl-2.1.html.
+ **
+ ** In addition, as a special exception, Nokia gives you certain additional rights.
+ ** These rights are described in the Nokia Qt LGPL Exception version 1.1, included
+ ** in the file LGPL_EXCEPTION.txt in this package.
+ **
+ ** Other Usage
+ ** Alternatively, this file may be used in accordance with the terms and
+ ** conditions contained in a signed written agreement between you and Nokia.
+ **/
+
+#include "test-telepathy-writer.h"
+
+#include <test-common.h>
+
+#include <QContactOnlineAccount>
+#include <QContactPresence>
+
+#include <QDateTime>
+#include <QFile>
+#include <QSqlQuery>
+
+#include "cdtpsqlitewriter.h"
+
+namespace {
+
+// The subset of the qtcontacts-sqlite schema touched by the writer
+const char *schema[] = {
+    "CREATE TABLE Details (detailId INTEGER PRIMARY KEY ASC, contactId INTEGER, detail TEXT, provenance TEXT)",
+    "CREATE INDEX DetailsContactIdIndex ON Details(contactId)",
+    "CREATE INDEX DetailsProvenanceIndex ON Details(provenance)",
+    "CREATE TABLE Presences (detailId INTEGER PRIMARY KEY ASC, contactId INTEGER, presenceState INTEGER, timestamp DATETIME, nickname TEXT, customMessage TEXT)",
+    "CREATE TABLE GlobalPresences (contactId INTEGER PRIMARY KEY ASC, presenceState INTEGER, timestamp DATETIME, nickname TEXT, customMessage TEXT)",
+    "CREATE TABLE OnlineAccounts (detailId INTEGER PRIMARY KEY ASC, contactId INTEGER, accountUri TEXT, capabilities TEXT)",
+    "CREATE TABLE Relationships (firstId INTEGER, secondId INTEGER, type TEXT)",
+    0
+};
+
+// Aggregate contacts and their detail copies are numbered after the constituents
+const quint32 aggregateOffset = 1000000;
+
+#ifdef USING_QTPIM
+QContactId contactId(quint32 id)
+{
+    static const QString idStr(QStringLiteral("qtcontacts:org.nemomobile.contacts.sqlite::sql-%1"));
+    return QContactId::fromString(idStr.arg(id));
+}
+#endif
+
+}
+
+TestTelepathyWriter::TestTelepathyWriter(QObject *parent)
+    : QObject(parent)
+{
+}
+
+void TestTelepathyWriter::initTestCase()
+{
+    QVERIFY(mDir.isValid());
+    mDatabasePath = mDir.path() + QStringLiteral("/contacts.db");
+}
+
+void TestTelepathyWriter::init()
+{
+    mDatabase = QSqlDatabase::addDatabase(QStringLiteral("QSQLITE"), QStringLiteral("fixture"));
+    mDatabase.setDatabaseName(mDatabasePath);
+    QVERIFY(mDatabase.open());
+
+    for (const char **statement = schema; *statement; ++statement) {
+        QSqlQuery query(mDatabase);
+        QVERIFY(query.exec(QString::fromLatin1(*statement)));
+    }
+}
+
+void TestTelepathyWriter::populate(int count, int aggregated)
+{
+    QVERIFY(mDatabase.transaction());
+
+    QSqlQuery details(mDatabase);
+    QSqlQuery presences(mDatabase);
+    QSqlQuery globalPresences(mDatabase);
+    QSqlQuery accounts(mDatabase);
+    QSqlQuery relationships(mDatabase);
+    QVERIFY(details.prepare(QStringLiteral("INSERT INTO Details VALUES (?, ?, ?, ?)")));
+    QVERIFY(presences.prepare(QStringLiteral("INSERT INTO Presences VALUES (?, ?, 0, NULL, '', '')")));
+    QVERIFY(globalPresences.prepare(QStringLiteral("INSERT INTO GlobalPresences VALUES (?, 0, NULL, '', '')")));
+    QVERIFY(accounts.prepare(QStringLiteral("INSERT INTO OnlineAccounts VALUES (?, ?, ?, '')")));
+    QVERIFY(relationships.prepare(QStringLiteral("INSERT INTO Relationships VALUES (?, ?, 'Aggregates')")));
+
+    for (int i = 1; i <= count; ++i) {
+        const bool aggregate = (i <= aggregated);
+        const quint32 ids[] = { quint32(i), quint32(i) + aggregateOffset };
+
+        for (int n = 0; n < (aggregate ? 2 : 1); ++n) {
+            const quint32 presenceId = 2 * i - 1 + (n ? aggregateOffset : 0);
+            const quint32 accountId = 2 * i + (n ? aggregateOffset : 0);
+            const QString presenceProvenance(n ? QStringLiteral("%1:Presence:%2").arg(i).arg(2 * i - 1) : QString());
+            const QString accountProvenance(n ? QStringLiteral("%1:OnlineAccount:%2").arg(i).arg(2 * i) : QString());
+
+            details.addBindValue(presenceId);
+            details.addBindValue(ids[n]);
+            details.addBindValue(QStringLiteral("Presence"));
+            details.addBindValue(presenceProvenance);
+            QVERIFY(details.exec());
+            details.addBindValue(accountId);
+            details.addBindValue(ids[n]);
+            details.addBindValue(QStringLiteral("OnlineAccount"));
+            details.addBindValue(accountProvenance);
+            QVERIFY(details.exec());
+
+            presences.addBindValue(presenceId);
+            presences.addBindValue(ids[n]);
+            QVERIFY(presences.exec());
+            globalPresences.addBindValue(ids[n]);
+            QVERIFY(globalPresences.exec());
+            accounts.addBindValue(accountId);
+            accounts.addBindValue(ids[n]);
+            accounts.addBindValue(QStringLiteral("contact%1@example.com").arg(i));
+            QVERIFY(accounts.exec());
+        }
+
+        if (aggregate) {
+            relationships.addBindValue(ids[1]);
+            relationships.addBindValue(ids[0]);
+            QVERIFY(relationships.exec());
+        }
+    }
+
+    QVERIFY(mDatabase.commit());
+}
+
+QContact TestTelepathyWriter::makeContact(quint32 id, int presenceState, const QString &message) const
+{
+    QContact contact;
+#ifdef USING_QTPIM
+    contact.setId(contactId(id));
+#else
+    QContactId contactId;
+    contactId.setLocalId(id);
+    contact.setId(contactId);
+#endif
+
+    QContactPresence presence;
+    presence.setPresenceState(static_cast<QContactPresence::PresenceState>(presenceState));
+    presence.setTimestamp(QDateTime::currentDateTime());
+    presence.setNickname(QStringLiteral("Contact %1").arg(id));
+    presence.setCustomMessage(message);
+    contact.saveDetail(&presence);
+
+    QContactOnlineAccount qcoa;
+    qcoa.setAccountUri(QStringLiteral("contact%1@example.com").arg(id));
+    qcoa.setCapabilities(QStringList() << QStringLiteral("text") << QStringLiteral("audio"));
+    contact.saveDetail(&qcoa);
+
+    return contact;
+}
+
+QVariant TestTelepathyWriter::value(const QString &statement) const
+{
+    QSqlQuery query(mDatabase);
+    if (!query.exec(statement) || !query.next()) {
+        return QVariant();
+    }
+    return query.value(0);
+}
+
+void TestTelepathyWriter::testInvalidSchema()
+{
+    QSqlQuery query(mDatabase);
+    QVERIFY(query.exec(QStringLiteral("DROP TABLE Presences")));
+
+    CDTpSqliteWriter writer(mDatabasePath);
+    QVERIFY(!writer.isValid());
+    QVERIFY(!writer.updateContacts(QList<QContact>() << makeContact(1, QContactPresence::PresenceAvailable, QString()),
+                                   CDTpSqliteWriter::Presence));
+
+    // A missing database is never created
+    CDTpSqliteWriter missing(mDir.path() + QStringLiteral("/missing.db"));
+    QVERIFY(!missing.isValid());
+    QVERIFY(!QFile::exists(mDir.path() + QStringLiteral("/missing.db")));
+}
+
+void TestTelepathyWriter::testUpdatePresence()
+{
+    populate(3, 1);
+
+    CDTpSqliteWriter writer(mDatabasePath);
+    QVERIFY(writer.isValid());
+
+    QList<QContact> contacts;
+    contacts << makeContact(1, QContactPresence::PresenceAvailable, QStringLiteral("Hello"))
+             << makeContact(2, QContactPresence::PresenceBusy, QStringLiteral("Busy"));
+    QVERIFY(writer.updateContacts(contacts, CDTpSqliteWriter::Presence));
+
+    QCOMPARE(value(QStringLiteral("SELECT presenceState FROM Presences WHERE contactId = 1")).toInt(), int(QContactPresence::PresenceAvailable));
+    QCOMPARE(value(QStringLiteral("SELECT customMessage FROM Presences WHERE contactId = 1")).toString(), QStringLiteral("Hello"));
+    QCOMPARE(value(QStringLiteral("SELECT presenceState FROM Presences WHERE contactId = 2")).toInt(), int(QContactPresence::PresenceBusy));
+    QCOMPARE(value(QStringLiteral("SELECT nickname FROM GlobalPresences WHERE contactId = 2")).toString(), QStringLiteral("Contact 2"));
+    QVERIFY(!value(QStringLiteral("SELECT timestamp FROM Presences WHERE contactId = 2")).toString().isEmpty());
+
+    // The aggregate's copy follows its constituent
+    QCOMPARE(value(QStringLiteral("SELECT customMessage FROM Presences WHERE contactId = %1").arg(1 + aggregateOffset)).toString(), QStringLiteral("Hello"));
+
+    // Untouched contacts and details are left alone
+    QCOMPARE(value(QStringLiteral("SELECT presenceState FROM Presences WHERE contactId = 3")).toInt(), 0);
+    QCOMPARE(value(QStringLiteral("SELECT capabilities FROM OnlineAccounts WHERE contactId = 1")).toString(), QString());
+}
+
+void TestTelepathyWriter::testUpdateCapabilities()
+{
+    populate(2, 2);
+
+    CDTpSqliteWriter writer(mDatabasePath);
+    QVERIFY(writer.isValid());
+
+    QVERIFY(writer.updateContacts(QList<QContact>() << makeContact(2, QContactPresence::PresenceAway, QString()),
+                                  CDTpSqliteWriter::Capabilities));
+
+    QCOMPARE(value(QStringLiteral("SELECT capabilities FROM OnlineAccounts WHERE contactId = 2")).toString(), QStringLiteral("text;audio"));
+    QCOMPARE(value(QStringLiteral("SELECT capabilities FROM OnlineAccounts WHERE contactId = %1").arg(2 + aggregateOffset)).toString(), QStringLiteral("text;audio"));
+    QCOMPARE(value(QStringLiteral("SELECT capabilities FROM OnlineAccounts WHERE contactId = 1")).toString(), QString());
+    QCOMPARE(value(QStringLiteral("SELECT presenceState FROM Presences WHERE contactId = 2")).toInt(), 0);
+}
+
+void TestTelepathyWriter::testMissingDetail()
+{
+    populate(2, 0);
+
+    CDTpSqliteWriter writer(mDatabasePath);
+    QVERIFY(writer.isValid());
+
+    // Contact 3 has no rows, so the whole batch must be rolled back for the manager to handle
+    QList<QContact> contacts;
+    contacts << makeContact(1, QContactPresence::PresenceAvailable, QStringLiteral("Hello"))
+             << makeContact(3, QContactPresence::PresenceAvailable, QStringLiteral("Hello"));
+    QVERIFY(!writer.updateContacts(contacts, CDTpSqliteWriter::Presence | CDTpSqliteWriter::Capabilities));
+
+    QCOMPARE(value(QStringLiteral("SELECT presenceState FROM Presences WHERE contactId = 1")).toInt(), 0);
+    QCOMPARE(value(QStringLiteral("SELECT customMessage FROM Presences WHERE contactId = 1")).toString(), QString());
+
+    // The writer remains usable afterwards
+    QVERIFY(writer.updateContacts(contacts.mid(0, 1), CDTpSqliteWriter::Presence));
+    QCOMPARE(value(QStringLiteral("SELECT customMessage FROM Presences WHERE contactId = 1")).toString(), QStringLiteral("Hello"));
+}
+
+void TestTelepathyWriter::testAggregateGlobalPresence()
+{
+    populate(2, 1);
+
+    // Make the aggregate of contact 1 also aggregate contact 2
+    const quint32 aggregateId = 1 + aggregateOffset;
+    QSqlQuery query(mDatabase);
+    QVERIFY(query.exec(QStringLiteral("INSERT INTO Details VALUES (%1, %2, 'Presence', '2:Presence:3')").arg(3 + aggregateOffset).arg(aggregateId)));
+    QVERIFY(query.exec(QStringLiteral("INSERT INTO Presences VALUES (%1, %2, 0, NULL, '', '')").arg(3 + aggregateOffset).arg(aggregateId)));
+    QVERIFY(query.exec(QStringLiteral("INSERT INTO Relationships VALUES (%1, 2, 'Aggregates')").arg(aggregateId)));
+
+    CDTpSqliteWriter writer(mDatabasePath);
+    QVERIFY(writer.isValid());
+
+    // The most available constituent presence becomes the global presence of the aggregate
+    QList<QContact> contacts;
+    contacts << makeContact(1, QContactPresence::PresenceAway, QStringLiteral("Away"))
+             << makeContact(2, QContactPresence::PresenceAvailable, QStringLiteral("Hello"));
+    QVERIFY(writer.updateContacts(contacts, CDTpSqliteWriter::Presence));
+
+    const QString globalPresence(QStringLiteral("SELECT %1 FROM GlobalPresences WHERE contactId = %2"));
+    QCOMPARE(value(globalPresence.arg(QStringLiteral("presenceState")).arg(aggregateId)).toInt(), int(QContactPresence::PresenceAvailable));
+    QCOMPARE(value(globalPresence.arg(QStringLiteral("nickname")).arg(aggregateId)).toString(), QStringLiteral("Contact 2"));
+    QCOMPARE(value(globalPresence.arg(QStringLiteral("presenceState")).arg(1)).toInt(), int(QContactPresence::PresenceAway));
+
+    // Updating a single constituent still takes the other one into account
+    QVERIFY(writer.updateContacts(QList<QContact>() << makeContact(2, QContactPresence::PresenceOffline, QString()),
+                                  CDTpSqliteWriter::Presence));
+    QCOMPARE(value(globalPresence.arg(QStringLiteral("presenceState")).arg(aggregateId)).toInt(), int(QContactPresence::PresenceAway));
+    QCOMPARE(value(globalPresence.arg(QStringLiteral("customMessage")).arg(aggregateId)).toString(), QStringLiteral("Away"));
+}
+
+void TestTelepathyWriter::cleanup()
+{
+    mDatabase.close();
+    mDatabase = QSqlDatabase();
+    QSqlDatabase::removeDatabase(QStringLiteral("fixture"));
+    QFile::remove(mDatabasePath);
+}
+
+void TestTelepathyWriter::cleanupTestCase()
+{
+}
+
+CONTACTSD_TEST_MAIN(TestTelepathyWriter)
@@ -0,0 +1,70 @@
+/** This file is part of Contacts daemon
+ **
+ ** Copyright (c) 2010-2011 Nokia Corporation and/or its subsidiary(-ies).
+ **
+ ** Contact:  Nokia Corporation (info@qt.nokia.com)
+ **
+ ** GNU Lesser General Public License Usage
+ ** This file may be used under the terms of the GNU Lesser General Public License
+ ** version 2.1 as published by the Free Software Foundation and appearing in the
+ ** file LICENSE.LGPL included in the packaging of this file.  Please review the
+ ** following information to ensure the GNU Lesser General Public License version
+ ** 2.1 requirements will be met:
+ ** http://www.gnu.org/licenses/old-licenses/lgpl-2.1.html.
+ **
+ ** In addition, as a special exception, Nokia gives you certain additional rights.
+ ** These rights are described in the Nokia Qt LGPL Exception version 1.1, included
+ ** in the file LGPL_EXCEPTION.txt in this package.
+ **
+ ** Other Usage
+ ** Alternatively, this file may be used in accordance with the terms and
+ ** conditions contained in a signed written agreement between you and Nokia.
+ **/
+
+#ifndef TEST_TELEPATHY_WRITER_H
+#define TEST_TELEPATHY_WRITER_H
+
+#include <QObject>
+#include <QSqlDatabase>
+#include <QTemporaryDir>
+#include <QtTest/QtTest>
+
+#include <QContact>
+
+#ifdef USING_QTPIM
+QTCONTACTS_USE_NAMESPACE
+#else
+QTM_USE_NAMESPACE
+#endif
+
+class TestTelepathyWriter : public QObject
+{
+    Q_OBJECT
+
+public:
+    explicit TestTelepathyWriter(QObject *parent = 0);
+
+private Q_SLOTS:
+    void initTestCase();
+    void init();
+
+    void testInvalidSchema();
+    void testUpdatePresence();
+    void testUpdateCapabilities();
+    void testMissingDetail();
+    void testAggregateGlobalPresence();
+
+    void cleanup();
+    void cleanupTestCase();
+
+private:
+    void populate(int count, int aggregated);
+    QContact makeContact(quint32 contactId, int presenceState, const QString &message) const;
+    QVariant value(const QString &statement) const;
+
+    QTemporaryDir mDir;
+    QString mDatabasePath;
+    QSqlDatabase mDatabase;
+};
+
+#endif // TEST_TELEPATHY_WRITER_H
@@ -0,0 +1,29 @@
+include(../common/test-common.pri)
+
+TARGET = ut_telepathywriter
+target.path = /opt/tests/$${PACKAGENAME}/$$TARGET
+
+CONFIG += test link_pkgconfig
+
+QT -= gui
+QT += dbus sql testlib
+DEFINES += ENABLE_DEBUG
+
+PKGCONFIG += Qt5Contacts
+DEFINES *= USING_QTPIM
+
+INCLUDEPATH += \
+    ../../plugins/telepathy \
+    ../../src
+
+HEADERS += \
+    test-telepathy-writer.h \
+    ../../plugins/telepathy/cdtpsqlitewriter.h \
+    ../../src/debug.h
+
+SOURCES += \
+    test-telepathy-writer.cpp \
+    ../../plugins/telepathy/cdtpsqlitewriter.cpp \
+    ../../src/debug.cpp
+
+INSTALLS += target